@@ -35,9 +35,20 @@
 // custom err msg
 #define USAGE_EXIT() do { \
   fprintf(stderr, \
-"Usage %s init <peer: int> <successor 1: int> <successor 2: int> <ping: int>\n"\
-"      %s join <peer: int> <known peer: int> <ping: int>\n", \
-          arg_parser_argv[0], arg_parser_argv[0]); \
+"Usage %s init <peer: int> <successor 1: int> <successor 2: int> <ping: int> [options]\n"\
+"      %s join <peer: int> <known peer: int> <ping: int> [options]\n"\
+"      %s restart <peer: int> <ping: int> [options]\n"\
+"Options:\n"\
+"      --text-protocol  send msgs in the old text format\n"\
+"      --vnodes=<n: int>  tokens this peer claims on the hash ring (64)\n"\
+"      --replicas=<k: int>  peers every key is stored on (1)\n"\
+"      --successors=<r: int>  successors each peer keeps and pings (2)\n"\
+"      --stats-file=<path>  dump stats to path every ping interval\n"\
+"      --compress  have the files we retrieve compressed on the wire\n"\
+"      --cache-mb=<n: int>  keep copies of hot files we forward (64, 0 for off)\n"\
+"      --workers=<n: int>  threads sending files and working through batches\n"\
+"                          (one per core)\n", \
+          arg_parser_argv[0], arg_parser_argv[0], arg_parser_argv[0]); \
   exit(1); } while(0)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,709 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "key_store.h"
+#include "lz.h"
+#include "p2p_node.h"
+#include "p2p_peer.h"
+#include "ping.h"
+#include "tcp.h"
+#include "utils.h"
+
+/**                                                  **
+ * Microbenchmarks of the hot paths.                  *
+ *                                                    *
+ * Every benchmark is calibrated till a run lasts     *
+ * atleast min time then run a few times, each result *
+ * is one CSV row (or JSON object) so runs of         *
+ * different builds can be diffed.                    *
+ **                                                  **/
+
+#define BENCH_DEFAULT_RUNS (5)
+#define BENCH_DEFAULT_MIN_MS (200)
+#define BENCH_DEFAULT_MAX_BYTES (1 << 30)
+#define BENCH_MAX_RUNS (64)
+
+// peers far away from anything a test ring would use
+#define BENCH_SENDER (50001)
+#define BENCH_RECEIVER (50002)
+// never started, it only holds successors
+#define BENCH_ROUTER (50003)
+
+// keys held by the store we look up into
+#define BENCH_LOOKUP_KEYS (1 << 16)
+
+// a transfer that hasn't landed by now has failed
+#define BENCH_TRANSFER_TIMEOUT_SECS (120)
+
+#define BENCH_PATH_LEN (64)
+
+typedef struct bench_opts_t {
+  int json;
+  int runs;
+  int64_t min_ns;
+  int64_t max_bytes;
+  const char *filter;
+  // the sender pushes compressed transfers through io_uring
+  int io_uring;
+
+  // results go here, stdout is full of the modules' chatter
+  FILE *out;
+  int reported;
+} bench_opts;
+
+/*
+  Run iters operations, returns -1 if the benchmark failed.
+ */
+typedef int (*bench_fn)(void *arg, int64_t iters);
+
+static bench_opts opts = {
+  .runs = BENCH_DEFAULT_RUNS,
+  .min_ns = BENCH_DEFAULT_MIN_MS * 1000000LL,
+  .max_bytes = BENCH_DEFAULT_MAX_BYTES,
+};
+
+// stops the compiler throwing the work away
+static volatile int64_t bench_sink;
+
+static int64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+  How long iters operations take, -1 if they failed.
+ */
+static int64_t bench_time(bench_fn fn, void *arg, int64_t iters) {
+  int64_t start = bench_now_ns();
+  if (fn(arg, iters)) return -1;
+  return bench_now_ns() - start;
+}
+
+static int bench_cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_report(const char *name, int64_t iters, double ns_per_op,
+                         double min_ns_per_op, int64_t bytes_per_op) {
+  double ops_per_sec = ns_per_op > 0 ? 1e9 / ns_per_op : 0;
+  double mb_per_sec = bytes_per_op * ops_per_sec / (1 << 20);
+
+  if (opts.json) {
+    fprintf(opts.out,
+            "%s  {\"name\": \"%s\", \"iterations\": %lld, \"runs\": %d, "
+            "\"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, "
+            "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f}",
+            opts.reported ? ",\n" : "", name, (long long)iters, opts.runs,
+            ns_per_op, min_ns_per_op, ops_per_sec, mb_per_sec);
+  } else {
+    fprintf(opts.out, "%s,%lld,%d,%.1f,%.1f,%.1f,%.2f\n", name,
+            (long long)iters, opts.runs, ns_per_op, min_ns_per_op,
+            ops_per_sec, mb_per_sec);
+  }
+  fflush(opts.out);
+  opts.reported++;
+}
+
+/*
+  Calibrate, run and report a benchmark.
+  bytes_per_op is 0 for benchmarks that don't move data.
+ */
+static int bench_run(const char *name, bench_fn fn, void *arg,
+                     int64_t bytes_per_op) {
+  if (opts.filter && !strstr(name, opts.filter)) return 0;
+
+  // grow iters till a run lasts long enough, this doubles as the warm up
+  int64_t iters = 1;
+  for (;;) {
+    int64_t ns = bench_time(fn, arg, iters);
+    if (ns < 0) {
+      fprintf(stderr, "Error: %s failed\n", name);
+      return -1;
+    }
+    if (ns >= opts.min_ns) break;
+
+    int64_t next = ns ? iters * opts.min_ns / ns * 5 / 4 : iters * 100;
+    if (next > iters * 100) next = iters * 100;
+    iters = next > iters ? next : iters + 1;
+  }
+
+  double samples[BENCH_MAX_RUNS];
+  for (int i = 0; i < opts.runs; i++) {
+    int64_t ns = bench_time(fn, arg, iters);
+    if (ns < 0) {
+      fprintf(stderr, "Error: %s failed\n", name);
+      return -1;
+    }
+    samples[i] = (double)ns / iters;
+  }
+
+  qsort(samples, opts.runs, sizeof(*samples), bench_cmp_double);
+  bench_report(name, iters, samples[opts.runs / 2], samples[0],
+               bytes_per_op);
+  return 0;
+}
+
+/*
+  == Message parsing ==
+ */
+
+static int bench_parse_posint(void *arg UNUSED_ATTR, int64_t iters) {
+  // invalid input prints an error so it isn't worth timing
+  static char *inputs[] = {"0", "7", "12345", "65535", "2147483647"};
+  int count = sizeof(inputs) / sizeof(*inputs);
+  int64_t sum = 0;
+  for (int64_t i = 0; i < iters; i++) {
+    sum += try_parse_posint(inputs[i % count]);
+  }
+  bench_sink = sum;
+  return 0;
+}
+
+static int bench_parse_ping_msg(void *arg UNUSED_ATTR, int64_t iters) {
+  static const char msg[] = "PING_REQ 12345 678";
+  char buf[sizeof(msg)];
+  int64_t sum = 0;
+
+  for (int64_t i = 0; i < iters; i++) {
+    // strtok eats the buffer so every msg needs a fresh copy
+    memcpy(buf, msg, sizeof(msg));
+    READ_MSG_TYPE(0, buf, " ");
+    int seq = READ_MSG_POSINT(0);
+    int peer = READ_MSG_POSINT(0);
+    sum += seq + peer + buf[0];
+  }
+  bench_sink = sum;
+  return 0;
+}
+
+/*
+  == Local key index ==
+ */
+
+// spreads the keys out like file ids would be
+#define BENCH_KEY(i) ((int64_t)(((uint64_t)(i) * 0x9e3779b97f4a7c15ULL) >> 1))
+
+static int bench_key_insert(void *arg UNUSED_ATTR, int64_t iters) {
+  key_store store;
+  key_store_init(&store);
+
+  int ret = 0;
+  for (int64_t i = 0; i < iters && !ret; i++) {
+    key_entry entry = {.key = BENCH_KEY(i), .slot = KEY_NO_SLOT};
+    ret = key_store_insert(&store, &entry, NULL) < 0;
+  }
+
+  key_store_destroy(&store);
+  return ret ? -1 : 0;
+}
+
+static int bench_key_lookup_hit(void *arg, int64_t iters) {
+  key_store *store = arg;
+  int64_t found = 0;
+  for (int64_t i = 0; i < iters; i++) {
+    found += key_store_lookup(store, BENCH_KEY(i & (BENCH_LOOKUP_KEYS - 1)),
+                              NULL);
+  }
+  bench_sink = found;
+  return found == iters ? 0 : -1;
+}
+
+static int bench_key_lookup_miss(void *arg, int64_t iters) {
+  key_store *store = arg;
+  int64_t found = 0;
+  for (int64_t i = 0; i < iters; i++) {
+    found += key_store_lookup(store, BENCH_KEY(BENCH_LOOKUP_KEYS + i), NULL);
+  }
+  bench_sink = found;
+  return found ? -1 : 0;
+}
+
+/*
+  == Routing state ==
+ */
+
+typedef struct bench_router_t {
+  p2p_node *node;
+  atomic_int stop;
+} bench_router;
+
+static int bench_successor_read(void *arg UNUSED_ATTR, int64_t iters) {
+  int64_t sum = 0;
+  for (int64_t i = 0; i < iters; i++) sum += get_first_successor(0);
+  bench_sink = sum;
+  return 0;
+}
+
+static int bench_successors_snapshot(void *arg UNUSED_ATTR, int64_t iters) {
+  int succs[MAX_SUCCESSORS];
+  int64_t sum = 0;
+  for (int64_t i = 0; i < iters; i++) sum += get_successors(succs);
+  bench_sink = sum;
+  return sum ? 0 : -1;
+}
+
+/*
+  Keeps swapping the router's successors (like a ring full of joins).
+ */
+static void *bench_router_writer(void *arg) {
+  bench_router *router = arg;
+  p2p_node_enter(router->node);
+
+  for (int i = 0; !atomic_load(&router->stop); i++) {
+    int base = i & 1 ? 100 : 200;
+    set_successors((int[]){base, base + 1, base + 2}, 3);
+  }
+  return NULL;
+}
+
+static int bench_routing(void) {
+  bench_router router = {
+    .node = p2p_node_create(&(p2p_node_config){
+      .peer = BENCH_ROUTER, .ping_interval = 1, .successors = 3,
+    }),
+  };
+  if (!router.node) return -1;
+
+  p2p_node *prev = p2p_node_enter(router.node);
+  set_successors((int[]){100, 101, 102}, 3);
+
+  int ret = 0;
+  ret |= bench_run("successor_read", bench_successor_read, NULL, 0);
+  ret |= bench_run("successors_snapshot", bench_successors_snapshot, NULL, 0);
+
+  // readers should stay lock free however often the list changes
+  pthread_t writer;
+  if (!pthread_create(&writer, NULL, bench_router_writer, &router)) {
+    ret |= bench_run("successor_read_contended", bench_successor_read, NULL,
+                     0);
+    ret |= bench_run("successors_snapshot_contended",
+                     bench_successors_snapshot, NULL, 0);
+    atomic_store(&router.stop, 1);
+    pthread_join(writer, NULL);
+  }
+
+  p2p_node_enter(prev);
+  p2p_node_destroy(router.node);
+  return ret;
+}
+
+/*
+  == Compression ==
+ */
+
+typedef struct bench_lz_t {
+  char raw[TRANSFER_LZ_BLOCK];
+  char enc[TRANSFER_LZ_BLOCK];
+  char out[TRANSFER_LZ_BLOCK];
+  size_t enc_len;
+} bench_lz;
+
+static int bench_lz_compress(void *arg, int64_t iters) {
+  bench_lz *lz = arg;
+  int64_t sum = 0;
+  for (int64_t i = 0; i < iters; i++) {
+    sum += lz_compress(lz->raw, sizeof(lz->raw), lz->enc, sizeof(lz->enc));
+  }
+  bench_sink = sum;
+  return 0;
+}
+
+static int bench_lz_decompress(void *arg, int64_t iters) {
+  bench_lz *lz = arg;
+  for (int64_t i = 0; i < iters; i++) {
+    if (lz_decompress(lz->enc, lz->enc_len, lz->out, sizeof(lz->out)) !=
+        sizeof(lz->out)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int bench_compression(void) {
+  bench_lz *lz = malloc(sizeof(*lz));
+  if (!lz) return -1;
+
+  // our own source is about as texty as the .txt files
+  FILE *src = fopen(__FILE__, "r");
+  size_t len = src ? fread(lz->raw, 1, sizeof(lz->raw), src) : 0;
+  if (src) fclose(src);
+  for (size_t i = len; i < sizeof(lz->raw); i++) {
+    lz->raw[i] = len ? lz->raw[i % len] : "p2p ring "[i % 9];
+  }
+
+  int ret = 0;
+  lz->enc_len = lz_compress(lz->raw, sizeof(lz->raw), lz->enc,
+                            sizeof(lz->enc));
+  ret |= bench_run("lz_compress_text_64KB", bench_lz_compress, lz,
+                   sizeof(lz->raw));
+  ret |= bench_run("lz_decompress_text_64KB", bench_lz_decompress, lz,
+                   sizeof(lz->raw));
+
+  // and random bytes like a .pdf, these have to be given up on fast
+  for (size_t i = 0; i < sizeof(lz->raw); i++) lz->raw[i] = rand();
+  ret |= bench_run("lz_compress_random_64KB", bench_lz_compress, lz,
+                   sizeof(lz->raw));
+
+  free(lz);
+  return ret;
+}
+
+/*
+  == Checksums ==
+ */
+
+typedef struct bench_crc_t {
+  char buf[TRANSFER_CRC_CHUNK];
+  uint32_t (*fn)(uint32_t crc, const void *buf, size_t len);
+} bench_crc;
+
+static int bench_crc32c(void *arg, int64_t iters) {
+  bench_crc *crc = arg;
+  uint32_t sum = 0;
+  for (int64_t i = 0; i < iters; i++) {
+    sum = crc->fn(sum, crc->buf, sizeof(crc->buf));
+  }
+  bench_sink = sum;
+  return 0;
+}
+
+static int bench_checksums(void) {
+  bench_crc *crc = malloc(sizeof(*crc));
+  if (!crc) return -1;
+  for (size_t i = 0; i < sizeof(crc->buf); i++) crc->buf[i] = rand();
+
+  int ret = 0;
+  crc->fn = crc32c;
+  ret |= bench_run("crc32c_1MB", bench_crc32c, crc, sizeof(crc->buf));
+  // the portable fallback, what a box without sse4.2 gets
+  crc->fn = crc32c_sw;
+  ret |= bench_run("crc32c_sw_1MB", bench_crc32c, crc, sizeof(crc->buf));
+
+  free(crc);
+  return ret;
+}
+
+/*
+  == Pings ==
+ */
+
+typedef struct bench_udp_t {
+  int a, b;
+  int a_port, b_port;
+} bench_udp;
+
+static int bench_udp_socket(int *port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  set_sockaddr(&addr, IP_ADDR, 0);
+
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      getsockname(fd, (struct sockaddr *)&addr, &len)) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+static int bench_ping_send(void *arg, int64_t iters) {
+  bench_udp *udp = arg;
+  char buf[64];
+
+  for (int64_t i = 0; i < iters; i++) {
+    if (send_ping(IP_ADDR, udp->b_port, PING_REQ, udp->a, i)) return -1;
+    // keep the sink from filling up (and dropping)
+    while (recv(udp->b, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+  }
+  return 0;
+}
+
+static int bench_ping_round_trip(void *arg, int64_t iters) {
+  bench_udp *udp = arg;
+  char buf[64];
+
+  for (int64_t i = 0; i < iters; i++) {
+    if (send_ping(IP_ADDR, udp->b_port, PING_REQ, udp->a, i) ||
+        recv(udp->b, buf, sizeof(buf), 0) <= 0 ||
+        send_ping(IP_ADDR, udp->a_port, PING_ACK, udp->b, i) ||
+        recv(udp->a, buf, sizeof(buf), 0) <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+  == Loopback transfers ==
+ */
+
+typedef struct bench_transfer_t {
+  int file;
+  int peer;
+  // the TCP_RETRIEVE flags it is sent with
+  int flags;
+  char received[BENCH_PATH_LEN];
+} bench_transfer;
+
+/*
+  Write a file of size bytes to send, returns -1 if we couldn't.
+ */
+static int bench_make_file(int file, int64_t size) {
+  char path[BENCH_PATH_LEN];
+  snprintf(path, sizeof(path), "%d.bin", file);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+
+  static char block[1 << 20];
+  for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)(i * 31 + 7);
+
+  int ret = 0;
+  for (int64_t left = size; left > 0 && !ret;) {
+    size_t want = left < (int64_t)sizeof(block) ? (size_t)left : sizeof(block);
+    ssize_t wrote = write(fd, block, want);
+    if (wrote <= 0) ret = -1;
+    else left -= wrote;
+  }
+
+  close(fd);
+  return ret;
+}
+
+static int bench_transfer_send(void *arg, int64_t iters) {
+  bench_transfer *tx = arg;
+  struct timespec pause = {.tv_nsec = 10000};
+
+  for (int64_t i = 0; i < iters; i++) {
+    tcp_transfer_send(tx->file, "bin", tx->peer, tx->flags);
+
+    // the receiver renames the file into place once it has it all
+    time_t deadline = time(NULL) + BENCH_TRANSFER_TIMEOUT_SECS;
+    while (access(tx->received, F_OK)) {
+      if (time(NULL) > deadline) return -1;
+      nanosleep(&pause, NULL);
+    }
+    unlink(tx->received);
+  }
+  return 0;
+}
+
+/*
+  Wait for a peer to start accepting connections.
+ */
+static int bench_wait_for(int peer) {
+  struct timespec pause = {.tv_nsec = 10000000};
+  for (int i = 0; i < 500; i++) {
+    int fd = tcp_connect(peer);
+    if (fd >= 0) {
+      close(fd);
+      return 0;
+    }
+    nanosleep(&pause, NULL);
+  }
+  return -1;
+}
+
+static int bench_transfers(p2p_node *sender) {
+  static const struct {
+    int64_t size;
+    const char *name;
+    int flags;
+  } cases[] = {
+    {1 << 10, "transfer_1KB", 0},
+    {64 << 10, "transfer_64KB", 0},
+    {1 << 20, "transfer_1MB", 0},
+    {16 << 20, "transfer_16MB", 0},
+    {256 << 20, "transfer_256MB", 0},
+    {1 << 30, "transfer_1GB", 0},
+    // what checking every block costs
+    {16 << 20, "transfer_16MB_crc", TCP_RETRIEVE_CHECKSUM},
+    {256 << 20, "transfer_256MB_crc", TCP_RETRIEVE_CHECKSUM},
+    // compressed a block at a time (with --io-uring through the ring)
+    {16 << 20, "transfer_16MB_lz", TCP_RETRIEVE_COMPRESSED},
+    {256 << 20, "transfer_256MB_lz", TCP_RETRIEVE_COMPRESSED},
+  };
+  int count = sizeof(cases) / sizeof(*cases);
+
+  int wanted = 0;
+  for (int i = 0; i < count; i++) {
+    wanted |= cases[i].size <= opts.max_bytes &&
+              (!opts.filter || strstr(cases[i].name, opts.filter));
+  }
+  if (!wanted) return 0;
+
+  p2p_node *receiver = p2p_node_create(&(p2p_node_config){
+    .peer = BENCH_RECEIVER, .ping_interval = 1, .cache_mb = -1,
+  });
+  if (!receiver) return -1;
+
+  // a two peer ring that never pings, we only want the tcp side
+  p2p_node_init(sender, (int[]){BENCH_RECEIVER, BENCH_SENDER}, 2);
+  p2p_node_init(receiver, (int[]){BENCH_SENDER, BENCH_RECEIVER}, 2);
+
+  int ret = bench_wait_for(BENCH_RECEIVER);
+  if (ret) fprintf(stderr, "Error: Peer %d never started\n", BENCH_RECEIVER);
+
+  for (int i = 0; i < count && !ret; i++) {
+    if (cases[i].size > opts.max_bytes) continue;
+    if (opts.filter && !strstr(cases[i].name, opts.filter)) continue;
+
+    bench_transfer tx = {
+      .file = i, .peer = BENCH_RECEIVER, .flags = cases[i].flags,
+    };
+    snprintf(tx.received, sizeof(tx.received), "received_%d.bin", i);
+    if (bench_make_file(i, cases[i].size)) {
+      perror("write");
+      ret = -1;
+      break;
+    }
+
+    ret = bench_run(cases[i].name, bench_transfer_send, &tx, cases[i].size);
+
+    char path[BENCH_PATH_LEN];
+    snprintf(path, sizeof(path), "%d.bin", i);
+    unlink(path);
+  }
+
+  p2p_node_stop(receiver);
+  p2p_node_destroy(receiver);
+  return ret;
+}
+
+/*
+  Parse a --option, returns 0 if it was valid.
+ */
+static int bench_parse_option(char *opt) {
+  int val;
+  if (!strcasecmp(opt, "--json")) {
+    opts.json = 1;
+  } else if (!strncasecmp(opt, "--runs=", strlen("--runs="))) {
+    val = try_parse_posint(opt + strlen("--runs="));
+    if (val < 1 || val > BENCH_MAX_RUNS) return -1;
+    opts.runs = val;
+  } else if (!strncasecmp(opt, "--min-ms=", strlen("--min-ms="))) {
+    val = try_parse_posint(opt + strlen("--min-ms="));
+    if (val < 1) return -1;
+    opts.min_ns = val * 1000000LL;
+  } else if (!strncasecmp(opt, "--max-bytes=", strlen("--max-bytes="))) {
+    val = try_parse_posint(opt + strlen("--max-bytes="));
+    if (val < 0) return -1;
+    opts.max_bytes = val;
+  } else if (!strncasecmp(opt, "--filter=", strlen("--filter="))) {
+    opts.filter = opt + strlen("--filter=");
+  } else if (!strcasecmp(opt, "--io-uring")) {
+    opts.io_uring = 1;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (!bench_parse_option(argv[i])) continue;
+    fprintf(stderr,
+"Usage %s [options]\n"
+"Options:\n"
+"      --json  print a JSON array instead of CSV\n"
+"      --runs=<n: int>  timed runs of every benchmark (%d)\n"
+"      --min-ms=<n: int>  how long a single run lasts atleast (%d)\n"
+"      --max-bytes=<n: int>  largest file to transfer (%d)\n"
+"      --filter=<str>  only run benchmarks with str in their name\n"
+"      --io-uring  send compressed transfers through io_uring\n",
+            argv[0], BENCH_DEFAULT_RUNS, BENCH_DEFAULT_MIN_MS,
+            BENCH_DEFAULT_MAX_BYTES);
+    return 1;
+  }
+
+  // the modules print a line for every ping / transfer
+  opts.out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!opts.out || !freopen("/dev/null", "w", stdout)) {
+    perror("stdout");
+    return 1;
+  }
+
+  // peers drop their index and received files in the working directory
+  char dir[] = "/tmp/p2p_bench.XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  p2p_node *sender = p2p_node_create(&(p2p_node_config){
+    .peer = BENCH_SENDER, .ping_interval = 1, .cache_mb = -1,
+    .io_uring = opts.io_uring,
+  });
+  if (!sender) return 1;
+  p2p_node_enter(sender);
+
+  if (opts.json) {
+    fprintf(opts.out, "[\n");
+  } else {
+    fprintf(opts.out, "name,iterations,runs,ns_per_op,min_ns_per_op,"
+                      "ops_per_sec,mb_per_sec\n");
+  }
+
+  int ret = 0;
+  ret |= bench_run("parse_posint", bench_parse_posint, NULL, 0);
+  ret |= bench_run("parse_ping_msg", bench_parse_ping_msg, NULL, 0);
+
+  key_store store;
+  key_store_init(&store);
+  for (int i = 0; i < BENCH_LOOKUP_KEYS; i++) {
+    key_entry entry = {.key = BENCH_KEY(i), .slot = KEY_NO_SLOT};
+    key_store_insert(&store, &entry, NULL);
+  }
+  ret |= bench_run("key_store_insert", bench_key_insert, NULL, 0);
+  ret |= bench_run("key_store_lookup_hit", bench_key_lookup_hit, &store, 0);
+  ret |= bench_run("key_store_lookup_miss", bench_key_lookup_miss, &store, 0);
+  key_store_destroy(&store);
+
+  ret |= bench_routing();
+  ret |= bench_compression();
+  ret |= bench_checksums();
+
+  bench_udp udp;
+  udp.a = bench_udp_socket(&udp.a_port);
+  udp.b = bench_udp_socket(&udp.b_port);
+  if (udp.a < 0 || udp.b < 0) {
+    perror("socket");
+    ret = -1;
+  } else {
+    ret |= bench_run("ping_send", bench_ping_send, &udp, 0);
+    ret |= bench_run("ping_round_trip", bench_ping_round_trip, &udp, 0);
+  }
+  if (udp.a >= 0) close(udp.a);
+  if (udp.b >= 0) close(udp.b);
+
+  ret |= bench_transfers(sender);
+
+  if (opts.json) fprintf(opts.out, "\n]\n");
+
+  p2p_node_stop(sender);
+  p2p_node_destroy(sender);
+
+  char path[BENCH_PATH_LEN];
+  snprintf(path, sizeof(path), STORE_INDEX_PATH_FMT, BENCH_SENDER);
+  unlink(path);
+  snprintf(path, sizeof(path), STORE_INDEX_PATH_FMT, BENCH_RECEIVER);
+  unlink(path);
+  if (chdir("/") || rmdir(dir)) perror("rmdir");
+
+  return ret ? 1 : 0;
+}
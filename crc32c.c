@@ -0,0 +1,169 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_HW
+#endif
+
+// the Castagnoli polynomial, bit reflected
+#define CRC32C_POLY (0x82f63b78)
+
+// how much each of the three streams takes at once,
+// long for the bulk and short to mop up what's left
+#define CRC32C_LONG (8192)
+#define CRC32C_SHORT (256)
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *buf,
+                              size_t len);
+
+static uint32_t crc32c_table[8][256];
+static crc32c_fn crc32c_impl;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// x^(8 * n) mod P for n = the stream lens, shifts a crc past them
+static uint32_t crc32c_long_shift[2];
+static uint32_t crc32c_short_shift[2];
+
+/*
+  a * b mod P, both bit reflected.
+ */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31, p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if (!(a & (m - 1))) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/*
+  x^(8 * n) mod P, the crc of n zero bytes is the crc times this.
+ */
+static uint32_t crc32c_xpow8n(size_t n) {
+  // x^0 and x^8 (reflected)
+  uint32_t result = 1u << 31, square = 1u << 23;
+  for (; n; n >>= 1) {
+    if (n & 1) result = crc32c_multmodp(square, result);
+    square = crc32c_multmodp(square, square);
+  }
+  return result;
+}
+
+static uint32_t crc32c_sw_raw(uint32_t crc, const unsigned char *p,
+                              size_t len) {
+  // slicing by 8, the bytes are read one by one so endianness doesn't matter
+  for (; len >= 8; p += 8, len -= 8) {
+    uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+          crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+  }
+  while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef CRC32C_HW
+static inline uint64_t crc32c_load64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+  crc * shift mod P, the product is reduced with the crc32 instruction.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw_shift(uint32_t crc, uint32_t shift) {
+  __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                      _mm_cvtsi32_si128(shift), 0x00);
+  // reflected products come out a bit short
+  prod = _mm_slli_epi64(prod, 1);
+  return _mm_crc32_u32(0, _mm_cvtsi128_si32(prod)) ^
+         (uint32_t)_mm_extract_epi32(prod, 1);
+}
+
+/*
+  crc32 has a latency of 3 but we can start one every cycle, so three
+  independent streams over a run of 3 * len bytes keep it busy.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline const unsigned char *crc32c_hw_streams(
+    uint64_t *crc, const unsigned char *p, size_t len, const uint32_t *shift) {
+  uint64_t c0 = *crc, c1 = 0, c2 = 0;
+  const unsigned char *end = p + len;
+  for (; p < end; p += 8) {
+    c0 = _mm_crc32_u64(c0, crc32c_load64(p));
+    c1 = _mm_crc32_u64(c1, crc32c_load64(p + len));
+    c2 = _mm_crc32_u64(c2, crc32c_load64(p + 2 * len));
+  }
+  *crc = crc32c_hw_shift(c0, shift[1]) ^ crc32c_hw_shift(c1, shift[0]) ^ c2;
+  return p + 2 * len;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc32, const unsigned char *p,
+                          size_t len) {
+  for (; len && (uintptr_t)p & 7; len--) crc32 = _mm_crc32_u8(crc32, *p++);
+
+  uint64_t crc = crc32;
+  for (; len >= 3 * CRC32C_LONG; len -= 3 * CRC32C_LONG) {
+    p = crc32c_hw_streams(&crc, p, CRC32C_LONG, crc32c_long_shift);
+  }
+  for (; len >= 3 * CRC32C_SHORT; len -= 3 * CRC32C_SHORT) {
+    p = crc32c_hw_streams(&crc, p, CRC32C_SHORT, crc32c_short_shift);
+  }
+  for (; len >= 8; p += 8, len -= 8) {
+    crc = _mm_crc32_u64(crc, crc32c_load64(p));
+  }
+
+  crc32 = crc;
+  while (len--) crc32 = _mm_crc32_u8(crc32, *p++);
+  return crc32;
+}
+#endif
+
+static void crc32c_init(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = crc32c_table[0][n];
+    for (int k = 1; k < 8; k++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[k][n] = crc;
+    }
+  }
+
+  crc32c_impl = crc32c_sw_raw;
+#ifdef CRC32C_HW
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+    for (int i = 0; i < 2; i++) {
+      crc32c_long_shift[i] = crc32c_xpow8n((size_t)CRC32C_LONG * (i + 1));
+      crc32c_short_shift[i] = crc32c_xpow8n((size_t)CRC32C_SHORT * (i + 1));
+    }
+    crc32c_impl = crc32c_hw;
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_impl(~crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_sw_raw(~crc, buf, len);
+}
@@ -0,0 +1,29 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_CRC32C_H__
+#define __P2P_CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**                                                   **
+ * CRC32C (Castagnoli) of the blocks we transfer.      *
+ * On x86 with SSE4.2 it runs three crc32 streams side *
+ * by side and stitches them together with PCLMUL,     *
+ * anywhere else it falls back to slicing by 8 tables. *
+ **                                                   **/
+
+/*
+  Carry on the crc of the bytes before buf (0 to start).
+  i.e. crc32c(crc32c(0, a, n), b, m) is the crc of a then b.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+  The same crc always using the tables (for benchmarks).
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+#endif
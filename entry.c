@@ -8,14 +8,19 @@
 #include <unistd.h>
 
 #include "args.h"
+#include "hash_ring.h"
 #include "utils.h"
 #include "tcp.h"
+#include "p2p_node.h"
 #include "p2p_peer.h"
 #include "ping.h"
+#include "proto.h"
+#include "stats.h"
+#include "work_pool.h"
 
 #define BUF_LEN (1024)
 
-pthread_t tcp_thrd;
+static p2p_node *node;
 
 // Exit handler in case of Ctrl + C
 // this just allows us to drop sockets.
@@ -23,13 +28,131 @@ pthread_t tcp_thrd;
 // whole abrupt thing pointless.
 void exit_handler(int code) {
   printf("\n> Shutting down due to signal %d\n", code);
-  destroy_ping_module();
-  if (pthread_cancel(tcp_thrd)) {
-    pthread_join(tcp_thrd, NULL);
+  if (node && node->started) {
+    p2p_node_enter(node);
+    destroy_ping_module();
+    if (pthread_cancel(node->tcp_thrd)) {
+      pthread_join(node->tcp_thrd, NULL);
+    }
   }
   exit(code);
 }
 
+/*
+  Our only peer has lost every successor.
+ */
+static void lost_handler(p2p_node *lost UNUSED_ATTR) {
+  exit_handler(SIGABRT);
+}
+
+/*
+  Parse a trailing --option into the config, returns 0 if it was valid.
+ */
+static int parse_option(char *opt, p2p_node_config *config) {
+  if (!strcasecmp(opt, "--text-protocol")) {
+    // talk to peers that only understand the old text msgs
+    proto_set_format(PROTO_TEXT);
+    return 0;
+  } else if (!strcasecmp(opt, "--compress")) {
+    // trade some cpu for less on the wire when we retrieve
+    config->compress = 1;
+    return 0;
+  } else if (!strncasecmp(opt, "--successors=", strlen("--successors="))) {
+    int count = try_parse_posint(opt + strlen("--successors="));
+    config->successors = count;
+    if (MIN_SUCCESSORS <= count && count <= MAX_SUCCESSORS) return 0;
+    fprintf(stderr, "Error: successors has to be between %d and %d\n",
+            MIN_SUCCESSORS, MAX_SUCCESSORS);
+    return -1;
+  } else if (!strncasecmp(opt, "--replicas=", strlen("--replicas="))) {
+    int replicas = try_parse_posint(opt + strlen("--replicas="));
+    config->replicas = replicas;
+    if (0 < replicas && replicas <= HASH_RING_MAX_REPLICAS) return 0;
+    fprintf(stderr, "Error: replicas has to be between 1 and %d\n",
+            HASH_RING_MAX_REPLICAS);
+    return -1;
+  } else if (!strncasecmp(opt, "--stats-file=", strlen("--stats-file="))) {
+    config->stats_path = opt + strlen("--stats-file=");
+    if (*config->stats_path &&
+        strlen(config->stats_path) < STATS_PATH_LEN) return 0;
+    fprintf(stderr, "Error: stats file has to be a path shorter than %d\n",
+            STATS_PATH_LEN);
+    return -1;
+  } else if (!strncasecmp(opt, "--cache-mb=", strlen("--cache-mb="))) {
+    int mb = try_parse_posint(opt + strlen("--cache-mb="));
+    if (mb < 0) {
+      fprintf(stderr, "Error: cache mb has to be a positive int (or 0)\n");
+      return -1;
+    }
+    // 0 turns it off
+    config->cache_mb = mb ? mb : -1;
+    return 0;
+  } else if (!strncasecmp(opt, "--workers=", strlen("--workers="))) {
+    int workers = try_parse_posint(opt + strlen("--workers="));
+    config->workers = workers;
+    if (0 < workers && workers <= WORK_POOL_MAX_WORKERS) return 0;
+    fprintf(stderr, "Error: workers has to be between 1 and %d\n",
+            WORK_POOL_MAX_WORKERS);
+    return -1;
+  } else if (!strncasecmp(opt, "--vnodes=", strlen("--vnodes="))) {
+    int vnodes = try_parse_posint(opt + strlen("--vnodes="));
+    config->vnodes = vnodes;
+    if (0 < vnodes && vnodes <= HASH_RING_MAX_VNODES) return 0;
+    fprintf(stderr, "Error: vnodes has to be between 1 and %d\n",
+            HASH_RING_MAX_VNODES);
+    return -1;
+  }
+
+  fprintf(stderr, "Error: %s is not a valid option\n", opt);
+  return -1;
+}
+
+/*
+  Read the file ids (whitespace / comma separated) out of a file.
+  Returns a malloc'd array of count ids or NULL.
+ */
+static int *read_batch(const char *path, int *count) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    perror(path);
+    return NULL;
+  }
+
+  int cap = 1024;
+  int *files = malloc(cap * sizeof(*files));
+  *count = 0;
+
+  char line[BUF_LEN];
+  while (files && fgets(line, BUF_LEN, in)) {
+    char *save;
+    for (char *tok = strtok_r(line, " ,\t\r\n", &save); tok;
+         tok = strtok_r(NULL, " ,\t\r\n", &save)) {
+      int file = try_parse_posint(tok);
+      if (file < 0) {
+        fprintf(stderr, "Error: %s isn't a valid file id\n", tok);
+        free(files);
+        files = NULL;
+        break;
+      }
+
+      if (*count == cap) {
+        cap *= 2;
+        int *grown = realloc(files, cap * sizeof(*files));
+        if (!grown) {
+          free(files);
+          files = NULL;
+          break;
+        }
+        files = grown;
+      }
+      files[(*count)++] = file;
+    }
+  }
+
+  fclose(in);
+  return files;
+}
+
 int main(int argc, char *argv[]) {
   INIT_ARGS(argc, argv);
   SKIP_PROGNAME();
@@ -41,28 +164,53 @@ int main(int argc, char *argv[]) {
     USAGE_EXIT();
   }
 
-  pthread_t ping_ticker, ping_rec;
+  int peer, first_succesor, second_successor, known_peer, ping;
+  enum { MODE_INIT, MODE_JOIN, MODE_RESTART } mode = MODE_INIT;
   if (!strcasecmp(subcommand, "init")) {
-    int peer, first_succesor, second_successor, ping;
     READ_INT(&peer);
     READ_INT(&first_succesor);
     READ_INT(&second_successor);
     READ_INT(&ping);
-    init_peer(peer, first_succesor, second_successor, ping, &ping_rec, &tcp_thrd);
   } else if (!strcasecmp(subcommand, "join")) {
-    int peer, known_peer, ping;
     READ_INT(&peer);
     READ_INT(&known_peer);
     READ_INT(&ping);
-    join_peer(peer, known_peer, ping, &ping_rec, &tcp_thrd);
+    mode = MODE_JOIN;
+  } else if (!strcasecmp(subcommand, "restart")) {
+    READ_INT(&peer);
+    READ_INT(&ping);
+    mode = MODE_RESTART;
   } else {
     fprintf(stderr, "Error [%s]: %s is not a valid subcommand\n", argv[0],
             subcommand);
     USAGE_EXIT();
   }
 
+  p2p_node_config config = {
+    .peer = peer, .ping_interval = ping, .on_lost = lost_handler,
+  };
+  for (char *opt; (opt = READ_STR());) {
+    if (parse_option(opt, &config)) USAGE_EXIT();
+  }
+
+  node = p2p_node_create(&config);
+  if (!node) {
+    fprintf(stderr, "Error [%s]: %d is not a valid peer\n", argv[0], peer);
+    USAGE_EXIT();
+  }
+  // the main thread works for our only peer
+  p2p_node_enter(node);
+
+  if (mode == MODE_JOIN) {
+    p2p_node_join(node, known_peer);
+  } else if (mode == MODE_RESTART) {
+    if (p2p_node_restart(node)) exit(1);
+  } else {
+    p2p_node_init(node, (int[]){first_succesor, second_successor}, 2);
+  }
+
   verify_peers();
-  ping_ticker = setup_ping_interval();
+  p2p_node_start(node);
 
   char read_buf[BUF_LEN];
   while (fgets(read_buf, BUF_LEN, stdin)) {
@@ -70,28 +218,46 @@ int main(int argc, char *argv[]) {
     READ_MSG_TYPE(0, read_buf, " ");
     if (!strcasecmp(read_buf, "store")) {
       int file = READ_MSG_POSINT(0);
-      printf("> Store %d request forwarded to successor\n", file);
-      tcp_send_store_req(file, get_peer(), get_first_successor(1));
+      int next = p2p_node_store(node, file);
+      printf("> Store %d request forwarded to Peer %d\n", file, next);
     } else if (!strcasecmp(read_buf, "request")) {
       int file = READ_MSG_POSINT(0);
-      printf("> Retrieve %d request forwarded to successor\n", file);
-      tcp_send_retrieve_req(file, get_peer(), get_first_successor(1));
+      int next = p2p_node_retrieve(node, file);
+      printf("> Retrieve %d request forwarded to Peer %d\n", file, next);
+    } else if (!strcasecmp(read_buf, "store-batch") ||
+               !strcasecmp(read_buf, "request-batch")) {
+      int store = !strcasecmp(read_buf, "store-batch");
+      char *path = READ_MSG_STR(0);
+      int count;
+      int *files = path ? read_batch(path, &count) : NULL;
+      if (!files) {
+        fprintf(stderr, "Error: %s needs a file of ids\n", read_buf);
+        continue;
+      }
+
+      int sent = store ? p2p_node_store_batch(node, files, count)
+                       : p2p_node_retrieve_batch(node, files, count);
+      if (sent < 0) {
+        fprintf(stderr, "Error: Couldn't send all of the batch on\n");
+      } else {
+        printf("> %s batch of %d keys, %d forwarded\n",
+               store ? "Store" : "Retrieve", count, sent);
+      }
+      free(files);
+    } else if (!strcasecmp(read_buf, "stats")) {
+      p2p_node_dump_stats(node, stdout);
+      fflush(stdout);
     } else if (!strcasecmp(read_buf, "quit")) {
-      tcp_send_quit_req();
+      p2p_node_quit(node);
       break;
     } else {
       fprintf(stderr, "Invalid Type %s\n", read_buf);
     }
   }
 
-  if (pthread_cancel(tcp_thrd)) {
-    pthread_join(tcp_thrd, NULL);
-  }
-  pthread_cancel(ping_ticker);
-  pthread_cancel(ping_rec);
-
   printf("Peer %d closing down\n", get_peer());
-  close_peer();
+  p2p_node_stop(node);
+  p2p_node_destroy(node);
 
   return 0;
 }
@@ -0,0 +1,144 @@
+#include "finger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "p2p_node.h"
+#include "p2p_peer.h"
+#include "stats.h"
+#include "tcp.h"
+
+/*
+  The finger table of the node this thread works for.
+ */
+static inline finger_state *finger_self(void) {
+  return &p2p_node_current()->fingers;
+}
+
+void finger_state_init(finger_state *table) {
+  table->self = -1;
+  for (int i = 0; i < FINGER_COUNT; i++) table->fingers[i] = -1;
+  pthread_mutex_init(&table->lock, NULL);
+}
+
+void finger_state_free(finger_state *table) {
+  pthread_mutex_destroy(&table->lock);
+}
+
+void finger_init(int self) {
+  finger_state *table = finger_self();
+  SCOPED_MTX_LOCK(&table->lock) {
+    table->self = self;
+    for (int i = 0; i < FINGER_COUNT; i++) table->fingers[i] = -1;
+  }
+}
+
+int finger_start(int i) {
+  return (get_peer() + (1 << i)) & (RING_SIZE - 1);
+}
+
+void finger_set(int i, int peer) {
+  if (i < 0 || i >= FINGER_COUNT) return;
+  finger_state *table = finger_self();
+  SCOPED_MTX_LOCK(&table->lock) table->fingers[i] = peer;
+}
+
+int finger_get(int i) {
+  if (i < 0 || i >= FINGER_COUNT) return -1;
+  finger_state *table = finger_self();
+  SCOPED_MTX_LOCK(&table->lock) return table->fingers[i];
+}
+
+void finger_drop(int peer) {
+  finger_state *table = finger_self();
+  SCOPED_MTX_LOCK(&table->lock) for (int i = 0; i < FINGER_COUNT; i++) {
+    if (table->fingers[i] == peer) table->fingers[i] = -1;
+  }
+}
+
+int finger_closest_preceding(int pos) {
+  finger_state *table = finger_self();
+  SCOPED_MTX_LOCK(&table->lock) for (int i = FINGER_COUNT - 1; i >= 0; i--) {
+    int f = table->fingers[i];
+    if (f != -1 && f != table->self && ring_in_open(f, table->self, pos)) {
+      return f;
+    }
+  }
+
+  return -1;
+}
+
+/*
+  Ask our first successor for its successors, peers that joined
+  or left further down our list show up here.
+ */
+static void finger_stabilize(int self) {
+  int first = get_first_successor(0);
+  if (first == -1) return;
+
+  int succs[MAX_SUCCESSORS + 1] = {first};
+  int count = tcp_query_successors(first, succs + 1);
+  if (count < 0) return;
+
+  // our successors changed under us, try again next tick
+  if (get_first_successor(0) != first) return;
+
+  if (set_successors(succs, count + 1)) print_successors();
+}
+
+/*
+  Refresh every finger, only the ones that aren't covered by
+  our successor or the previous finger need a lookup.
+ */
+static void finger_fix(int self) {
+  int succ = get_first_successor(0);
+  if (succ == -1) return;
+
+  int prev = succ;
+  for (int i = 0; i < FINGER_COUNT; i++) {
+    int start = finger_start(i);
+    if (ring_in_range(start, self, succ)) {
+      finger_set(i, succ);
+    } else if (prev != -1 && ring_in_range(start, self, prev)) {
+      finger_set(i, prev);
+    } else {
+      tcp_send_find_succ(start, i);
+    }
+    prev = finger_get(i);
+  }
+}
+
+/*
+  Gossip the hash ring to our successor and a random finger,
+  the finger lets news skip across the ring.
+ */
+static void finger_gossip(int self) {
+  int succ = get_first_successor(0);
+  if (succ != -1) tcp_send_members(succ);
+
+  int finger = finger_get(rand() % FINGER_COUNT);
+  if (finger != -1 && finger != succ && finger != self) {
+    tcp_send_members(finger);
+  }
+}
+
+void *finger_thrd_ticker(void *node) {
+  p2p_node_enter(node);
+  // not currently modifiable in program
+  int interval = get_ping_interval();
+  int self = get_peer();
+
+  for (;;) {
+    finger_stabilize(self);
+    finger_fix(self);
+    finger_gossip(self);
+    // a join whose handoffs have stalled takes over anyway
+    handoff_check();
+    stats_tick();
+    sleep(interval);
+  }
+
+  pthread_exit(NULL);
+}
@@ -0,0 +1,95 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_FINGER_H__
+#define __P2P_FINGER_H__
+
+#include <pthread.h>
+
+#include "utils.h"
+
+/**                                                 **
+ * A chord style finger table, finger i points at    *
+ * the first peer at or after self + 2^i so that any *
+ * position on the ring is O(log N) hops away.       *
+ **                                                 **/
+
+// Peer ids are ports offset from MIN_PEER_PORT so they fit in 16 bits
+#define RING_BITS (16)
+#define RING_SIZE (1 << RING_BITS)
+
+#define FINGER_COUNT (RING_BITS)
+
+/*
+  Is x in (a, b] going clockwise around the ring.
+  If a == b the range is the whole ring.
+ */
+static inline int ring_in_range(int x, int a, int b) {
+  if (a < b) return a < x && x <= b;
+  if (a > b) return a < x || x <= b;
+  return 1;
+}
+
+/*
+  Is x in (a, b) going clockwise around the ring.
+ */
+static inline int ring_in_open(int x, int a, int b) {
+  if (a < b) return a < x && x < b;
+  if (a > b) return a < x || x < b;
+  return x != a;
+}
+
+typedef struct finger_state_t {
+  int fingers[FINGER_COUNT];
+  int self;
+  pthread_mutex_t lock;
+} finger_state;
+
+/*
+  Set up an empty table.
+ */
+void finger_state_init(finger_state *table);
+
+/*
+  Free the table's lock.
+ */
+void finger_state_free(finger_state *table);
+
+/*
+  Reset the table for the given peer.
+ */
+void finger_init(int self);
+
+/*
+  The ring position finger i is responsible for (self + 2^i).
+ */
+int finger_start(int i);
+
+/*
+  Set finger i to point at peer.
+ */
+void finger_set(int i, int peer);
+
+/*
+  Get finger i, -1 if we don't know it yet.
+ */
+int finger_get(int i);
+
+/*
+  Forget about a peer that has left (abruptly or not).
+ */
+void finger_drop(int peer);
+
+/*
+  The finger that most closely precedes pos, -1 if there is none.
+ */
+int finger_closest_preceding(int pos);
+
+/*
+  Periodically stabilises a node's successors, fixes fingers
+  and gossips the hash ring.
+ */
+void *finger_thrd_ticker(void *node);
+
+#endif
@@ -0,0 +1,737 @@
+#include "handoff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "key_store.h"
+#include "p2p_node.h"
+#include "p2p_peer.h"
+#include "stats.h"
+#include "store_index.h"
+#include "tcp.h"
+#include "transfer.h"
+#include "work_pool.h"
+
+/*
+  The handoff state of the node this thread works for.
+ */
+static inline handoff_state *handoff_self(void) {
+  return &p2p_node_current()->handoff;
+}
+
+void handoff_state_init(handoff_state *handoff) {
+  handoff->holder_count = 0;
+  handoff->deadline = 0;
+  for (int i = 0; i < HANDOFF_RECORDS; i++) {
+    handoff->records[i] = (handoff_record){.peer = -1};
+  }
+  atomic_init(&handoff->open, 0);
+  handoff->next_round = 0;
+  pthread_mutex_init(&handoff->lock, NULL);
+}
+
+void handoff_state_free(handoff_state *handoff) {
+  for (int i = 0; i < HANDOFF_RECORDS; i++) {
+    free(handoff->records[i].files);
+    free(handoff->records[i].pending);
+    hash_ring_view_free(&handoff->records[i].view);
+  }
+  pthread_mutex_destroy(&handoff->lock);
+}
+
+/*
+  Encode and send a msg on a connection we already have.
+ */
+static int handoff_send_on(int sock, tcp_type type, const int64_t *fields,
+                           int field_count) {
+  char buf[PROTO_MAX_MSG];
+  int len = proto_encode(buf, sizeof(buf), type, 0, proto_next_req_id(),
+                         fields, field_count, NULL, 0);
+  return len < 0 ? -1 : tcp_send_all(sock, buf, len, 0);
+}
+
+/*
+  Encode and send a msg to a peer.
+ */
+static int handoff_send(int peer, tcp_type type, const int64_t *fields,
+                        int field_count) {
+  char buf[PROTO_MAX_MSG];
+  int len = proto_encode(buf, sizeof(buf), type, 0, proto_next_req_id(),
+                         fields, field_count, NULL, 0);
+  return len < 0 ? -1 : tcp_send_msg(peer, buf, len);
+}
+
+/**
+ * The joining peer.
+ **/
+
+/*
+  Ask a member to hand us the keys we will hold once we have joined.
+ */
+static int handoff_send_req(int peer) {
+  int64_t fields[] = {get_peer(), hash_ring_incarnation(),
+                      hash_ring_vnodes()};
+  return handoff_send(peer, TCP_HANDOFF_REQ, fields, 3);
+}
+
+/*
+  The holder that is peer, NULL if we never asked them.
+  Requires handoff->lock.
+ */
+static handoff_holder *handoff_holder_find(handoff_state *handoff, int peer) {
+  for (int i = 0; i < handoff->holder_count; i++) {
+    if (handoff->holders[i].peer == peer) return &handoff->holders[i];
+  }
+  return NULL;
+}
+
+static void handoff_answered(int holder, int ok);
+
+void handoff_check(void) {
+  handoff_state *handoff = handoff_self();
+  if (!hash_ring_joining()) return;
+
+  int waiting = 0;
+  int again[HANDOFF_HOLDERS];
+  int agains = 0;
+  time_t now = time(NULL);
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    // we haven't heard who the members are yet
+    if (!handoff->holder_count) return;
+    for (int i = 0; i < handoff->holder_count; i++) {
+      handoff_holder *h = &handoff->holders[i];
+      waiting += h->state != HANDOFF_OVER;
+      // REFUSED -> ASKED, a tick after they turned us away
+      if (h->state == HANDOFF_REFUSED && now > h->asked_at) {
+        h->state = HANDOFF_ASKED;
+        h->asked_at = now;
+        again[agains++] = h->peer;
+      }
+    }
+  }
+
+  if (waiting && now < handoff->deadline) {
+    for (int i = 0; i < agains; i++) {
+      printf("> Asking Peer %d for our keys again\n", again[i]);
+      if (handoff_send_req(again[i]) < 0) handoff_answered(again[i], 0);
+    }
+    return;
+  }
+
+  if (waiting) {
+    fprintf(stderr, "Error: %d peers never handed us our keys, "
+                    "taking over without them\n", waiting);
+  }
+  // now that we have our keys everyone can route to us
+  if (hash_ring_set_joining(0)) {
+    printf("> Handoffs are over, we now own our keys\n");
+    int succ = get_first_successor(0);
+    if (succ != -1) tcp_send_members(succ);
+  }
+}
+
+/*
+  Start waiting on a holder.
+  Requires handoff->lock, returns 1 if we hadn't asked them yet.
+ */
+static int handoff_holder_add(handoff_state *handoff, int peer) {
+  if (handoff_holder_find(handoff, peer)) return 0;
+  if (handoff->holder_count == HANDOFF_HOLDERS) return 0;
+
+  // everyone we hear of later gets the same time to answer
+  if (!handoff->holder_count) handoff->deadline = time(NULL) + HANDOFF_SECS;
+  handoff->holders[handoff->holder_count++] = (handoff_holder){
+    .peer = peer, .state = HANDOFF_ASKED, .asked_at = time(NULL),
+  };
+  return 1;
+}
+
+void handoff_ask(void) {
+  handoff_state *handoff = handoff_self();
+  int peers[HANDOFF_HOLDERS];
+  int count = hash_ring_live_peers(peers, HANDOFF_HOLDERS);
+
+  for (int i = 0; i < count; i++) {
+    int fresh = 0;
+    SCOPED_MTX_LOCK(&handoff->lock) {
+      fresh = handoff_holder_add(handoff, peers[i]);
+    }
+    if (!fresh) continue;
+
+    printf("> Asking Peer %d for our keys\n", peers[i]);
+    if (handoff_send_req(peers[i]) < 0) {
+      fprintf(stderr, "Error: Couldn't ask %d for our keys\n", peers[i]);
+      handoff_answered(peers[i], 0);
+    }
+  }
+  handoff_check();
+}
+
+/*
+  A holder's last round landed (ok), or its connection broke off and it
+  is asked again till it is out of tries.
+ */
+static void handoff_answered(int holder, int ok) {
+  handoff_state *handoff = handoff_self();
+  int waiting = 0, retry = 0;
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    handoff_holder *h = handoff_holder_find(handoff, holder);
+    if (!h || h->state == HANDOFF_OVER) break;
+    waiting = 1;
+    retry = !ok && ++h->tries < HANDOFF_TRIES;
+    h->state = retry ? HANDOFF_ASKED : HANDOFF_OVER;
+  }
+  // a late (or repeated) handoff, we already took over
+  if (!waiting) return;
+
+  if (retry) {
+    printf("> Handoff from Peer %d broke off, asking again\n", holder);
+    if (handoff_send_req(holder) < 0) handoff_answered(holder, 0);
+    return;
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: Giving up on the keys %d holds for us\n", holder);
+  }
+  handoff_check();
+}
+
+/*
+  ASKED -> REFUSED, the holder had no record to spare (a refusal isn't
+  one of its tries).
+ */
+static void handoff_refused(int holder) {
+  handoff_state *handoff = handoff_self();
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    handoff_holder *h = handoff_holder_find(handoff, holder);
+    if (!h || h->state != HANDOFF_ASKED) break;
+    printf("> Peer %d is busy, asking again later\n", holder);
+    h->state = HANDOFF_REFUSED;
+  }
+}
+
+int handoff_forward(int file, int peer, int flags) {
+  if (flags & TCP_RETRIEVE_HOLDER) return 0;
+
+  // whoever held it is the next peer round the ring from us
+  int replicas[2];
+  if (hash_ring_replicas(file, replicas, 2) < 2 ||
+      replicas[0] != get_peer()) {
+    return 0;
+  }
+  int holder = replicas[1];
+
+  handoff_state *handoff = handoff_self();
+  int asked = 0;
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    asked = handoff_holder_find(handoff, holder) != NULL;
+  }
+  if (!asked) return 0;
+
+  int64_t fields[] = {file, peer, holder, holder,
+                      flags | TCP_RETRIEVE_HOLDER};
+  if (handoff_send(holder, TCP_RETRIEVE, fields, 5) < 0) return 0;
+  stats_forwarded(TCP_RETRIEVE);
+  printf("> Retrieve %d request forwarded to Peer %d, who held it before us\n",
+         file, holder);
+  return 1;
+}
+
+int handoff_rx_keys(handoff_rx **rx, const proto_msg *msg, int holder,
+                    int total) {
+  // late ones are still taken, their holder hangs on to them till then
+  if (holder < 0 || total < 0 || total > HANDOFF_ROUND_KEYS) return -1;
+
+  if (!*rx) {
+    *rx = malloc(sizeof(**rx) + total * sizeof(int));
+    if (!*rx) return -1;
+    **rx = (handoff_rx){.holder = holder, .total = total};
+  }
+
+  handoff_rx *at = *rx;
+  int count = proto_get_keys(msg, at->files + at->count,
+                             at->total - at->count);
+  if (holder != at->holder || total != at->total || count < 0) {
+    fprintf(stderr, "Error: Invalid handoff from %d\n", holder);
+    return -1;
+  }
+  at->count += count;
+  return 0;
+}
+
+int handoff_rx_done(handoff_rx **rx, int holder, int count, int round,
+                    int flags) {
+  handoff_rx *at = *rx;
+  if (flags & HANDOFF_BUSY && !at) {
+    handoff_refused(holder);
+    return 0;
+  }
+
+  // a holder with nothing for us just sends this
+  int landed = round >= 0 &&
+               (at ? holder == at->holder && count == at->total &&
+                     at->count == at->total && !at->failed :
+                     holder >= 0 && count == 0);
+  if (!landed) {
+    fprintf(stderr, "Error: Handoff from %d didn't land\n", holder);
+    return -1;
+  }
+
+  for (int i = 0; at && i < at->count; i++) {
+    if (tcp_store_key(at->files[i]) < 0) {
+      fprintf(stderr, "Error: Failed to store %d\n", at->files[i]);
+    }
+  }
+  printf("> Peer %d handed us %d keys\n", holder, count);
+  *rx = NULL;
+  free(at);
+
+  handoff_send(holder, TCP_HANDOFF_ACK,
+               (int64_t[]){get_peer(), count, round}, 3);
+  // ASKED -> OVER only once the last round has landed
+  if (!(flags & HANDOFF_MORE)) handoff_answered(holder, 1);
+  return 0;
+}
+
+void handoff_rx_abort(handoff_rx **rx) {
+  if (!*rx) return;
+  int holder = (*rx)->holder;
+  free(*rx);
+  *rx = NULL;
+  handoff_answered(holder, 0);
+}
+
+/**
+ * The holders.
+ **/
+
+/*
+  The record of the handoff to peer, NULL if there isn't one.
+  Requires handoff->lock.
+ */
+static handoff_record *handoff_record_find(handoff_state *handoff,
+                                           int peer) {
+  for (int i = 0; i < HANDOFF_RECORDS; i++) {
+    handoff_record *at = &handoff->records[i];
+    if (at->state != HANDOFF_FREE && at->peer == peer) return at;
+  }
+  return NULL;
+}
+
+/*
+  -> FREE
+  Requires handoff->lock.
+ */
+static void handoff_record_clear(handoff_state *handoff,
+                                 handoff_record *at) {
+  if (at->state != HANDOFF_FREE) atomic_fetch_sub(&handoff->open, 1);
+  free(at->files);
+  free(at->pending);
+  hash_ring_view_free(&at->view);
+  *at = (handoff_record){.peer = -1};
+}
+
+/*
+  Append count keys to a list, if it can't grow we lose track of them.
+ */
+static void handoff_append(int **list, int *len, int *cap, const int *keys,
+                           int count, int *lost) {
+  if (*len + count > *cap) {
+    int grown = *cap ? *cap : 64;
+    while (grown < *len + count) grown *= 2;
+    int *next = realloc(*list, grown * sizeof(*next));
+    if (!next) {
+      *lost = 1;
+      return;
+    }
+    *list = next;
+    *cap = grown;
+  }
+  memcpy(*list + *len, keys, count * sizeof(*keys));
+  *len += count;
+}
+
+/*
+  Whether peer is one of the replicas of key once it is in the ring.
+ */
+static int handoff_theirs(const hash_ring_view *view, int peer,
+                          int64_t key) {
+  int replicas[HASH_RING_MAX_REPLICAS];
+  int count = hash_ring_view_replicas(view, key, replicas,
+                                      hash_ring_replica_count());
+  for (int i = 0; i < count; i++) {
+    if (replicas[i] == peer) return 1;
+  }
+  return 0;
+}
+
+/*
+  Whether every key we handed over has landed, so we can drop them.
+  Requires handoff->lock.
+ */
+static int handoff_landed(const handoff_record *at) {
+  return at->state == HANDOFF_SENT && at->rounds &&
+         at->acked >= at->rounds && !at->pending_count && !at->lost;
+}
+
+/*
+  The slot for a handoff to peer, theirs if they asked before, else a
+  free one, else one that has landed (its keys just stay with us as
+  well).  NULL if every slot is a handoff that hasn't landed, or we are
+  still sending them the last one they asked for.
+  Requires handoff->lock.
+ */
+static handoff_record *handoff_record_slot(handoff_state *handoff,
+                                           int peer) {
+  handoff_record *at = handoff_record_find(handoff, peer);
+  if (at && at->state == HANDOFF_SENDING) return NULL;
+  for (int i = 0; i < HANDOFF_RECORDS && !at; i++) {
+    if (handoff->records[i].state == HANDOFF_FREE) at = &handoff->records[i];
+  }
+  for (int i = 0; i < HANDOFF_RECORDS && !at; i++) {
+    if (handoff_landed(&handoff->records[i])) at = &handoff->records[i];
+  }
+  return at;
+}
+
+static void handoff_flush(void *arg);
+
+/*
+  SENT -> SENDING if there are keys left to send, returns 1 if the
+  caller has to start a worker on them.
+  Requires handoff->lock.
+ */
+static int handoff_resend(handoff_record *at) {
+  if (at->state != HANDOFF_SENT || !at->pending_count) return 0;
+  at->state = HANDOFF_SENDING;
+  return 1;
+}
+
+void handoff_release(void) {
+  handoff_state *handoff = handoff_self();
+  key_store *store = &p2p_node_current()->tcp.store;
+  for (int i = 0; i < HANDOFF_RECORDS; i++) {
+    handoff_record record = {.peer = -1};
+    int flush = -1;
+    SCOPED_MTX_LOCK(&handoff->lock) {
+      handoff_record *at = &handoff->records[i];
+      if (at->state == HANDOFF_FREE) break;
+      // keys whose last send broke off get another go
+      if (handoff_resend(at)) flush = at->peer;
+      // SENT -> FREE
+      if (!handoff_landed(at) || !hash_ring_alive(at->peer)) break;
+      record = *at;
+      // the files are ours now
+      at->files = NULL;
+      handoff_record_clear(handoff, at);
+    }
+    if (flush != -1) work_submit(handoff_flush, (void *)(size_t)flush);
+    if (record.peer == -1) continue;
+
+    int dropped = 0;
+    for (int j = 0; j < record.count; j++) {
+      int replicas[HASH_RING_MAX_REPLICAS];
+      int count = hash_ring_replicas(record.files[j], replicas,
+                                     hash_ring_replica_count());
+      int ours = 0;
+      for (int r = 0; r < count && !ours; r++) {
+        ours = replicas[r] == get_peer();
+      }
+
+      key_entry old;
+      if (!ours && key_store_remove(store, record.files[j], &old)) {
+        store_index_free(old.slot);
+        dropped++;
+      }
+    }
+    printf("> Peer %d took over %d of our keys\n", record.peer, dropped);
+    free(record.files);
+  }
+}
+
+void handoff_track(int key) {
+  handoff_state *handoff = handoff_self();
+  if (!atomic_load(&handoff->open) || hash_ring_owner(key) != get_peer()) {
+    return;
+  }
+
+  int flush[HANDOFF_RECORDS];
+  int flushes = 0;
+  SCOPED_MTX_LOCK(&handoff->lock) for (int i = 0; i < HANDOFF_RECORDS; i++) {
+    handoff_record *at = &handoff->records[i];
+    if (at->state == HANDOFF_FREE ||
+        !handoff_theirs(&at->view, at->peer, key)) {
+      continue;
+    }
+    handoff_append(&at->pending, &at->pending_count, &at->pending_cap, &key,
+                   1, &at->lost);
+    if (handoff_resend(at)) flush[flushes++] = at->peer;
+  }
+  for (int i = 0; i < flushes; i++) {
+    work_submit(handoff_flush, (void *)(size_t)flush[i]);
+  }
+}
+
+/*
+  Stream a round of keys and then every file of them to the new peer,
+  flags are HANDOFF_* flags.
+ */
+static int handoff_stream(int sock, int peer, const int *files, int count,
+                          int flags) {
+  // the keys first, as many to a msg as fit
+  int64_t fields[] = {get_peer(), count};
+  for (int i = 0; i < count; i += TCP_BATCH_MAX_KEYS) {
+    char keys[TCP_BATCH_MAX_KEYS * PROTO_KEY_LEN];
+    int n = count - i < TCP_BATCH_MAX_KEYS ? count - i : TCP_BATCH_MAX_KEYS;
+    size_t len = proto_put_keys(keys, files + i, n);
+
+    char buf[PROTO_MAX_MSG];
+    int msg_len = proto_encode_fmt(buf, sizeof(buf), PROTO_BINARY,
+                                   TCP_HANDOFF, 0, proto_next_req_id(),
+                                   fields, 2, keys, len);
+    if (msg_len < 0 || tcp_send_all(sock, buf, msg_len, 0) < 0) return -1;
+  }
+
+  static const char *exts[] = {"txt", "pdf"};
+  for (int i = 0; i < count; i++) {
+    for (int e = 0; e < 2; e++) {
+      char name[TRANSFER_PATH_LEN];
+      snprintf(name, sizeof(name), "%d.%s", files[i], exts[e]);
+      // we don't have every extension of every file
+      if (access(name, R_OK)) continue;
+
+      ssize_t sent = transfer_send_on(sock, files[i], name, name,
+                                      TRANSFER_HANDOFF);
+      if (sent < 0) return -1;
+      stats_file_sent(sent);
+    }
+  }
+
+  // they ack the round, the keys are only dropped once every round has
+  handoff_state *handoff = handoff_self();
+  int round = 0;
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    round = handoff->next_round++;
+    handoff_record *at = handoff_record_find(handoff, peer);
+    if (at) at->rounds++;
+  }
+  return handoff_send_on(sock, TCP_HANDOFF_DONE,
+                         (int64_t[]){get_peer(), count, round, flags}, 4);
+}
+
+/*
+  Stream keys in as many rounds as it takes, every round but the last
+  tells them another follows.
+ */
+static int handoff_rounds(int sock, int peer, const int *files, int count) {
+  int from = 0;
+  do {
+    int round = count - from < HANDOFF_ROUND_KEYS ? count - from :
+                HANDOFF_ROUND_KEYS;
+    int flags = from + round < count ? HANDOFF_MORE : 0;
+    if (handoff_stream(sock, peer, files + from, round, flags) < 0) {
+      return -1;
+    }
+    from += round;
+  } while (from < count);
+  return 0;
+}
+
+/*
+  While SENDING, send the keys stored in a peer's range since its
+  handoff started as rounds of their own till there are none left
+  (-> SENT).  sock is a connection to them we already have (-1 if there
+  isn't one), it is closed once we are done.
+ */
+static void handoff_flush_on(int sock, int peer) {
+  handoff_state *handoff = handoff_self();
+  for (;;) {
+    int *files = NULL;
+    int count = 0;
+    SCOPED_MTX_LOCK(&handoff->lock) {
+      handoff_record *at = handoff_record_find(handoff, peer);
+      if (!at) break;
+      if (!at->pending_count) {
+        at->state = HANDOFF_SENT;
+        break;
+      }
+      files = at->pending;
+      count = at->pending_count;
+      at->pending = NULL;
+      at->pending_count = at->pending_cap = 0;
+      // they are dropped with the rest once they have landed
+      handoff_append(&at->files, &at->count, &at->cap, files, count,
+                     &at->lost);
+    }
+    if (!files) break;
+
+    if (sock < 0) sock = tcp_connect(peer);
+    if (sock < 0 || handoff_rounds(sock, peer, files, count) < 0) {
+      fprintf(stderr, "Error: Failed to hand %d more keys to %d\n", count,
+              peer);
+      // they go again on the next release
+      SCOPED_MTX_LOCK(&handoff->lock) {
+        handoff_record *at = handoff_record_find(handoff, peer);
+        if (!at) break;
+        handoff_append(&at->pending, &at->pending_count, &at->pending_cap,
+                       files, count, &at->lost);
+        at->state = HANDOFF_SENT;
+      }
+      free(files);
+      break;
+    }
+    printf("> Handed %d more keys to Peer %d\n", count, peer);
+    free(files);
+  }
+
+  if (sock >= 0) {
+    shutdown(sock, SHUT_WR);
+    close(sock);
+  }
+}
+
+static void handoff_flush(void *arg) {
+  handoff_flush_on(-1, (size_t)arg);
+}
+
+typedef struct handoff_scan_t {
+  hash_ring_view view;
+  int peer;
+  int count;
+  int cap;
+  int *files;
+  // we ran out of memory, they have to ask again
+  int failed;
+} handoff_scan;
+
+/*
+  Collect a key if it is ours to hand over, we are its owner now and
+  the new peer will be one of its replicas.
+ */
+static void handoff_collect(const key_entry *entry, void *arg) {
+  handoff_scan *scan = arg;
+  if (hash_ring_owner(entry->key) != get_peer()) return;
+  if (!handoff_theirs(&scan->view, scan->peer, entry->key)) return;
+
+  handoff_append(&scan->files, &scan->count, &scan->cap,
+                 (int[]){entry->key}, 1, &scan->failed);
+}
+
+/*
+  Tell a joining peer we have no record to spare right now.
+ */
+static int handoff_send_busy(int peer) {
+  int64_t fields[] = {get_peer(), 0, 0, HANDOFF_BUSY};
+  return handoff_send(peer, TCP_HANDOFF_DONE, fields, 4);
+}
+
+typedef struct handoff_task_t {
+  int peer;
+  uint32_t vnodes;
+} handoff_task;
+
+/*
+  FREE -> SENDING, scan our keys for theirs and stream them.
+ */
+static void handoff_task_run(void *arg) {
+  handoff_task *task = arg;
+  handoff_state *handoff = handoff_self();
+  handoff_scan scan = {.peer = task->peer};
+  hash_ring_view view = {0};
+  if (hash_ring_view_with(&scan.view, task->peer, task->vnodes) ||
+      hash_ring_view_with(&view, task->peer, task->vnodes)) {
+    fprintf(stderr, "Error: Couldn't work out the keys of %d\n", task->peer);
+    hash_ring_view_free(&scan.view);
+    free(task);
+    return;
+  }
+
+  // the record goes up before the scan, so anything stored from here
+  // on that the scan misses is sent to them after it
+  int full = 0;
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    handoff_record *at = handoff_record_slot(handoff, task->peer);
+    if (!at) {
+      full = 1;
+      break;
+    }
+    handoff_record_clear(handoff, at);
+    *at = (handoff_record){
+      .state = HANDOFF_SENDING, .peer = task->peer, .view = view,
+      .first_round = handoff->next_round,
+    };
+    atomic_fetch_add(&handoff->open, 1);
+  }
+  if (full) {
+    printf("> Too many handoffs going, Peer %d has to wait\n", task->peer);
+    hash_ring_view_free(&view);
+  } else {
+    key_store_iterate(&p2p_node_current()->tcp.store, handoff_collect, &scan);
+  }
+  hash_ring_view_free(&scan.view);
+
+  // remember them, we hold on to them till they own them
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    handoff_record *at = full ? NULL : handoff_record_find(handoff, task->peer);
+    if (!at) break;
+    if (scan.failed) {
+      fprintf(stderr, "Error: Ran out of memory collecting the keys of %d\n",
+              task->peer);
+      handoff_record_clear(handoff, at);
+      break;
+    }
+    handoff_append(&at->files, &at->count, &at->cap, scan.files, scan.count,
+                   &at->lost);
+  }
+  if (full || scan.failed) {
+    if (handoff_send_busy(task->peer) < 0) {
+      fprintf(stderr, "Error: Couldn't tell %d to ask again\n", task->peer);
+    }
+    free(scan.files);
+    free(task);
+    return;
+  }
+
+  printf("> Handing %d keys to Peer %d\n", scan.count, task->peer);
+  int sock = tcp_connect(task->peer);
+  if (sock >= 0 &&
+      handoff_rounds(sock, task->peer, scan.files, scan.count) >= 0) {
+    handoff_flush_on(sock, task->peer);
+  } else {
+    fprintf(stderr, "Error: Failed to hand our keys to %d\n", task->peer);
+    // they ask again, whatever was stored meanwhile goes with the scan
+    SCOPED_MTX_LOCK(&handoff->lock) {
+      handoff_record *at = handoff_record_find(handoff, task->peer);
+      if (at) at->state = HANDOFF_SENT;
+    }
+    if (sock >= 0) close(sock);
+  }
+  free(scan.files);
+  free(task);
+}
+
+int handoff_start(int peer, uint32_t vnodes) {
+  handoff_task *task = malloc(sizeof(*task));
+  if (!task) return -1;
+  *task = (handoff_task){.peer = peer, .vnodes = vnodes};
+  // the scan and the transfers take a while
+  work_submit(handoff_task_run, task);
+  return 0;
+}
+
+void handoff_acked(int peer, int round) {
+  handoff_state *handoff = handoff_self();
+  SCOPED_MTX_LOCK(&handoff->lock) {
+    handoff_record *at = handoff_record_find(handoff, peer);
+    // rounds of a handoff they asked for again don't count
+    if (at && round >= at->first_round) at->acked++;
+  }
+  // they may already be in our view
+  handoff_release();
+}
+
+int handoff_open_count(void) {
+  return atomic_load(&handoff_self()->open);
+}
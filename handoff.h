@@ -0,0 +1,241 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_HANDOFF_H__
+#define __P2P_HANDOFF_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hash_ring.h"
+#include "proto.h"
+#include "utils.h"
+
+/**                                                        **
+ * Handing a joining peer the keys it will hold, before it  *
+ * takes them over (so retrieves never find it empty).      *
+ *                                                          *
+ * The joining peer waits on every live member (a holder): *
+ *                                                          *
+ *   ASKED --DONE (last round landed)--------> OVER         *
+ *   ASKED --DONE with HANDOFF_BUSY----------> REFUSED      *
+ *   REFUSED --next handoff_check------------> ASKED        *
+ *   ASKED --connection broke, tries left----> ASKED        *
+ *   ASKED --connection broke, out of tries--> OVER         *
+ *                                                          *
+ * and takes over once every holder is OVER (or it has had  *
+ * HANDOFF_SECS).  It keeps its holders after that, so a    *
+ * key it owns but misses is asked of whoever had it.       *
+ *                                                          *
+ * Every holder keeps a record of a handoff it is sending:  *
+ *                                                          *
+ *   FREE --HANDOFF_REQ, a slot to spare-----> SENDING      *
+ *   FREE --HANDOFF_REQ, none to spare-------> (BUSY)       *
+ *   SENDING --no keys left to send----------> SENT         *
+ *   SENDING --a send broke off--------------> SENT         *
+ *   SENT --a key stored in their range------> SENDING      *
+ *   SENT --landed and they are in our view--> FREE         *
+ *                                                          *
+ * SENDING is one worker streaming rounds on a connection   *
+ * of its own (the scan, then every key stored since), so a *
+ * file is never on its way to them twice at once.  A       *
+ * record has landed once they have acked every round and   *
+ * nothing is left to send, only then are the keys we no    *
+ * longer replicate dropped.  A record that hasn't landed   *
+ * is never given up for another.                           *
+ **                                                        **/
+
+// How long a joining peer waits for its holders to hand its keys over
+// before it takes over without them, and how often it asks a holder
+// whose handoff broke off
+#define HANDOFF_SECS (30)
+#define HANDOFF_TRIES (3)
+// Holders a joining peer can wait on
+#define HANDOFF_HOLDERS (256)
+// Handoffs a holder sends at once (it turns more away till one has
+// landed), and the most keys one round of a handoff carries
+#define HANDOFF_RECORDS (8)
+#define HANDOFF_ROUND_KEYS (1 << 20)
+
+// The flags of a TCP_HANDOFF_DONE
+// another round of the handoff follows on the connection
+#define HANDOFF_MORE (1 << 0)
+// the holder can't hand them over right now, ask again later
+#define HANDOFF_BUSY (1 << 1)
+
+/*
+  The messages, see tcp.h for their fields.
+
+  TCP_HANDOFF_REQ   joining peer -> every live member
+    Hand us the keys we'll hold, the holder works out which from the
+    ring with the joining peer in it (and its vnodes).
+
+  TCP_HANDOFF       holder -> joining peer, on a connection of its own
+    The keys of a round, as many to a msg as fit.  Every file of them
+    follows as a TCP_TRANSFER with TRANSFER_HANDOFF.
+
+  TCP_HANDOFF_DONE  holder -> joining peer, on the same connection
+    Ends a round, the keys are stored once every file of them landed.
+    HANDOFF_MORE says another round follows, HANDOFF_BUSY (sent on
+    its own) that the holder has no record to spare.
+
+  TCP_HANDOFF_ACK   joining peer -> holder
+    A round has been stored, the holder counts it towards the record
+    landing.
+ */
+
+typedef enum handoff_holder_state_t {
+  HANDOFF_ASKED,
+  HANDOFF_REFUSED,
+  HANDOFF_OVER,
+} handoff_holder_state;
+
+// A holder of some of the keys of a joining peer
+typedef struct handoff_holder_t {
+  int peer;
+  handoff_holder_state state;
+  // connections that broke off
+  int tries;
+  // when we last asked, a refused holder is asked on a later check
+  time_t asked_at;
+} handoff_holder;
+
+typedef enum handoff_record_state_t {
+  HANDOFF_FREE,
+  HANDOFF_SENDING,
+  HANDOFF_SENT,
+} handoff_record_state;
+
+// A handoff we are sending to a joining peer
+typedef struct handoff_record_t {
+  handoff_record_state state;
+  int peer;
+  // the ring once they are in it, keys we store in their range till
+  // they own them are sent on to them
+  hash_ring_view view;
+
+  // rounds sent since (and including) first_round, and how many of
+  // them they have stored
+  int first_round;
+  int rounds;
+  int acked;
+
+  // keys stored since the scan still to be sent
+  int pending_count;
+  int pending_cap;
+  int *pending;
+  // a key we couldn't keep track of, we hold on to everything
+  int lost;
+
+  // every key sent, we drop them once the record lands
+  int count;
+  int cap;
+  int *files;
+} handoff_record;
+
+// The keys of a handoff we are receiving on a connection, they are
+// only stored once every file of them has landed
+typedef struct handoff_rx_t {
+  int holder;
+  int total;
+  int count;
+  // set if one of the files didn't make it
+  int failed;
+  int files[];
+} handoff_rx;
+
+typedef struct handoff_state_t {
+  // while we join, the members we asked for our keys
+  handoff_holder holders[HANDOFF_HOLDERS];
+  int holder_count;
+  time_t deadline;
+
+  // the handoffs we are sending
+  handoff_record records[HANDOFF_RECORDS];
+  // records in use, stores only look at them if there are any
+  _Atomic int open;
+  // the id of the next round we send
+  int next_round;
+
+  pthread_mutex_t lock;
+} handoff_state;
+
+/*
+  Set up a node's handoff state, nothing is being handed over.
+ */
+void handoff_state_init(handoff_state *handoff);
+
+/*
+  Free the handoff state (any records still open).
+ */
+void handoff_state_free(handoff_state *handoff);
+
+/*
+  While we are joining, ask every live member we haven't yet for our
+  keys (called whenever we hear of more members).
+ */
+void handoff_ask(void);
+
+/*
+  While we are joining, ask refused holders again and take over our keys
+  once every holder is over (or has had HANDOFF_SECS).
+ */
+void handoff_check(void);
+
+/*
+  A retrieve of a key we own but don't have, ask the peer that held it
+  before we joined (flags are TCP_RETRIEVE flags, a retrieve that was
+  already sent to them isn't).  Returns 1 if it went to them.
+ */
+int handoff_forward(int file, int peer, int flags);
+
+/*
+  A TCP_HANDOFF on a connection, *rx collects the keys of its round.
+  Returns -1 if the msg is invalid.
+ */
+int handoff_rx_keys(handoff_rx **rx, const proto_msg *msg, int holder,
+                    int total);
+
+/*
+  A TCP_HANDOFF_DONE on a connection, stores the keys of the round in
+  *rx (if it landed) and acks it.  Returns -1 if it didn't land.
+ */
+int handoff_rx_done(handoff_rx **rx, int holder, int count, int round,
+                    int flags);
+
+/*
+  The connection *rx came in on closed before its round was done.
+ */
+void handoff_rx_abort(handoff_rx **rx);
+
+/*
+  A TCP_HANDOFF_REQ, a worker hands the peer (with vnodes) its keys.
+ */
+int handoff_start(int peer, uint32_t vnodes);
+
+/*
+  A TCP_HANDOFF_ACK of a round we sent peer.
+ */
+void handoff_acked(int peer, int round);
+
+/*
+  Drop the keys of records that have landed once their peer is in our
+  view, and resend what a broken send left behind.
+ */
+void handoff_release(void);
+
+/*
+  We just stored key, if it is in the range of a peer we are handing
+  keys to it is sent on to them as well.
+ */
+void handoff_track(int key);
+
+/*
+  How many records are open (for the stats).
+ */
+int handoff_open_count(void);
+
+#endif
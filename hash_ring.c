@@ -0,0 +1,395 @@
+#include "hash_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "p2p_node.h"
+#include "proto.h"
+
+/*
+  The ring of the node this thread works for.
+ */
+static inline hash_ring_state *hash_ring_self(void) {
+  return &p2p_node_current()->ring;
+}
+
+void hash_ring_state_init(hash_ring_state *ring) {
+  ring->member_count = 0;
+  ring->tokens = NULL;
+  ring->token_count = 0;
+  atomic_init(&ring->generation, 0);
+  ring->self = -1;
+  ring->self_vnodes = HASH_RING_DEFAULT_VNODES;
+  ring->replica_count = HASH_RING_DEFAULT_REPLICAS;
+  ring->joining = 0;
+  pthread_rwlock_init(&ring->lock, NULL);
+}
+
+void hash_ring_state_free(hash_ring_state *ring) {
+  free(ring->tokens);
+  ring->tokens = NULL;
+  ring->token_count = 0;
+  pthread_rwlock_destroy(&ring->lock);
+}
+
+static inline uint64_t hash_ring_token_of(int peer, uint32_t vnode) {
+  return mix64(((uint64_t)peer << 32 | vnode) ^ HASH_RING_TOKEN_SEED);
+}
+
+static int hash_ring_token_cmp(const void *a, const void *b) {
+  const hash_ring_token *x = a, *y = b;
+  if (x->token != y->token) return x->token < y->token ? -1 : 1;
+  return (x->peer > y->peer) - (x->peer < y->peer);
+}
+
+/*
+  The sorted tokens of every live member (leaving us out while we are
+  joining) and of peer with vnodes tokens (unless peer is -1).
+  Requires ring->lock.
+ */
+static hash_ring_token *hash_ring_tokens(const hash_ring_state *ring,
+                                         int peer, uint32_t vnodes,
+                                         size_t *count) {
+  const hash_ring_member *members = ring->members;
+  *count = peer == -1 ? 0 : vnodes;
+  for (int i = 0; i < ring->member_count; i++) {
+    if (!members[i].alive || members[i].peer == peer ||
+        (ring->joining && members[i].peer == ring->self)) {
+      continue;
+    }
+    *count += members[i].vnodes;
+  }
+
+  hash_ring_token *tokens = malloc(*count * sizeof(*tokens) + 1);
+  if (!tokens) return NULL;
+
+  size_t at = 0;
+  for (uint32_t v = 0; peer != -1 && v < vnodes; v++) {
+    tokens[at++] = (hash_ring_token){
+      .token = hash_ring_token_of(peer, v), .peer = peer,
+    };
+  }
+  for (int i = 0; i < ring->member_count; i++) {
+    if (!members[i].alive || members[i].peer == peer ||
+        (ring->joining && members[i].peer == ring->self)) {
+      continue;
+    }
+    for (uint32_t v = 0; v < members[i].vnodes; v++) {
+      tokens[at++] = (hash_ring_token){
+        .token = hash_ring_token_of(members[i].peer, v),
+        .peer = members[i].peer,
+      };
+    }
+  }
+  qsort(tokens, *count, sizeof(*tokens), hash_ring_token_cmp);
+  return tokens;
+}
+
+/*
+  Requires ring->lock (write).
+ */
+static void hash_ring_rebuild(hash_ring_state *ring) {
+  size_t count;
+  hash_ring_token *next = hash_ring_tokens(ring, -1, 0, &count);
+  if (!next) {
+    fprintf(stderr, "Error: Couldn't rebuild the hash ring\n");
+    return;
+  }
+
+  free(ring->tokens);
+  ring->tokens = next;
+  ring->token_count = count;
+  atomic_fetch_add_explicit(&ring->generation, 1, memory_order_release);
+}
+
+/*
+  Requires ring->lock.
+ */
+static hash_ring_member *hash_ring_find(hash_ring_state *ring, int peer) {
+  for (int i = 0; i < ring->member_count; i++) {
+    if (ring->members[i].peer == peer) return &ring->members[i];
+  }
+  return NULL;
+}
+
+/*
+  Apply what someone else thinks of a member.
+  Requires ring->lock (write), returns 1 if the ring changed.
+ */
+static int hash_ring_apply(hash_ring_state *ring,
+                           const hash_ring_member *update) {
+  if (update->vnodes == 0 || update->vnodes > HASH_RING_MAX_VNODES) return 0;
+
+  hash_ring_member *m = hash_ring_find(ring, update->peer);
+  if (update->peer == ring->self) {
+    // someone thinks we are dead, outlive that rumour
+    if (m && !update->alive && update->incarnation >= m->incarnation) {
+      m->incarnation = update->incarnation + 1;
+    }
+    return 0;
+  }
+
+  if (!m) {
+    if (ring->member_count == HASH_RING_MAX_MEMBERS) return 0;
+    ring->members[ring->member_count++] = *update;
+    return update->alive;
+  }
+
+  if (update->incarnation > m->incarnation ||
+      (update->incarnation == m->incarnation && m->alive && !update->alive)) {
+    int changed = m->alive != update->alive || m->vnodes != update->vnodes;
+    *m = *update;
+    return changed;
+  }
+
+  return 0;
+}
+
+int hash_ring_set_replicas(int replicas) {
+  if (replicas <= 0 || replicas > HASH_RING_MAX_REPLICAS) return -1;
+  hash_ring_self()->replica_count = replicas;
+  return 0;
+}
+
+int hash_ring_replica_count(void) {
+  return hash_ring_self()->replica_count;
+}
+
+int hash_ring_set_vnodes(int vnodes) {
+  if (vnodes <= 0 || vnodes > HASH_RING_MAX_VNODES) return -1;
+  hash_ring_self()->self_vnodes = vnodes;
+  return 0;
+}
+
+void hash_ring_init(int self) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &ring->lock) {
+    ring->self = self;
+    ring->members[0] = (hash_ring_member){
+      .peer = self, .incarnation = (uint32_t)time(NULL),
+      .vnodes = ring->self_vnodes, .alive = 1,
+    };
+    ring->member_count = 1;
+    hash_ring_rebuild(ring);
+  }
+}
+
+uint32_t hash_ring_vnodes(void) {
+  return hash_ring_self()->self_vnodes;
+}
+
+uint32_t hash_ring_incarnation(void) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    return ring->member_count ? ring->members[0].incarnation : 0;
+  }
+  return 0;
+}
+
+uint32_t hash_ring_generation(void) {
+  return atomic_load_explicit(&hash_ring_self()->generation,
+                              memory_order_acquire);
+}
+
+/*
+  The first token at or after the key's hash (wrapping around).
+  Requires atleast one token.
+ */
+static size_t hash_ring_search(const hash_ring_token *tokens, size_t count,
+                               int64_t key) {
+  uint64_t hash = mix64((uint64_t)key ^ HASH_RING_KEY_SEED);
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (tokens[mid].token < hash) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo == count ? 0 : lo;
+}
+
+/*
+  The owner of a key then the next distinct peers after it.
+ */
+static int hash_ring_walk(const hash_ring_token *tokens, size_t count,
+                          int64_t key, int *peers, int max) {
+  if (!count) return 0;
+
+  int found = 0;
+  size_t at = hash_ring_search(tokens, count, key);
+  for (size_t seen = 0; seen < count && found < max; seen++) {
+    int peer = tokens[(at + seen) % count].peer;
+    int dup = 0;
+    for (int i = 0; i < found && !dup; i++) dup = peers[i] == peer;
+    if (!dup) peers[found++] = peer;
+  }
+  return found;
+}
+
+int hash_ring_owner(int64_t key) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    if (!ring->token_count) return -1;
+    return ring->tokens[hash_ring_search(ring->tokens, ring->token_count,
+                                         key)].peer;
+  }
+  return -1;
+}
+
+int hash_ring_replicas(int64_t key, int *peers, int max) {
+  hash_ring_state *ring = hash_ring_self();
+  int count = 0;
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    count = hash_ring_walk(ring->tokens, ring->token_count, key, peers, max);
+  }
+  return count;
+}
+
+int hash_ring_view_with(hash_ring_view *view, int peer, uint32_t vnodes) {
+  if (vnodes == 0 || vnodes > HASH_RING_MAX_VNODES) return -1;
+
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    view->tokens = hash_ring_tokens(ring, peer, vnodes, &view->token_count);
+  }
+  return view->tokens ? 0 : -1;
+}
+
+int hash_ring_view_replicas(const hash_ring_view *view, int64_t key,
+                            int *peers, int max) {
+  return hash_ring_walk(view->tokens, view->token_count, key, peers, max);
+}
+
+void hash_ring_view_free(hash_ring_view *view) {
+  free(view->tokens);
+  view->tokens = NULL;
+  view->token_count = 0;
+}
+
+int hash_ring_add(int peer, uint32_t incarnation, uint32_t vnodes) {
+  hash_ring_member update = {
+    .peer = peer, .incarnation = incarnation, .vnodes = vnodes, .alive = 1,
+  };
+
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &ring->lock) {
+    if (!hash_ring_apply(ring, &update)) return 0;
+    hash_ring_rebuild(ring);
+  }
+  return 1;
+}
+
+int hash_ring_remove(int peer) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &ring->lock) {
+    hash_ring_member *m = hash_ring_find(ring, peer);
+    if (peer == ring->self || !m || !m->alive) return 0;
+    m->alive = 0;
+    hash_ring_rebuild(ring);
+  }
+  return 1;
+}
+
+int hash_ring_alive(int peer) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    if (peer == ring->self) return !ring->joining;
+    hash_ring_member *m = hash_ring_find(ring, peer);
+    return m && m->alive;
+  }
+  return 0;
+}
+
+int hash_ring_live_peers(int *peers, int max) {
+  hash_ring_state *ring = hash_ring_self();
+  int count = 0;
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    for (int i = 0; i < ring->member_count && count < max; i++) {
+      const hash_ring_member *m = &ring->members[i];
+      if (m->alive && m->peer != ring->self) peers[count++] = m->peer;
+    }
+  }
+  return count;
+}
+
+int hash_ring_set_joining(int joining) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &ring->lock) {
+    if (ring->joining == !!joining) return 0;
+    ring->joining = !!joining;
+    hash_ring_rebuild(ring);
+  }
+  return 1;
+}
+
+int hash_ring_joining(void) {
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    return ring->joining;
+  }
+  return 0;
+}
+
+int hash_ring_live_count(void) {
+  hash_ring_state *ring = hash_ring_self();
+  int count = 0;
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    for (int i = 0; i < ring->member_count; i++) {
+      count += ring->members[i].alive;
+    }
+  }
+  return count;
+}
+
+size_t hash_ring_encode(char *buf, size_t cap) {
+  size_t len = 0;
+  if (!cap) return 0;
+  buf[0] = '\0';
+
+  hash_ring_state *ring = hash_ring_self();
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &ring->lock) {
+    for (int i = 0; i < ring->member_count; i++) {
+      const hash_ring_member *m = &ring->members[i];
+      // nobody hears of us till our keys have been handed to us
+      if (ring->joining && m->peer == ring->self) continue;
+      int wrote = snprintf(buf + len, cap - len, "%s%c%d:%u:%u",
+                           len ? "," : "", m->alive ? '+' : '-', m->peer,
+                           m->incarnation, m->vnodes);
+      if (wrote < 0 || (size_t)wrote >= cap - len) {
+        buf[len] = '\0';
+        break;
+      }
+      len += wrote;
+    }
+  }
+
+  return len;
+}
+
+int hash_ring_merge(const char *str, size_t len) {
+  char copy[PROTO_MAX_MSG];
+  if (len >= sizeof(copy)) len = sizeof(copy) - 1;
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  hash_ring_state *ring = hash_ring_self();
+  int changed = 0;
+  char *save;
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &ring->lock) {
+    for (char *tok = strtok_r(copy, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+      hash_ring_member update = {.alive = tok[0] == '+'};
+      if ((tok[0] != '+' && tok[0] != '-') ||
+          sscanf(tok + 1, "%d:%u:%u", &update.peer, &update.incarnation,
+                 &update.vnodes) != 3 || update.peer < 0) {
+        continue;
+      }
+      changed |= hash_ring_apply(ring, &update);
+    }
+
+    if (changed) hash_ring_rebuild(ring);
+  }
+
+  return changed;
+}
@@ -0,0 +1,206 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_HASH_RING_H__
+#define __P2P_HASH_RING_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/**                                                      **
+ * Which peer owns a key.                                 *
+ *                                                        *
+ * Every live peer puts vnodes tokens on a 64 bit ring,   *
+ * a key belongs to the peer with the first token at or   *
+ * after the key's hash.  The members behind the ring are *
+ * gossiped between peers so everyone agrees on owners.   *
+ **                                                      **/
+
+#define HASH_RING_DEFAULT_VNODES (64)
+#define HASH_RING_MAX_VNODES (1024)
+
+// how many peers hold each key (the owner + the next distinct peers)
+#define HASH_RING_DEFAULT_REPLICAS (1)
+#define HASH_RING_MAX_REPLICAS (8)
+
+// enough for a couple hundred members in one msg
+#define HASH_RING_MAX_MEMBERS (256)
+
+// keys and tokens are salted differently from the key store's hash
+// so a peer's keys still spread over every key store stripe.
+#define HASH_RING_KEY_SEED (0x9e3779b97f4a7c15ULL)
+#define HASH_RING_TOKEN_SEED (0xc2b2ae3d27d4eb4fULL)
+
+typedef struct hash_ring_member_t {
+  int peer;
+
+  // bumped every time the peer (re)joins, the newest wins
+  uint32_t incarnation;
+
+  // how many tokens the peer puts on the ring
+  uint32_t vnodes;
+
+  // dead members are kept so the death gossips around
+  int alive;
+} hash_ring_member;
+
+typedef struct hash_ring_token_t {
+  uint64_t token;
+  int peer;
+} hash_ring_token;
+
+/*
+  A copy of the ring with a peer added, to work out what
+  will change once it joins.
+ */
+typedef struct hash_ring_view_t {
+  hash_ring_token *tokens;
+  size_t token_count;
+} hash_ring_view;
+
+typedef struct hash_ring_state_t {
+  hash_ring_member members[HASH_RING_MAX_MEMBERS];
+  int member_count;
+
+  // sorted by token, rebuilt whenever the live members change
+  hash_ring_token *tokens;
+  size_t token_count;
+
+  // bumped every rebuild, anything remembering who owns
+  // a key is stale once this moves on
+  _Atomic uint32_t generation;
+
+  int self;
+  uint32_t self_vnodes;
+  int replica_count;
+  // set till the keys we own have been handed to us, we stay out of
+  // our own view (and the views we gossip) so nobody routes to us
+  int joining;
+
+  pthread_rwlock_t lock;
+} hash_ring_state;
+
+/*
+  Set up an empty ring with the default vnodes / replicas.
+ */
+void hash_ring_state_init(hash_ring_state *ring);
+
+/*
+  Free the ring's tokens and lock.
+ */
+void hash_ring_state_free(hash_ring_state *ring);
+
+/*
+  Set how many vnodes this peer will claim, only before hash_ring_init.
+  Returns -1 if it is out of range.
+ */
+int hash_ring_set_vnodes(int vnodes);
+
+/*
+  Set how many peers every key is stored on.
+  Returns -1 if it is out of range.
+ */
+int hash_ring_set_replicas(int replicas);
+
+/*
+  How many peers every key is stored on.
+ */
+int hash_ring_replica_count(void);
+
+/*
+  Start a fresh view holding only ourselves.
+ */
+void hash_ring_init(int self);
+
+/*
+  How many vnodes we claim.
+ */
+uint32_t hash_ring_vnodes(void);
+
+/*
+  Our own incarnation (for join requests).
+ */
+uint32_t hash_ring_incarnation(void);
+
+/*
+  Changes whenever the live members (and so the owners) change.
+ */
+uint32_t hash_ring_generation(void);
+
+/*
+  The peer that owns a key, -1 if the ring is empty.
+ */
+int hash_ring_owner(int64_t key);
+
+/*
+  The peers holding a key, the owner first then the next distinct
+  peers around the ring.  Returns how many were written (<= max).
+ */
+int hash_ring_replicas(int64_t key, int *peers, int max);
+
+/*
+  Add / revive a member.
+  Returns 1 if the ring changed.
+ */
+int hash_ring_add(int peer, uint32_t incarnation, uint32_t vnodes);
+
+/*
+  Mark a member as dead.
+  Returns 1 if the ring changed.
+ */
+int hash_ring_remove(int peer);
+
+/*
+  Check if a peer is a live member (we are only once we have joined).
+ */
+int hash_ring_alive(int peer);
+
+/*
+  The live members other than us, returns how many were written (<= max).
+ */
+int hash_ring_live_peers(int *peers, int max);
+
+/*
+  Leave ourselves out of the ring while we join / put us back in.
+  Returns 1 if the ring changed.
+ */
+int hash_ring_set_joining(int joining);
+int hash_ring_joining(void);
+
+/*
+  Copy the ring as it will be once peer (with vnodes tokens) is in it.
+  Returns -1 on failure.
+ */
+int hash_ring_view_with(hash_ring_view *view, int peer, uint32_t vnodes);
+
+/*
+  hash_ring_replicas in a view.
+ */
+int hash_ring_view_replicas(const hash_ring_view *view, int64_t key,
+                            int *peers, int max);
+
+void hash_ring_view_free(hash_ring_view *view);
+
+/*
+  The number of live members.
+ */
+int hash_ring_live_count(void);
+
+/*
+  Write every member as "[+-]peer:incarnation:vnodes,..." into buf.
+  Returns the length written (members that don't fit are skipped).
+ */
+size_t hash_ring_encode(char *buf, size_t cap);
+
+/*
+  Merge in an encoded view from another peer.
+  Returns 1 if the ring changed.
+ */
+int hash_ring_merge(const char *str, size_t len);
+
+#endif
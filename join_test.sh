@@ -0,0 +1,155 @@
+#!/bin/sh
+
+# Stores keys while a peer joins the ring and then retrieves every one of
+# them, the ones the joining peer now owns come back through it.  Every
+# wait polls the peers' stats rather than sleeping a fixed time.
+# Run from the directory with ./p2p in it (make test).
+
+P2P="$(pwd)/p2p"
+DIR="$(mktemp -d)"
+PIDS=""
+PEERS="2 4 5 8 9 6"
+# how long any one wait may take, past the joining peer's HANDOFF_SECS
+LIMIT=60
+
+cleanup() {
+  kill $PIDS 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+cd "$DIR" || exit 1
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+# the fd we write a peer's commands to (sh only goes up to 9)
+fd() {
+  case $1 in
+    2) echo 3 ;; 4) echo 4 ;; 5) echo 5 ;;
+    8) echo 6 ;; 9) echo 7 ;; 6) echo 8 ;;
+  esac
+}
+
+# start <peer> <args...>, the peer reads its commands from a fifo
+start() {
+  peer=$1
+  shift
+  mkfifo "in$peer"
+  stdbuf -oL -eL "$P2P" "$@" < "in$peer" > "out$peer" 2>&1 &
+  PIDS="$PIDS $!"
+  eval "exec $(fd "$peer")> in$peer"
+}
+
+# send <peer> <command>
+send() {
+  eval "echo \"\$2\" >&$(fd "$1")"
+}
+
+# metric <peer> <name>, asks the peer for its stats and prints the value
+# of the metric in the dump that answers it
+metric() {
+  seen=$(grep -c "^$2{" "out$1")
+  send "$1" stats
+  tries=0
+  while [ "$(grep -c "^$2{" "out$1")" -le "$seen" ]; do
+    tries=$((tries + 1))
+    [ "$tries" -lt 100 ] || return 1
+    sleep 0.05
+  done
+  grep "^$2{" "out$1" | tail -n 1 | cut -d' ' -f2
+}
+
+# wait_for <what> <command...>, polls the command till it passes
+wait_for() {
+  what=$1
+  shift
+  end=$(($(date +%s) + LIMIT))
+  until "$@"; do
+    [ "$(date +%s)" -lt "$end" ] || fail "timed out waiting for $what"
+    sleep 0.1
+  done
+}
+
+# every peer given has pinged its successors
+pinging() {
+  for peer in "$@"; do
+    [ "$(metric "$peer" p2p_pings_acked_total)" -gt 0 ] 2>/dev/null ||
+      return 1
+  done
+}
+
+# the keys stored over every peer
+stored() {
+  total=0
+  for peer in $PEERS; do
+    keys=$(metric "$peer" p2p_keys_stored) || return 1
+    total=$((total + keys))
+  done
+  echo "$total"
+}
+
+# there are $1 keys in the ring (with only the one replica)
+all_stored() {
+  [ "$(stored)" = "$1" ]
+}
+
+# the join is over, peer 6 owns its keys and every holder has let them go
+joined() {
+  [ "$(metric 6 p2p_joining)" = 0 ] || return 1
+  for peer in $PEERS; do
+    [ "$(metric "$peer" p2p_handoffs_open)" = 0 ] || return 1
+  done
+}
+
+# every key in the file has been received
+received() {
+  while read -r key; do
+    [ -f "received_$key.txt" ] || return 1
+  done < "$1"
+}
+
+# Keys 1000 - 1299 are in the ring before the join, 2000 - 2199 are
+# stored while it goes on
+seq 1000 1299 > before
+seq 2000 2199 > during
+cat before during > all
+while read -r key; do echo "$key" > "$key.txt"; done < all
+
+start 2 init 2 4 5 2
+start 4 init 4 5 8 2
+start 5 init 5 8 9 2
+start 8 init 8 9 2 2
+start 9 init 9 2 4 2
+wait_for "the ring" pinging 2 4 5 8 9
+
+PEERS="2 4 5 8 9"
+send 2 "store-batch before"
+wait_for "the first stores" all_stored 300
+
+PEERS="2 4 5 8 9 6"
+start 6 join 6 2 2
+for peer in 2 4 5 8 9; do
+  send "$peer" "store-batch during"
+done
+wait_for "the join" joined
+wait_for "every store" all_stored 500
+
+send 8 "request-batch all"
+wait_for "the retrieves" received all
+
+missing=0
+while read -r key; do
+  if ! cmp -s "$key.txt" "received_$key.txt"; then
+    echo "Error: $key came back wrong" >&2
+    missing=$((missing + 1))
+  fi
+done < all
+[ "$missing" -eq 0 ] || fail "$missing keys lost over the join"
+
+owned=$(metric 6 p2p_keys_stored)
+[ "$owned" -gt 0 ] 2>/dev/null || fail "peer 6 was never handed any keys"
+echo "PASS: every key stored during the join came back, peer 6 owns $owned"
@@ -0,0 +1,171 @@
+#include "key_store.h"
+
+#include <stdlib.h>
+
+static inline uint64_t key_store_hash(int64_t key) {
+  return mix64((uint64_t)key);
+}
+
+// the top bits pick the stripe, the bottom bits pick the slot
+#define STRIPE_OF(hash) ((hash) >> 58 & (KEY_STORE_STRIPES - 1))
+
+static key_entry *key_stripe_alloc(size_t cap) {
+  key_entry *slots = malloc(cap * sizeof(*slots));
+  if (!slots) return NULL;
+  for (size_t i = 0; i < cap; i++) slots[i].key = KEY_STORE_EMPTY;
+  return slots;
+}
+
+void key_store_init(key_store *store) {
+  for (int i = 0; i < KEY_STORE_STRIPES; i++) {
+    key_stripe *stripe = &store->stripes[i];
+    pthread_rwlock_init(&stripe->lock, NULL);
+    stripe->slots = NULL;
+    stripe->cap = stripe->count = stripe->dead = 0;
+  }
+}
+
+void key_store_destroy(key_store *store) {
+  for (int i = 0; i < KEY_STORE_STRIPES; i++) {
+    key_stripe *stripe = &store->stripes[i];
+    free(stripe->slots);
+    stripe->slots = NULL;
+    stripe->cap = stripe->count = stripe->dead = 0;
+    pthread_rwlock_destroy(&stripe->lock);
+  }
+}
+
+/*
+  The slot the key lives in, or the empty slot it would go in.
+  Requires the stripe to have atleast one empty slot.
+ */
+static size_t key_stripe_probe(const key_stripe *stripe, int64_t key,
+                               uint64_t hash) {
+  size_t mask = stripe->cap - 1;
+  size_t i = hash & mask;
+  size_t first_dead = SIZE_MAX;
+
+  for (;; i = (i + 1) & mask) {
+    int64_t cur = stripe->slots[i].key;
+    if (cur == key) return i;
+    if (cur == KEY_STORE_EMPTY) return first_dead != SIZE_MAX ? first_dead : i;
+    if (cur == KEY_STORE_DEAD && first_dead == SIZE_MAX) first_dead = i;
+  }
+}
+
+/*
+  Rehash into a table big enough for one more key,
+  tombstones are dropped along the way.
+ */
+static int key_stripe_grow(key_stripe *stripe) {
+  size_t cap = stripe->cap ? stripe->cap : KEY_STORE_MIN_CAP;
+  // if it is mostly tombstones a same sized rehash is enough
+  while ((stripe->count + 1) * 100 >= cap * KEY_STORE_MAX_LOAD / 2) cap *= 2;
+
+  key_entry *slots = key_stripe_alloc(cap);
+  if (!slots) return -1;
+
+  key_entry *old = stripe->slots;
+  size_t old_cap = stripe->cap;
+  stripe->slots = slots;
+  stripe->cap = cap;
+  stripe->dead = 0;
+
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].key < 0) continue;
+    size_t at = key_stripe_probe(stripe, old[i].key,
+                                 key_store_hash(old[i].key));
+    stripe->slots[at] = old[i];
+  }
+
+  free(old);
+  return 0;
+}
+
+int key_store_insert(key_store *store, const key_entry *entry,
+                     key_entry *old) {
+  if (entry->key < 0) return -1;
+
+  uint64_t hash = key_store_hash(entry->key);
+  key_stripe *stripe = &store->stripes[STRIPE_OF(hash)];
+  int ret = -1;
+
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &stripe->lock) {
+    if ((stripe->count + stripe->dead + 1) * 100 >=
+        stripe->cap * KEY_STORE_MAX_LOAD && key_stripe_grow(stripe)) {
+      break;
+    }
+
+    size_t at = key_stripe_probe(stripe, entry->key, hash);
+    int64_t cur = stripe->slots[at].key;
+    ret = cur != entry->key;
+    if (cur == KEY_STORE_DEAD) stripe->dead--;
+    if (ret) stripe->count++;
+    else if (old) *old = stripe->slots[at];
+    stripe->slots[at] = *entry;
+  }
+
+  return ret;
+}
+
+int key_store_lookup(key_store *store, int64_t key, key_entry *out) {
+  if (key < 0) return 0;
+
+  uint64_t hash = key_store_hash(key);
+  key_stripe *stripe = &store->stripes[STRIPE_OF(hash)];
+
+  SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &stripe->lock) {
+    if (!stripe->count) return 0;
+
+    size_t at = key_stripe_probe(stripe, key, hash);
+    if (stripe->slots[at].key != key) return 0;
+    if (out) *out = stripe->slots[at];
+    return 1;
+  }
+
+  return 0;
+}
+
+int key_store_remove(key_store *store, int64_t key, key_entry *out) {
+  if (key < 0) return 0;
+
+  uint64_t hash = key_store_hash(key);
+  key_stripe *stripe = &store->stripes[STRIPE_OF(hash)];
+
+  SCOPED_LOCK(pthread_rwlock_wrlock, pthread_rwlock_unlock, &stripe->lock) {
+    if (!stripe->count) return 0;
+
+    size_t at = key_stripe_probe(stripe, key, hash);
+    if (stripe->slots[at].key != key) return 0;
+    if (out) *out = stripe->slots[at];
+
+    stripe->slots[at].key = KEY_STORE_DEAD;
+    stripe->count--;
+    stripe->dead++;
+    return 1;
+  }
+
+  return 0;
+}
+
+void key_store_iterate(key_store *store, key_store_iter_fn fn, void *arg) {
+  for (int i = 0; i < KEY_STORE_STRIPES; i++) {
+    key_stripe *stripe = &store->stripes[i];
+    SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &stripe->lock) {
+      for (size_t j = 0; j < stripe->cap; j++) {
+        if (stripe->slots[j].key >= 0) fn(&stripe->slots[j], arg);
+      }
+    }
+  }
+}
+
+size_t key_store_count(key_store *store) {
+  size_t count = 0;
+  for (int i = 0; i < KEY_STORE_STRIPES; i++) {
+    key_stripe *stripe = &store->stripes[i];
+    SCOPED_LOCK(pthread_rwlock_rdlock, pthread_rwlock_unlock, &stripe->lock) {
+      count += stripe->count;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,98 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_KEY_STORE_H__
+#define __P2P_KEY_STORE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/**                                                    **
+ * The index of every key this peer is storing.         *
+ *                                                      *
+ * A set of open addressing (linear probe) hash tables, *
+ * keys are spread over the stripes by their hash so    *
+ * each stripe can have its own reader / writer lock.   *
+ **                                                    **/
+
+// Must be a power of 2
+#define KEY_STORE_STRIPES (64)
+#define KEY_STORE_MIN_CAP (16)
+
+// We grow once (live + dead) slots go over this percentage
+#define KEY_STORE_MAX_LOAD (70)
+
+// Slot markers, real keys are never negative
+#define KEY_STORE_EMPTY (INT64_MIN)
+#define KEY_STORE_DEAD (INT64_MIN + 1)
+
+// The entry isn't backed by a record in the on disk index
+#define KEY_NO_SLOT (UINT32_MAX)
+
+typedef struct key_entry_t {
+  int64_t key;
+
+  // when it was stored (seconds since epoch)
+  int64_t stored_at;
+
+  // the record in the on disk index
+  uint32_t slot;
+} key_entry;
+
+typedef struct key_stripe_t {
+  pthread_rwlock_t lock;
+  key_entry *slots;
+  size_t cap;
+  size_t count;
+  // tombstones left behind by removals
+  size_t dead;
+} key_stripe;
+
+typedef struct key_store_t {
+  key_stripe stripes[KEY_STORE_STRIPES];
+} key_store;
+
+/*
+  Called for each entry whilst iterating, the stripe is read locked
+  so you can't modify the store from inside it.
+ */
+typedef void (*key_store_iter_fn)(const key_entry *entry, void *arg);
+
+void key_store_init(key_store *store);
+void key_store_destroy(key_store *store);
+
+/*
+  Insert (or replace) an entry, the replaced entry is copied to old
+  (if given).
+  Returns 1 if the key is new, 0 if it replaced one and -1 on failure.
+ */
+int key_store_insert(key_store *store, const key_entry *entry,
+                     key_entry *old);
+
+/*
+  Find a key, copies the entry to out (if given).
+  Returns 1 if found.
+ */
+int key_store_lookup(key_store *store, int64_t key, key_entry *out);
+
+/*
+  Remove a key, copies the old entry to out (if given).
+  Returns 1 if it was there.
+ */
+int key_store_remove(key_store *store, int64_t key, key_entry *out);
+
+/*
+  Visit every entry (one stripe at a time).
+ */
+void key_store_iterate(key_store *store, key_store_iter_fn fn, void *arg);
+
+/*
+  The number of keys stored.
+ */
+size_t key_store_count(key_store *store);
+
+#endif
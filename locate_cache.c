@@ -0,0 +1,100 @@
+#include "locate_cache.h"
+
+#include "hash_ring.h"
+#include "p2p_node.h"
+
+/*
+  The cache of the node this thread works for.
+ */
+static inline locate_cache_state *locate_cache_self(void) {
+  return &p2p_node_current()->locate;
+}
+
+void locate_cache_state_init(locate_cache_state *cache) {
+  for (int s = 0; s < LOCATE_CACHE_SETS; s++) {
+    for (int w = 0; w < LOCATE_CACHE_WAYS; w++) {
+      cache->entries[s][w] = (locate_entry){.key = -1, .peer = -1};
+    }
+  }
+  cache->clock = 0;
+  pthread_mutex_init(&cache->lock, NULL);
+}
+
+void locate_cache_state_free(locate_cache_state *cache) {
+  pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+  The set a key lives in.
+ */
+static locate_entry *locate_cache_set(locate_cache_state *cache,
+                                      int64_t key) {
+  return cache->entries[mix64((uint64_t)key) & (LOCATE_CACHE_SETS - 1)];
+}
+
+/*
+  The way holding key in set, NULL if it isn't there.
+  Requires cache->lock.
+ */
+static locate_entry *locate_cache_find(locate_entry *set, int64_t key) {
+  for (int w = 0; w < LOCATE_CACHE_WAYS; w++) {
+    if (set[w].key == key) return &set[w];
+  }
+  return NULL;
+}
+
+void locate_cache_put(int64_t key, int peer) {
+  if (key < 0 || peer < 0) return;
+
+  locate_cache_state *cache = locate_cache_self();
+  uint32_t generation = hash_ring_generation();
+  SCOPED_MTX_LOCK(&cache->lock) {
+    locate_entry *set = locate_cache_set(cache, key);
+    locate_entry *entry = locate_cache_find(set, key);
+
+    // otherwise take a free / stale way or evict the lru one
+    for (int w = 0; w < LOCATE_CACHE_WAYS && !entry; w++) {
+      if (set[w].key == -1 || set[w].generation != generation) {
+        entry = &set[w];
+      }
+    }
+    if (!entry) {
+      entry = &set[0];
+      for (int w = 1; w < LOCATE_CACHE_WAYS; w++) {
+        if (set[w].used < entry->used) entry = &set[w];
+      }
+    }
+
+    *entry = (locate_entry){
+      .key = key, .peer = peer, .generation = generation,
+      .used = ++cache->clock,
+    };
+  }
+}
+
+int locate_cache_get(int64_t key) {
+  locate_cache_state *cache = locate_cache_self();
+  uint32_t generation = hash_ring_generation();
+  int peer = -1;
+  SCOPED_MTX_LOCK(&cache->lock) {
+    locate_entry *entry = locate_cache_find(locate_cache_set(cache, key), key);
+    if (!entry) break;
+
+    if (entry->generation != generation) {
+      // the owners may have moved since, go back to routing
+      entry->key = -1;
+    } else {
+      entry->used = ++cache->clock;
+      peer = entry->peer;
+    }
+  }
+  return peer;
+}
+
+void locate_cache_forget(int64_t key) {
+  locate_cache_state *cache = locate_cache_self();
+  SCOPED_MTX_LOCK(&cache->lock) {
+    locate_entry *entry = locate_cache_find(locate_cache_set(cache, key), key);
+    if (entry) entry->key = -1;
+  }
+}
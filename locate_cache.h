@@ -0,0 +1,71 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_LOCATE_CACHE_H__
+#define __P2P_LOCATE_CACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/**                                                    **
+ * Who last served us a key, so asking for it again     *
+ * goes straight to them instead of around the ring.    *
+ *                                                      *
+ * A small set associative table (lru within each set), *
+ * entries are tagged with the hash ring generation so  *
+ * any join / depart / repair forgets every one of them *
+ **                                                    **/
+
+// Must be a power of 2
+#define LOCATE_CACHE_SETS (1024)
+#define LOCATE_CACHE_WAYS (4)
+
+typedef struct locate_entry_t {
+  // -1 for a free way
+  int64_t key;
+  int peer;
+
+  // the hash ring generation it was learnt in
+  uint32_t generation;
+
+  // for lru eviction within the set
+  uint64_t used;
+} locate_entry;
+
+typedef struct locate_cache_state_t {
+  locate_entry entries[LOCATE_CACHE_SETS][LOCATE_CACHE_WAYS];
+  uint64_t clock;
+
+  pthread_mutex_t lock;
+} locate_cache_state;
+
+/*
+  Set up an empty cache.
+ */
+void locate_cache_state_init(locate_cache_state *cache);
+
+/*
+  Free the cache's lock.
+ */
+void locate_cache_state_free(locate_cache_state *cache);
+
+/*
+  Remember that peer served us key.
+ */
+void locate_cache_put(int64_t key, int peer);
+
+/*
+  The peer that last served us key, -1 if we don't know
+  (or the ring has changed since).
+ */
+int locate_cache_get(int64_t key);
+
+/*
+  Forget where key is (i.e. that peer has gone).
+ */
+void locate_cache_forget(int64_t key);
+
+#endif
@@ -0,0 +1,169 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+  Write a len that doesn't fit in its nibble, returns NULL if it
+  doesn't fit before end.
+ */
+static uint8_t *lz_write_len(uint8_t *op, uint8_t *end, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (op >= end) return NULL;
+    *op++ = 255;
+  }
+  if (op >= end) return NULL;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/*
+  Write a sequence of literals (and a match if match_len isn't 0).
+  Returns NULL if it doesn't fit before end.
+ */
+static uint8_t *lz_write_seq(uint8_t *op, uint8_t *end, const uint8_t *lit,
+                             size_t lit_len, size_t offset, size_t match_len) {
+  if (op >= end) return NULL;
+  uint8_t *token = op++;
+  size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+  *token = (lit_len < 15 ? lit_len : 15) << 4 |
+           (match_code < 15 ? match_code : 15);
+
+  if (lit_len >= 15 && !(op = lz_write_len(op, end, lit_len - 15))) {
+    return NULL;
+  }
+  if ((size_t)(end - op) < lit_len) return NULL;
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (!match_len) return op;
+
+  if (end - op < 2) return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (match_code >= 15) op = lz_write_len(op, end, match_code - 15);
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap) {
+  const uint8_t *in = src;
+  const uint8_t *ip = in, *anchor = in, *end = in + n;
+  uint8_t *op = dst, *out_end = op + cap;
+
+  // positions of the last 4 bytes with each hash
+  uint32_t table[1 << LZ_HASH_BITS] = {0};
+  // skip further ahead the longer we go without a match,
+  // so data that doesn't compress is given up on quickly
+  size_t misses = 0;
+
+  while (n >= LZ_MIN_MATCH + LZ_LAST_LITERALS &&
+         ip <= end - LZ_MIN_MATCH - LZ_LAST_LITERALS) {
+    uint32_t seq = lz_read32(ip);
+    uint32_t h = lz_hash(seq);
+    const uint8_t *ref = in + table[h];
+    table[h] = ip - in;
+
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    // the match can't run into the last literals
+    size_t len = LZ_MIN_MATCH;
+    size_t max = end - LZ_LAST_LITERALS - ip;
+    while (len < max && ref[len] == ip[len]) len++;
+
+    // and matches are better if they start as early as they can
+    while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+      len++;
+    }
+
+    op = lz_write_seq(op, out_end, anchor, ip - anchor, ip - ref, len);
+    if (!op) return 0;
+
+    ip += len;
+    anchor = ip;
+    // a match is atleast LZ_MIN_MATCH long so this is still in the block
+    if (ip <= end - LZ_MIN_MATCH) {
+      table[lz_hash(lz_read32(ip - 2))] = ip - 2 - in;
+    }
+  }
+
+  op = lz_write_seq(op, out_end, anchor, end - anchor, 0, 0);
+  return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+/*
+  Read a len that didn't fit in its nibble, returns -1 if it runs
+  off the block.
+ */
+static long lz_read_len(const uint8_t **ip, const uint8_t *end) {
+  long len = 0;
+  uint8_t byte;
+  do {
+    if (*ip >= end) return -1;
+    byte = *(*ip)++;
+    len += byte;
+  } while (byte == 255);
+  return len;
+}
+
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap) {
+  const uint8_t *ip = src, *end = ip + n;
+  uint8_t *out = dst, *op = out, *out_end = out + cap;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+
+    long lit_len = token >> 4;
+    if (lit_len == 15) {
+      long more = lz_read_len(&ip, end);
+      if (more < 0) return -1;
+      lit_len += more;
+    }
+    if (lit_len > end - ip || lit_len > out_end - op) return -1;
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    // the last sequence has no match
+    if (ip == end) break;
+
+    if (end - ip < 2) return -1;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (!offset || offset > (size_t)(op - out)) return -1;
+
+    long match_len = token & 15;
+    if (match_len == 15) {
+      long more = lz_read_len(&ip, end);
+      if (more < 0) return -1;
+      match_len += more;
+    }
+    match_len += LZ_MIN_MATCH;
+    if (match_len > out_end - op) return -1;
+
+    // matches close behind us overlap what they are writing
+    const uint8_t *ref = op - offset;
+    if ((long)offset >= match_len) {
+      memcpy(op, ref, match_len);
+      op += match_len;
+    } else {
+      while (match_len--) *op++ = *ref++;
+    }
+  }
+
+  return op - out;
+}
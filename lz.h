@@ -0,0 +1,42 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_LZ_H__
+#define __P2P_LZ_H__
+
+#include <stddef.h>
+
+/**                                                **
+ * A small, fast LZ77 block codec (in the spirit of *
+ * LZ4) so transfers of text can trade a bit of CPU *
+ * for a lot less on the wire.                      *
+ *                                                  *
+ * A block is a run of sequences, each one a token  *
+ * (literal len << 4 | match len - LZ_MIN_MATCH),   *
+ * the literals, a 2 byte offset and the extra      *
+ * match len.  Lens of 15 carry on in 255 bytes.    *
+ * The last sequence is only literals.              *
+ **                                                **/
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+// the end of a block is always literals, so matches never run off it
+#define LZ_LAST_LITERALS (5)
+#define LZ_HASH_BITS (12)
+
+/*
+  Compress n bytes of src into dst.
+  Returns the compressed size or 0 if it doesn't fit in cap
+  (pass cap < n to only take blocks that actually shrink).
+ */
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+/*
+  Decompress a block of n bytes into dst.
+  Returns the decompressed size or -1 if the block is corrupt
+  (or wouldn't fit in cap), never reads or writes out of bounds.
+ */
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif
@@ -0,0 +1,269 @@
+#include "obj_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "p2p_node.h"
+
+/*
+  The cache of the node this thread works for.
+ */
+static inline obj_cache_state *obj_cache_self(void) {
+  return &p2p_node_current()->cache;
+}
+
+void obj_cache_state_init(obj_cache_state *cache, int64_t budget) {
+  cache->dir[0] = '\0';
+  cache->budget = budget;
+  cache->bytes = 0;
+  for (int i = 0; i < OBJ_CACHE_ENTRIES; i++) {
+    cache->entries[i] = (obj_cache_entry){.file = -1};
+  }
+  cache->clock = 0;
+  memset(cache->heat, 0, sizeof(cache->heat));
+  cache->heat_ticks = 0;
+  for (int i = 0; i < OBJ_CACHE_WATCHED; i++) {
+    cache->watched[i] = (obj_cache_watch){.file = -1};
+  }
+  cache->watch_next = 0;
+  pthread_mutex_init(&cache->lock, NULL);
+}
+
+void obj_cache_state_free(obj_cache_state *cache) {
+  pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+  Remove every file in the cache dir starting with prefix ("" for all).
+ */
+static void obj_cache_unlink(const obj_cache_state *cache,
+                             const char *prefix) {
+  DIR *dir = opendir(cache->dir);
+  if (!dir) return;
+
+  char path[OBJ_CACHE_PATH_LEN * 2];
+  size_t len = strlen(prefix);
+  for (struct dirent *ent; (ent = readdir(dir));) {
+    if (ent->d_name[0] == '.' || strncmp(ent->d_name, prefix, len)) continue;
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+}
+
+void obj_cache_open(int peer) {
+  obj_cache_state *cache = obj_cache_self();
+  if (cache->budget <= 0) return;
+
+  snprintf(cache->dir, sizeof(cache->dir), OBJ_CACHE_DIR_FMT, peer);
+  if (mkdir(cache->dir, 0755) && errno != EEXIST) {
+    perror("mkdir");
+    cache->budget = 0;
+    return;
+  }
+  obj_cache_unlink(cache, "");
+}
+
+/*
+  Throw away an entry and its files.
+  Requires cache->lock.
+ */
+static void obj_cache_evict(obj_cache_state *cache, obj_cache_entry *entry) {
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "%d.", entry->file);
+  obj_cache_unlink(cache, prefix);
+
+  cache->bytes -= entry->bytes;
+  *entry = (obj_cache_entry){.file = -1};
+}
+
+/*
+  Requires cache->lock.
+ */
+static obj_cache_entry *obj_cache_find(obj_cache_state *cache, int file) {
+  for (int i = 0; i < OBJ_CACHE_ENTRIES; i++) {
+    if (cache->entries[i].file == file) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+/*
+  Check if an entry is past trusting, either a copy that has
+  been around too long or a fill that never finished.
+ */
+static int obj_cache_expired(const obj_cache_entry *entry, time_t now) {
+  time_t limit = entry->filling ? OBJ_CACHE_FILL_SECS : OBJ_CACHE_TTL_SECS;
+  return now - entry->filled_at > limit;
+}
+
+/*
+  Bump how hot a key is, returns its heat.
+  Requires cache->lock.
+ */
+static int obj_cache_heat(obj_cache_state *cache, int file) {
+  uint8_t *heat = &cache->heat[mix64(file) & (OBJ_CACHE_HEAT_SLOTS - 1)];
+  if (*heat < UINT8_MAX) (*heat)++;
+  int out = *heat;
+
+  // so keys that were hot once don't stay hot forever
+  if (++cache->heat_ticks == OBJ_CACHE_HEAT_DECAY) {
+    cache->heat_ticks = 0;
+    for (int i = 0; i < OBJ_CACHE_HEAT_SLOTS; i++) cache->heat[i] >>= 1;
+  }
+  return out;
+}
+
+int obj_cache_forwarded(int file) {
+  obj_cache_state *cache = obj_cache_self();
+  if (cache->budget <= 0) return 0;
+
+  time_t now = time(NULL);
+  SCOPED_MTX_LOCK(&cache->lock) {
+    if (obj_cache_heat(cache, file) < OBJ_CACHE_HOT) return 0;
+
+    obj_cache_entry *entry = obj_cache_find(cache, file);
+    if (entry && !obj_cache_expired(entry, now)) return 0;
+    if (entry) obj_cache_evict(cache, entry);
+
+    // a free slot or the lru copy (fills in flight are left alone)
+    obj_cache_entry *lru = NULL;
+    for (int i = 0; i < OBJ_CACHE_ENTRIES; i++) {
+      obj_cache_entry *at = &cache->entries[i];
+      if (at->file == -1) {
+        lru = at;
+        break;
+      }
+      if (!at->filling && (!lru || at->used < lru->used)) lru = at;
+    }
+    if (!lru) return 0;
+    if (lru->file != -1) obj_cache_evict(cache, lru);
+
+    *lru = (obj_cache_entry){
+      .file = file, .filling = 1, .filled_at = now, .used = ++cache->clock,
+    };
+  }
+  return 1;
+}
+
+int obj_cache_path(const char *name, char *path, size_t cap) {
+  obj_cache_state *cache = obj_cache_self();
+  if (cache->budget <= 0) return -1;
+  snprintf(path, cap, "%s/%s", cache->dir, name);
+  return 0;
+}
+
+int obj_cache_has(int file) {
+  obj_cache_state *cache = obj_cache_self();
+  if (cache->budget <= 0) return 0;
+
+  SCOPED_MTX_LOCK(&cache->lock) {
+    obj_cache_entry *entry = obj_cache_find(cache, file);
+    if (!entry || entry->filling) return 0;
+    if (obj_cache_expired(entry, time(NULL))) {
+      obj_cache_evict(cache, entry);
+      return 0;
+    }
+    entry->used = ++cache->clock;
+  }
+  return 1;
+}
+
+int obj_cache_filled(int file, int64_t bytes) {
+  obj_cache_state *cache = obj_cache_self();
+  if (bytes > OBJ_CACHE_MAX_OBJECT || bytes > cache->budget) {
+    obj_cache_fill_failed(file);
+    return -1;
+  }
+
+  SCOPED_MTX_LOCK(&cache->lock) {
+    // dropped while it was on its way
+    obj_cache_entry *entry = obj_cache_find(cache, file);
+    if (!entry) return -1;
+
+    entry->filling = 0;
+    entry->bytes += bytes;
+    entry->filled_at = time(NULL);
+    entry->used = ++cache->clock;
+    cache->bytes += bytes;
+
+    while (cache->bytes > cache->budget) {
+      obj_cache_entry *lru = NULL;
+      for (int i = 0; i < OBJ_CACHE_ENTRIES; i++) {
+        obj_cache_entry *at = &cache->entries[i];
+        if (at->file == -1 || at->filling || at == entry) continue;
+        if (!lru || at->used < lru->used) lru = at;
+      }
+      if (!lru) lru = entry;
+      obj_cache_evict(cache, lru);
+      if (lru == entry) break;
+    }
+  }
+  return 0;
+}
+
+void obj_cache_fill_failed(int file) {
+  obj_cache_state *cache = obj_cache_self();
+  SCOPED_MTX_LOCK(&cache->lock) {
+    obj_cache_entry *entry = obj_cache_find(cache, file);
+    if (entry && entry->filling) obj_cache_evict(cache, entry);
+  }
+}
+
+void obj_cache_drop(int file) {
+  obj_cache_state *cache = obj_cache_self();
+  if (cache->budget <= 0) return;
+
+  SCOPED_MTX_LOCK(&cache->lock) {
+    obj_cache_entry *entry = obj_cache_find(cache, file);
+    if (entry) obj_cache_evict(cache, entry);
+  }
+}
+
+/*
+  Requires cache->lock.
+ */
+static obj_cache_watch *obj_cache_find_watch(obj_cache_state *cache,
+                                             int file) {
+  for (int i = 0; i < OBJ_CACHE_WATCHED; i++) {
+    if (cache->watched[i].file == file) return &cache->watched[i];
+  }
+  return NULL;
+}
+
+void obj_cache_watch_fill(int file, int peer) {
+  obj_cache_state *cache = obj_cache_self();
+  SCOPED_MTX_LOCK(&cache->lock) {
+    obj_cache_watch *watch = obj_cache_find_watch(cache, file);
+    if (!watch) {
+      // the oldest one is forgotten, its copies just age out
+      watch = &cache->watched[cache->watch_next];
+      cache->watch_next = (cache->watch_next + 1) % OBJ_CACHE_WATCHED;
+      *watch = (obj_cache_watch){.file = file};
+    }
+
+    for (int i = 0; i < watch->cacher_count; i++) {
+      if (watch->cachers[i] == peer) return;
+    }
+    if (watch->cacher_count < OBJ_CACHE_MAX_CACHERS) {
+      watch->cachers[watch->cacher_count++] = peer;
+    }
+  }
+}
+
+int obj_cache_take_cachers(int file, int *peers) {
+  obj_cache_state *cache = obj_cache_self();
+  int count = 0;
+  SCOPED_MTX_LOCK(&cache->lock) {
+    obj_cache_watch *watch = obj_cache_find_watch(cache, file);
+    if (!watch) break;
+
+    count = watch->cacher_count;
+    memcpy(peers, watch->cachers, count * sizeof(*peers));
+    *watch = (obj_cache_watch){.file = -1};
+  }
+  return count;
+}
@@ -0,0 +1,150 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_OBJ_CACHE_H__
+#define __P2P_OBJ_CACHE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "utils.h"
+
+/**                                                     **
+ * Copies of hot files kept by the peers that forward    *
+ * retrieves for them, so popular keys are served along  *
+ * the way instead of all landing on their owner.        *
+ *                                                       *
+ * Once a key has been forwarded OBJ_CACHE_HOT times we  *
+ * pull a copy of our own (a fill), copies are evicted   *
+ * lru first to stay under the byte budget.  Holders     *
+ * remember who filled from them and tell them to drop   *
+ * their copy when the key is stored again.              *
+ **                                                     **/
+
+// where a peer keeps its copies, relative to where it runs
+#define OBJ_CACHE_DIR_FMT "cache_%d"
+#define OBJ_CACHE_PATH_LEN (512)
+
+#define OBJ_CACHE_DEFAULT_MB (64)
+// larger files aren't worth a copy (and are pulled in segments anyway)
+#define OBJ_CACHE_MAX_OBJECT (16 << 20)
+#define OBJ_CACHE_ENTRIES (256)
+
+// forwards of a key (give or take decay) before we fill it
+#define OBJ_CACHE_HOT (3)
+// Must be a power of 2
+#define OBJ_CACHE_HEAT_SLOTS (4096)
+// every this many forwards the heat of every key halves
+#define OBJ_CACHE_HEAT_DECAY (4096)
+
+// a copy we weren't told to drop is only trusted for this long,
+// and a fill that hasn't landed by now is given up on
+#define OBJ_CACHE_TTL_SECS (300)
+#define OBJ_CACHE_FILL_SECS (30)
+
+// peers a holder remembers filling each key, and keys it remembers
+#define OBJ_CACHE_MAX_CACHERS (8)
+#define OBJ_CACHE_WATCHED (256)
+
+typedef struct obj_cache_entry_t {
+  // -1 for a free slot
+  int file;
+  // set till the first of its files lands
+  int filling;
+  // every extension we have of it
+  int64_t bytes;
+  // when the fill started / last file landed
+  time_t filled_at;
+  // for lru eviction
+  uint64_t used;
+} obj_cache_entry;
+
+typedef struct obj_cache_watch_t {
+  // -1 for a free slot
+  int file;
+  int cachers[OBJ_CACHE_MAX_CACHERS];
+  int cacher_count;
+} obj_cache_watch;
+
+typedef struct obj_cache_state_t {
+  char dir[OBJ_CACHE_PATH_LEN];
+  int64_t budget;
+  int64_t bytes;
+
+  obj_cache_entry entries[OBJ_CACHE_ENTRIES];
+  uint64_t clock;
+
+  uint8_t heat[OBJ_CACHE_HEAT_SLOTS];
+  uint32_t heat_ticks;
+
+  // the holder side, who has a copy of the keys we hold
+  obj_cache_watch watched[OBJ_CACHE_WATCHED];
+  int watch_next;
+
+  pthread_mutex_t lock;
+} obj_cache_state;
+
+/*
+  Set up an empty cache of at most budget bytes (0 turns it off).
+ */
+void obj_cache_state_init(obj_cache_state *cache, int64_t budget);
+
+/*
+  Free the cache's lock, the copies are left on disk.
+ */
+void obj_cache_state_free(obj_cache_state *cache);
+
+/*
+  Start the cache for a peer, any copies left over from last
+  time may be stale so they are thrown away.
+ */
+void obj_cache_open(int peer);
+
+/*
+  We are forwarding a retrieve of file, returns 1 if it has just
+  become hot enough that we should fill a copy (and marks it filling).
+ */
+int obj_cache_forwarded(int file);
+
+/*
+  Where our copy of a file (i.e. 12.txt) goes / is, "cache_4/12.txt".
+  Returns -1 if the cache is off.
+ */
+int obj_cache_path(const char *name, char *path, size_t cap);
+
+/*
+  Check we have a fresh copy of file to serve (and mark it used).
+ */
+int obj_cache_has(int file);
+
+/*
+  One of the files of a fill (bytes long) landed at its path.
+  Returns -1 if we don't want it after all (the caller removes it).
+ */
+int obj_cache_filled(int file, int64_t bytes);
+
+/*
+  A fill didn't make it, let a later forward try again.
+ */
+void obj_cache_fill_failed(int file);
+
+/*
+  Throw away our copy of file (if we have one).
+ */
+void obj_cache_drop(int file);
+
+/*
+  Remember that peer filled a copy of file from us.
+ */
+void obj_cache_watch_fill(int file, int peer);
+
+/*
+  Take the peers that have a copy of file from us (so they can be
+  told to drop it), returns how many (at most OBJ_CACHE_MAX_CACHERS).
+ */
+int obj_cache_take_cachers(int file, int *peers);
+
+#endif
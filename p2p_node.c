@@ -0,0 +1,181 @@
+#include "p2p_node.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+_Thread_local p2p_node *p2p_current_node = NULL;
+
+p2p_node *p2p_node_enter(p2p_node *node) {
+  p2p_node *prev = p2p_current_node;
+  p2p_current_node = node;
+  return prev;
+}
+
+/*
+  Run a call as the node, putting back whoever we were after.
+ */
+#define AS_NODE(node) \
+  for (p2p_node *_prev_node = p2p_node_enter(node), *_once = (node); _once; \
+       _once = NULL, p2p_node_enter(_prev_node))
+
+p2p_node *p2p_node_create(const p2p_node_config *config) {
+  p2p_node *node = calloc(1, sizeof(*node));
+  if (!node) return NULL;
+
+  node->config = *config;
+  if (!node->config.successors) node->config.successors = DEFAULT_SUCCESSORS;
+  if (!node->config.replicas) {
+    node->config.replicas = HASH_RING_DEFAULT_REPLICAS;
+  }
+  if (!node->config.vnodes) node->config.vnodes = HASH_RING_DEFAULT_VNODES;
+  if (!node->config.reactor_threads) {
+    node->config.reactor_threads = TCP_REACTOR_THREADS;
+  }
+
+  peer_info_init(&node->info, config->peer, config->ping_interval);
+  ping_state_init(&node->ping);
+  tcp_state_init(&node->tcp, node->config.reactor_threads);
+  handoff_state_init(&node->handoff);
+  tcp_pool_state_init(&node->pool);
+  finger_state_init(&node->fingers);
+  hash_ring_state_init(&node->ring);
+  store_index_state_init(&node->index);
+  stats_state_init(&node->stats, config->stats_path);
+  locate_cache_state_init(&node->locate);
+  int cache_mb = node->config.cache_mb ? node->config.cache_mb :
+                 OBJ_CACHE_DEFAULT_MB;
+  obj_cache_state_init(&node->cache,
+                       cache_mb < 0 ? 0 : (int64_t)cache_mb << 20);
+  work_pool_state_init(&node->workers, node->config.workers);
+
+  int invalid = 0;
+  AS_NODE(node) {
+    invalid = set_successor_count(node->config.successors) ||
+              hash_ring_set_replicas(node->config.replicas) ||
+              hash_ring_set_vnodes(node->config.vnodes);
+  }
+
+  if (invalid || config->peer < 0 || config->peer >= RING_SIZE) {
+    p2p_node_destroy(node);
+    return NULL;
+  }
+  return node;
+}
+
+int p2p_node_init(p2p_node *node, const int *succs, int count) {
+  int ret = -1;
+  AS_NODE(node) ret = init_peer(succs, count);
+  return ret;
+}
+
+int p2p_node_join(p2p_node *node, int known) {
+  int ret = -1;
+  AS_NODE(node) ret = join_peer(known);
+  return ret;
+}
+
+int p2p_node_restart(p2p_node *node) {
+  int ret = -1;
+  AS_NODE(node) ret = restart_peer();
+  return ret;
+}
+
+void p2p_node_start(p2p_node *node) {
+  if (!node->started || node->ticking) return;
+
+  AS_NODE(node) {
+    node->ping_ticker = setup_ping_interval();
+    node->finger_ticker = setup_finger_interval();
+  }
+  node->ticking = 1;
+}
+
+int p2p_node_store(p2p_node *node, int file) {
+  int next = -1;
+  AS_NODE(node) {
+    stats_begin(STATS_STORE, file);
+    next = tcp_send_store_req(file, get_peer(), -1);
+  }
+  return next;
+}
+
+int p2p_node_retrieve(p2p_node *node, int file) {
+  int next = -1;
+  AS_NODE(node) {
+    stats_begin(STATS_RETRIEVE, file);
+    int flags = TCP_RETRIEVE_SEGMENTED | TCP_RETRIEVE_CHECKSUM;
+    if (node->config.compress) flags |= TCP_RETRIEVE_COMPRESSED;
+    next = tcp_send_retrieve_req(file, get_peer(), -1, flags);
+  }
+  return next;
+}
+
+int p2p_node_store_batch(p2p_node *node, const int *files, int count) {
+  int sent = -1;
+  AS_NODE(node) sent = tcp_send_store_batch(files, count, get_peer());
+  return sent;
+}
+
+int p2p_node_retrieve_batch(p2p_node *node, const int *files, int count) {
+  int sent = -1;
+  AS_NODE(node) {
+    int flags = TCP_RETRIEVE_SEGMENTED | TCP_RETRIEVE_CHECKSUM;
+    if (node->config.compress) flags |= TCP_RETRIEVE_COMPRESSED;
+    sent = tcp_send_retrieve_batch(files, count, get_peer(), flags);
+  }
+  return sent;
+}
+
+void p2p_node_dump_stats(p2p_node *node, FILE *out) {
+  AS_NODE(node) stats_dump(out);
+}
+
+void p2p_node_quit(p2p_node *node) {
+  AS_NODE(node) tcp_send_quit_req();
+}
+
+/*
+  Cancel and reap one of the node's threads.
+ */
+static void p2p_node_reap(pthread_t thrd) {
+  pthread_cancel(thrd);
+  pthread_join(thrd, NULL);
+}
+
+void p2p_node_stop(p2p_node *node) {
+  // the tickers start the most work of their own so they go first,
+  // the tcp thread takes the rest of the reactor down with it.
+  if (node->ticking) {
+    p2p_node_reap(node->ping_ticker);
+    p2p_node_reap(node->finger_ticker);
+    node->ticking = 0;
+  }
+
+  if (node->started) {
+    p2p_node_reap(node->tcp_thrd);
+    p2p_node_reap(node->ping_thrd);
+    // nothing submits any more, so the workers can finish up
+    work_pool_stop(&node->workers);
+    node->started = 0;
+  }
+
+  AS_NODE(node) close_peer();
+}
+
+void p2p_node_destroy(p2p_node *node) {
+  if (!node) return;
+
+  work_pool_state_free(&node->workers);
+  obj_cache_state_free(&node->cache);
+  locate_cache_state_free(&node->locate);
+  stats_state_free(&node->stats);
+  store_index_state_free(&node->index);
+  hash_ring_state_free(&node->ring);
+  finger_state_free(&node->fingers);
+  tcp_pool_state_free(&node->pool);
+  handoff_state_free(&node->handoff);
+  tcp_state_free(&node->tcp);
+  ping_state_free(&node->ping);
+  peer_info_free(&node->info);
+  free(node);
+}
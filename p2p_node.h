@@ -0,0 +1,169 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_NODE_H__
+#define __P2P_NODE_H__
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "finger.h"
+#include "handoff.h"
+#include "hash_ring.h"
+#include "locate_cache.h"
+#include "obj_cache.h"
+#include "p2p_peer.h"
+#include "ping.h"
+#include "stats.h"
+#include "store_index.h"
+#include "tcp.h"
+#include "tcp_pool.h"
+#include "utils.h"
+#include "work_pool.h"
+
+/**                                                      **
+ * Everything a single peer owns, so one process can run  *
+ * as many peers as it likes (each on its own port).      *
+ *                                                        *
+ * The modules find the node through the thread they are  *
+ * running on, every thread a node starts works for that  *
+ * node and anything else has to p2p_node_enter it first. *
+ **                                                      **/
+
+typedef struct p2p_node_t p2p_node;
+
+/*
+  Called on one of the node's threads once every successor has gone.
+ */
+typedef void (*p2p_node_lost_fn)(p2p_node *node);
+
+typedef struct p2p_node_config_t {
+  int peer;
+  int ping_interval;
+
+  // 0 for the defaults
+  int successors;
+  int replicas;
+  int vnodes;
+  int reactor_threads;
+  int workers;
+
+  // NULL just stops the node pinging
+  p2p_node_lost_fn on_lost;
+
+  // file the node dumps its stats to every ping interval (NULL for none)
+  const char *stats_path;
+  // ask holders to compress the files we retrieve
+  int compress;
+  // how much we keep copies of hot files in (0 for the default, -1 for off)
+  int cache_mb;
+  // send compressed files through io_uring (where the kernel has it),
+  // only the bench sets it
+  int io_uring;
+} p2p_node_config;
+
+struct p2p_node_t {
+  p2p_node_config config;
+
+  p2p_peer_info info;
+  ping_state ping;
+  tcp_state tcp;
+  handoff_state handoff;
+  tcp_pool_state pool;
+  finger_state fingers;
+  hash_ring_state ring;
+  store_index_state index;
+  stats_state stats;
+  locate_cache_state locate;
+  obj_cache_state cache;
+  work_pool workers;
+
+  // set once the threads behind them have been started
+  int started;
+  int ticking;
+
+  pthread_t ping_thrd;
+  pthread_t tcp_thrd;
+  pthread_t ping_ticker;
+  pthread_t finger_ticker;
+};
+
+extern _Thread_local p2p_node *p2p_current_node;
+
+/*
+  The node the calling thread works for.
+ */
+static inline p2p_node *p2p_node_current(void) {
+  return p2p_current_node;
+}
+
+/*
+  Make the calling thread work for a node.
+  Returns the node it was working for before.
+ */
+p2p_node *p2p_node_enter(p2p_node *node);
+
+/*
+  Set up a node that hasn't joined anything yet.
+  Returns NULL if the config is invalid.
+ */
+p2p_node *p2p_node_create(const p2p_node_config *config);
+
+/*
+  Start the node in a ring with known successors.
+ */
+int p2p_node_init(p2p_node *node, const int *succs, int count);
+
+/*
+  Start the node by joining through a known peer.
+ */
+int p2p_node_join(p2p_node *node, int known);
+
+/*
+  Start the node from its saved index.
+ */
+int p2p_node_restart(p2p_node *node);
+
+/*
+  Start pinging successors and stabilising, after init / join / restart.
+ */
+void p2p_node_start(p2p_node *node);
+
+/*
+  Store / retrieve a file from the node.
+  Returns the peer the request was routed to or -1.
+ */
+int p2p_node_store(p2p_node *node, int file);
+int p2p_node_retrieve(p2p_node *node, int file);
+
+/*
+  Store / retrieve many files at once, batched per next hop rather
+  than a msg per file (their latencies aren't tracked).
+  Returns how many were sent on to other peers or -1.
+ */
+int p2p_node_store_batch(p2p_node *node, const int *files, int count);
+int p2p_node_retrieve_batch(p2p_node *node, const int *files, int count);
+
+/*
+  Write the node's stats (counters and latency histograms) to out.
+ */
+void p2p_node_dump_stats(p2p_node *node, FILE *out);
+
+/*
+  Tell our predecessors we are leaving (before p2p_node_stop).
+ */
+void p2p_node_quit(p2p_node *node);
+
+/*
+  Stop every thread of the node and close its sockets, without
+  telling anyone (it looks like an abrupt departure).
+ */
+void p2p_node_stop(p2p_node *node);
+
+/*
+  Free a (stopped) node.
+ */
+void p2p_node_destroy(p2p_node *node);
+
+#endif
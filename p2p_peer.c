@@ -5,43 +5,151 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "finger.h"
+#include "hash_ring.h"
+#include "obj_cache.h"
+#include "p2p_node.h"
 #include "ping.h"
 #include "utils.h"
 #include "tcp.h"
+#include "store_index.h"
+#include "tcp_pool.h"
+#include "work_pool.h"
 
-static p2p_peer_info info = {
-  .first_successor = -1, .second_successor = -1, .peer = -1
-};
-static pthread_mutex_t info_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t info_wait = PTHREAD_COND_INITIALIZER;
+/*
+  The info of the node this thread works for.
+ */
+static inline p2p_peer_info *peer_info(void) {
+  return &p2p_node_current()->info;
+}
+
+void peer_info_init(p2p_peer_info *info, int peer, int ping_interval) {
+  *info = (p2p_peer_info){
+    .peer = peer, .ping_interval = ping_interval,
+    .successor_count = DEFAULT_SUCCESSORS,
+  };
+  for (int i = 0; i < MAX_SUCCESSORS; i++) {
+    atomic_init(&info->successors[i], -1);
+  }
+  pthread_mutex_init(&info->lock, NULL);
+  pthread_cond_init(&info->wait, NULL);
+  pthread_mutex_init(&info->set_lock, NULL);
+}
+
+void peer_info_free(p2p_peer_info *info) {
+  pthread_mutex_destroy(&info->set_lock);
+  pthread_cond_destroy(&info->wait);
+  pthread_mutex_destroy(&info->lock);
+}
+
+static inline int successor_load(p2p_peer_info *info, int i) {
+  return atomic_load_explicit(&info->successors[i], memory_order_relaxed);
+}
+
+/*
+  Copy out the successors we currently know, returns how many.
+  Never blocks, we just retry if a writer swapped them underneath us.
+ */
+static int read_successors(p2p_peer_info *info, int succs[MAX_SUCCESSORS]) {
+  for (;;) {
+    unsigned seq = atomic_load_explicit(&info->successors_seq,
+                                        memory_order_acquire);
+    if (seq & 1) continue;
+
+    int count = 0;
+    while (count < info->successor_count &&
+           (succs[count] = successor_load(info, count)) != -1) {
+      count++;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&info->successors_seq, memory_order_relaxed) ==
+        seq) {
+      return count;
+    }
+  }
+}
+
+/*
+  Swap in a new list of successors in one go.
+  Requires info->lock.
+ */
+static void write_successors(p2p_peer_info *info, const int *succs,
+                             int count) {
+  unsigned seq = atomic_load_explicit(&info->successors_seq,
+                                      memory_order_relaxed);
+  atomic_store_explicit(&info->successors_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (int i = 0; i < MAX_SUCCESSORS; i++) {
+    atomic_store_explicit(&info->successors[i], i < count ? succs[i] : -1,
+                          memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&info->successors_seq, seq + 2, memory_order_release);
+}
 
-int init_peer(int peer, int first, int second, int ping,
-                    pthread_t *ping_thrd, pthread_t *tcp_thrd) {
-  info.peer = peer;
-  info.first_successor = first;
-  info.second_successor = second;
-  info.ping_interval = ping;
+int set_successor_count(int count) {
+  if (count < MIN_SUCCESSORS || count > MAX_SUCCESSORS) return -1;
+  peer_info()->successor_count = count;
+  return 0;
+}
+
+int get_successor_count(void) {
+  // set before any thread starts
+  return peer_info()->successor_count;
+}
+
+/*
+  Start the threads every peer needs before it can talk to anyone.
+ */
+static void start_peer(void) {
+  p2p_node *node = p2p_node_current();
+  // without workers everything just runs on the reactor threads
+  if (work_pool_start()) {
+    fprintf(stderr, "Warning: Couldn't start the workers\n");
+  }
+  pthread_create(&node->ping_thrd, NULL, init_ping_module, node);
+  // listening before the join goes out, its reply can beat the watcher
+  if (tcp_listen()) fprintf(stderr, "Warning: Couldn't listen for peers\n");
+  pthread_create(&node->tcp_thrd, NULL, tcp_watcher, node);
+  node->started = 1;
+}
+
+int init_peer(const int *succs, int count) {
+  int peer = get_peer();
 
   printf("> Peer %d init\n", peer);
+  finger_init(peer);
+  hash_ring_init(peer);
+  // we learn their real incarnations once they gossip to us
+  for (int i = 0; i < count; i++) {
+    hash_ring_add(succs[i], 0, hash_ring_vnodes());
+  }
+  tcp_open_store(peer);
+  obj_cache_open(peer);
+  set_successors(succs, count);
 
-  pthread_create(ping_thrd, NULL, init_ping_module, NULL);
-  pthread_create(tcp_thrd, NULL, tcp_watcher, NULL);
+  start_peer();
   return 0;
 }
 
-int join_peer(int peer, int known, int ping, pthread_t *ping_thrd,
-                    pthread_t *tcp_thrd) {
-  info.peer = peer;
-  info.ping_interval = ping;
+int join_peer(int known) {
+  int peer = get_peer();
   printf("> Peer %d join\n", peer);
+  finger_init(peer);
+  hash_ring_init(peer);
+  // we own nothing till the members have handed us our keys
+  hash_ring_set_joining(1);
+  tcp_open_store(peer);
+  obj_cache_open(peer);
 
   // we still want to be able to send pings responses out
   // i.e. if we have 9 -> 14 -> 16 and we inserting 15
   // then 9 may get updated second successor (15) before it's
   // actually finished initialising so we need to allow it to
   // be able to send back the ping response!!
-  pthread_create(ping_thrd, NULL, init_ping_module, NULL);
-  pthread_create(tcp_thrd, NULL, tcp_watcher, NULL);
+  start_peer();
 
   tcp_send_join_req(known, peer);
 
@@ -50,123 +158,171 @@ int join_peer(int peer, int known, int ping, pthread_t *ping_thrd,
   return 0;
 }
 
+int restart_peer(void) {
+  int peer = get_peer();
+  int succs[MAX_SUCCESSORS];
+  int count = store_index_open(peer) ? 0 :
+              store_index_get_successors(succs, MAX_SUCCESSORS);
+  if (count < MIN_SUCCESSORS) {
+    fprintf(stderr, "Error: Peer %d has no saved state to restart from\n",
+            peer);
+    return -1;
+  }
+
+  printf("> Peer %d restarting with %d saved successors\n", peer, count);
+  return init_peer(succs, count);
+}
+
 int get_ping_interval(void) {
-  SCOPED_MTX_LOCK(&info_lock) return info.ping_interval;
+  // set before any thread starts
+  return peer_info()->ping_interval;
 }
 
 int get_peer(void) {
-  SCOPED_MTX_LOCK(&info_lock) return info.peer;
+  // set once before any thread starts, so no info->lock (the ping module
+  // calls this holding ping->lock, info->lock is never held calling it)
+  return peer_info()->peer;
 }
 
-int get_first_successor(int wait) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    while (wait && info.first_successor == -1) {
-      printf("I'm in the middle of getting my next first successor so I'll wait...\n");
-      pthread_cond_wait(&info_wait, &info_lock);
-    }
+int get_successor(int i, int wait) {
+  if (i < 0 || i >= MAX_SUCCESSORS) return -1;
 
-    return info.first_successor;
-  }
-}
+  // a single successor is one load, no need for the seqlock
+  p2p_peer_info *info = peer_info();
+  int succ = atomic_load_explicit(&info->successors[i], memory_order_acquire);
+  if (succ != -1 || !wait) return succ;
 
-int get_second_successor(int wait) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    while (wait && info.second_successor == -1) {
-      printf("I'm in the middle of getting my next second successor so I'll wait...\n");
-      pthread_cond_wait(&info_wait, &info_lock);
+  // only waiting for one we don't know yet takes the lock
+  SCOPED_MTX_LOCK(&info->lock) {
+    while ((succ = successor_load(info, i)) == -1) {
+      printf("I'm in the middle of getting my next successors so I'll wait...\n");
+      pthread_cond_wait(&info->wait, &info->lock);
     }
-
-    return info.second_successor;
   }
+  return succ;
 }
 
-int clear_first_successor(void) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    drop_ping_info(info.first_successor + MIN_PEER_PORT);
-    int tmp = info.first_successor;
-    info.first_successor = -1;
-    return tmp;
-  }
+int get_first_successor(int wait) {
+  return get_successor(0, wait);
 }
 
-int clear_second_successor(void) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    drop_ping_info(info.second_successor + MIN_PEER_PORT);
-    int tmp = info.second_successor;
-    info.second_successor = -1;
-    return tmp;
-  }
+int get_second_successor(int wait) {
+  return get_successor(1, wait);
 }
 
-int set_first_successor(int next) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    if (info.first_successor != -1) {
-      return info.first_successor;
-    } else {
-      initialise_ping_info(IP_ADDR, next);
-      info.first_successor = next;
+int get_successors(int succs[MAX_SUCCESSORS]) {
+  return read_successors(peer_info(), succs);
+}
+
+/*
+  Stop pinging whoever we ping that isn't in succs, and start pinging
+  everyone in succs we don't yet.
+  Requires info->set_lock.
+ */
+static void update_ping_slots(const int *succs, int count) {
+  ping_info pinged[MAX_PING_FDS];
+  int pinged_count = get_ping_stats(pinged);
+  for (int i = 0; i < pinged_count; i++) {
+    int kept = 0;
+    for (int j = 0; j < count && !kept; j++) {
+      kept = pinged[i].port == succs[j] + MIN_PEER_PORT;
     }
+    if (!kept) drop_ping_info(pinged[i].port);
   }
-
-  pthread_cond_broadcast(&info_wait);
-  return 0;
+  for (int i = 0; i < count; i++) initialise_ping_info(IP_ADDR, succs[i]);
 }
 
-int set_second_successor(int next) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    if (info.second_successor != -1) {
-      return info.second_successor;
-    } else {
-      initialise_ping_info(IP_ADDR, next);
-      info.second_successor = next;
+int set_successors(const int *succs, int count) {
+  int next[MAX_SUCCESSORS];
+  int next_count = 0;
+  int old[MAX_SUCCESSORS];
+  int changed = 0;
+
+  p2p_peer_info *info = peer_info();
+  // the ping slots and the index have locks of their own, so only the
+  // swap is under info->lock, set_lock keeps a later set from landing
+  // in between
+  SCOPED_MTX_LOCK(&info->set_lock) {
+    SCOPED_MTX_LOCK(&info->lock) {
+      // a small ring wraps back round to us, stop at the first repeat
+      for (int i = 0; i < count && next_count < info->successor_count; i++) {
+        int dup = succs[i] < 0;
+        for (int j = 0; j < next_count && !dup; j++) dup = next[j] == succs[i];
+        if (dup) break;
+        next[next_count++] = succs[i];
+        if (succs[i] == info->peer) break;
+      }
+
+      // we are the only writer so this never retries
+      int old_count = read_successors(info, old);
+
+      changed = old_count != next_count;
+      for (int i = 0; i < next_count; i++) {
+        changed |= i >= old_count || old[i] != next[i];
+      }
+
+      write_successors(info, next, next_count);
     }
+    pthread_cond_broadcast(&info->wait);
+
+    // only ping slots for peers that actually came / went change
+    update_ping_slots(next, next_count);
+
+    // persist them so a restart can rejoin where we left off
+    if (next_count) store_index_save_successors(next, next_count);
   }
 
-  pthread_cond_broadcast(&info_wait);
-  return 0;
+  return changed;
 }
 
-void clear_and_set_successors(int first, int second) {
-  SCOPED_MTX_LOCK(&info_lock) {
-    if (info.first_successor != first) {
-      drop_ping_info(info.first_successor + MIN_PEER_PORT);
-      initialise_ping_info(IP_ADDR, first);
-    }
-
-    if (info.second_successor != second) {
-      drop_ping_info(info.second_successor + MIN_PEER_PORT);
-      initialise_ping_info(IP_ADDR, second);
-    }
+int drop_successor(int peer) {
+  int succs[MAX_SUCCESSORS];
+  int count = get_successors(succs);
 
-    info.first_successor = first;
-    info.second_successor = second;
+  int at = -1;
+  for (int i = 0; i < count && at == -1; i++) {
+    if (succs[i] == peer) at = i;
   }
+  if (at == -1) return -1;
+
+  for (int i = at; i + 1 < count; i++) succs[i] = succs[i + 1];
+  set_successors(succs, count - 1);
+  return at;
+}
 
-  pthread_cond_broadcast(&info_wait);
+void print_successors(void) {
+  int succs[MAX_SUCCESSORS];
+  int count = get_successors(succs);
+
+  printf("> My successors are now");
+  for (int i = 0; i < count; i++) printf(" %d", succs[i]);
+  printf("\n");
 }
 
 void close_peer(void) {
   destroy_ping_module();
+  tcp_pool_destroy();
+  store_index_close();
 }
 
 void verify_peers() {
   // TODO: Errors
-  int first = get_first_successor(0);
-  int second = get_second_successor(0);
+  int succs[MAX_SUCCESSORS];
   sleep(1);
-  if (first != -1) {
-    first = initialise_ping_info(IP_ADDR, first);
-    send_pingfd(first, PING_REQ, 0);
-  }
-
-  if (second != -1) {
-    second = initialise_ping_info(IP_ADDR, second);
-    send_pingfd(second, PING_REQ, 0);
+  int count = get_successors(succs);
+  for (int i = 0; i < count; i++) {
+    send_pingfd(initialise_ping_info(IP_ADDR, succs[i]), PING_REQ, 0);
   }
 }
 
 pthread_t setup_ping_interval() {
   pthread_t thrd;
-  pthread_create(&thrd, NULL, ping_thrd_ticker, NULL);
+  pthread_create(&thrd, NULL, ping_thrd_ticker, p2p_node_current());
+  return thrd;
+}
+
+pthread_t setup_finger_interval() {
+  pthread_t thrd;
+  pthread_create(&thrd, NULL, finger_thrd_ticker, p2p_node_current());
   return thrd;
-}
\ No newline at end of file
+}
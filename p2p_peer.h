@@ -6,17 +6,61 @@
 #define __P2P_PEER_H__
 
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define MIN_PEER_PORT (12000)
 #define PEER_TO_PORT(peer) (MIN_PEER_PORT + peer)
 
+// The successors we keep (and ping), a depart msg has to fit
+// us plus all of them in PROTO_MAX_FIELDS.
+#define MIN_SUCCESSORS (2)
+#define MAX_SUCCESSORS (7)
+#define DEFAULT_SUCCESSORS (2)
+
 typedef struct p2p_peer_info_t {
+  // these don't change once the peer starts so are read without a lock
   int peer;
-  int first_successor;
-  int second_successor;
   int ping_interval;
+  // how long we let the list get
+  int successor_count;
+
+  // successors[0] is our first successor, -1 past the ones we know.
+  // Routing reads them on every msg so they are behind a seqlock,
+  // seq is odd while a writer is swapping in a new list.
+  _Atomic unsigned successors_seq;
+  _Atomic int successors[MAX_SUCCESSORS];
+
+  // serialises writers and lets readers wait for a successor
+  pthread_mutex_t lock;
+  // signalled whenever our successors change
+  pthread_cond_t wait;
+  // held across a whole set_successors, so the ping slots and the
+  // index are brought up to date in the same order the lists land
+  pthread_mutex_t set_lock;
 } p2p_peer_info;
 
+/*
+  Set up the info of a peer that doesn't know any successors yet.
+ */
+void peer_info_init(p2p_peer_info *info, int peer, int ping_interval);
+
+/*
+  Free the info's locks.
+ */
+void peer_info_free(p2p_peer_info *info);
+
+/*
+  Set how many successors we keep, only before the peer starts.
+  Returns -1 if it is out of range.
+ */
+int set_successor_count(int count);
+
+/*
+  How many successors we keep.
+ */
+int get_successor_count(void);
+
 /*
   Get the ping interval for this p2p client.
  */
@@ -27,6 +71,12 @@ int get_ping_interval(void);
  */
 int get_peer(void);
 
+/*
+  Get the i'th successor for this p2p client (-1 if unknown).
+  If wait is set we block till we know it.
+ */
+int get_successor(int i, int wait);
+
 /*
   Get the first successor for this p2p client.
  */
@@ -38,57 +88,43 @@ int get_first_successor(int wait);
 int get_second_successor(int wait);
 
 /*
-  Clear the first successor for the p2p client.
-  Used in conjunction with an eventual set_first_successor
-  to support when we lose a successor.
-
-  Returns old successor.
+  Copy out every successor we know, returns how many.
  */
-int clear_first_successor(void);
+int get_successors(int succs[MAX_SUCCESSORS]);
 
 /*
-  Clear the second successor for the p2p client.
-  Used in conjunction with an eventual set_second_successor
-  to support when we lose a successor.
+  Replace our successors, the list is cut short at our successor
+  count or the first repeat (small rings wrap back to us).
 
-  Returns old successor.
+  Returns 1 if they changed.
  */
-int clear_second_successor(void);
+int set_successors(const int *succs, int count);
 
 /*
-  Set the first successor for the p2p client.
-  Used in conjunction with an eventual clear_first_successor
-  to support when we lose a successor.
-
-  Fails and returns old successor if it wasn't cleared
+  Remove a successor that has gone, the rest shuffle up.
+  Returns where it was in the list or -1 if it wasn't a successor.
  */
-int set_first_successor(int next);
+int drop_successor(int peer);
 
 /*
-  Set the second successor for the p2p client.
-  Used in conjunction with an eventual clear_second_successor
-  to support when we lose a successor.
-
-  Fails and returns old successor if it wasn't cleared
+  Print our current successors.
  */
-int set_second_successor(int next);
+void print_successors(void);
 
 /*
-  Clear / set both successors.
- */
-void clear_and_set_successors(int first, int second);
+  Joins a network using a known peer.
+*/
+int join_peer(int known);
 
 /*
-  Joins a network using a known peer.
+  Initialises network with known successors.
 */
-int join_peer(int peer, int known, int ping,
-                    pthread_t *ping_thrd, pthread_t *tcp_thrd);
+int init_peer(const int *succs, int count);
 
 /*
-  Initialises network with two known peers.
+  Restarts a peer from its saved index (keys + last successors).
 */
-int init_peer(int peer, int first, int second, int ping,
-                    pthread_t *ping_thrd, pthread_t *tcp_thrd);
+int restart_peer(void);
 
 /*
   Closes down the peer.
@@ -105,4 +141,9 @@ void verify_peers();
 */
 pthread_t setup_ping_interval();
 
+/*
+  Sets up a thread that stabilises successors and fixes fingers.
+*/
+pthread_t setup_finger_interval();
+
 #endif
\ No newline at end of file
@@ -11,50 +11,102 @@
 #include <signal.h>
 
 #include "utils.h"
+#include "finger.h"
+#include "hash_ring.h"
+#include "p2p_node.h"
+#include "stats.h"
 #include "tcp.h"
+#include "tcp_pool.h"
 #include "p2p_peer.h"
-#include "entry.h"
 
-typedef struct ping_info_t {
-  // the IP we are sending to
-  // required ownership!
-  char *ip;
+#define BUF_LEN (2048)
 
-  // the port we are sending to
-  int port;
+#define PING_MSG(x) (#x)
+#define PING_BUF (25)
+#define PINGS_ABRUPT (2)
 
-  // the number we have sent out
-  int last_seq_sent;
+static void ping_receiver_thread();
+static void ping_remember_pred(int peer);
 
-  // the number we have gotten back
-  int last_seq_received;
+/*
+  The ping state of the node this thread works for.
+ */
+static inline ping_state *ping_self(void) {
+  return &p2p_node_current()->ping;
+}
 
-  // the time of the next ping event
-  time_t next_ping_event;
-} ping_info;
+void ping_state_init(ping_state *ping) {
+  *ping = (ping_state){.read_socket = -1};
+  memset(ping->preds, -1, sizeof(ping->preds));
+  pthread_mutex_init(&ping->lock, NULL);
+  pthread_cond_init(&ping->wait, NULL);
 
-static ping_info ping_rets[MAX_PING_FDS] = {};
-// we'll remember the last two pings we got
-// as what predecessors we have!
-// This does mean that when we depart we may need
-// to wait for this to be full (i.e. if we depart
-// very very quickly then we'll have to wait for more pings)
-static int ping_preds[MAX_PING_FDS] = {};
+  // created up front since joining peers ping before anyone pings them
+  ping->send_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+}
 
-static pthread_mutex_t ping_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t ping_wait = PTHREAD_COND_INITIALIZER;
-static int send_socket = -1;
-static int read_socket;
+void ping_state_free(ping_state *ping) {
+  pthread_cond_destroy(&ping->wait);
+  pthread_mutex_destroy(&ping->lock);
+}
 
-#define BUF_LEN (2048)
+/*
+  Requires ping->lock.
+ */
+static int ping_any_active(const ping_state *ping) {
+  for (int i = 0; i < MAX_PING_FDS; i++) {
+    if (ping->rets[i].port) return 1;
+  }
+  return 0;
+}
 
-#define PING_MSG(x) (#x)
-#define PING_BUF (25)
-#define PINGS_ABRUPT (2)
+/*
+  A successor stopped answering, take it out and refill our list
+  from the next successor still alive.  We only give up once every
+  successor has gone.
 
-static void ping_receiver_thread();
+  Returns -1 if we have lost all of them.
+ */
+static int ping_successor_lost(int slot) {
+  ping_state *ping = ping_self();
+  int left = -1;
+  SCOPED_MTX_LOCK(&ping->lock) left = ping->rets[slot].port - MIN_PEER_PORT;
+
+  tcp_pool_drop(left);
+  finger_drop(left);
+  hash_ring_remove(left);
+  if (drop_successor(left) == -1) drop_ping_info(left + MIN_PEER_PORT);
+
+  for (;;) {
+    int first = get_first_successor(0);
+    if (first == -1) {
+      fprintf(stderr, "Error: Peer %d has lost all of its successors so it can't reconnect\n", get_peer());
+      // We don't have to send a leave request because what data would we
+      // send them... all of our successors are invalidated!
+      p2p_node *node = p2p_node_current();
+      if (node->config.on_lost) node->config.on_lost(node);
+      return -1;
+    }
+
+    int theirs[MAX_SUCCESSORS];
+    int count = tcp_send_abrupt(first, left, theirs);
+    if (count >= 0) {
+      int succs[MAX_SUCCESSORS + 1] = {first};
+      for (int i = 0; i < count; i++) succs[i + 1] = theirs[i];
+      set_successors(succs, count + 1);
+      print_successors();
+      return 0;
+    }
+
+    // they are gone too, try the one after
+    fprintf(stderr, "Error: Got invalid successor talking to %d\n", first);
+    drop_successor(first);
+  }
+}
 
-void *ping_thrd_ticker(void *_ UNUSED_ATTR) {
+void *ping_thrd_ticker(void *node) {
+  p2p_node_enter(node);
+  ping_state *ping = ping_self();
   // not currently modifiable in program
   // to reduce contention just cache
   int ping_interval = get_ping_interval();
@@ -63,62 +115,46 @@ void *ping_thrd_ticker(void *_ UNUSED_ATTR) {
     time_t shortest = 0;
     int abrupt = -1;
 
-    SCOPED_MTX_LOCK(&ping_lock) for (int i = 0; i < MAX_PING_FDS; i++) {
+    SCOPED_MTX_LOCK(&ping->lock) for (int i = 0; i < MAX_PING_FDS; i++) {
       time_t cur = time(NULL);
-      char *ip = ping_rets[i].ip;
-      int port = ping_rets[i].port;
-      time_t next = ping_rets[i].next_ping_event;
+      char *ip = ping->rets[i].ip;
+      int port = ping->rets[i].port;
+      time_t next = ping->rets[i].next_ping_event;
       if (port && ip && next && next <= cur) {
-        int diff = ping_rets[i].last_seq_sent - ping_rets[i].last_seq_received;
+        int diff = ping->rets[i].last_seq_sent - ping->rets[i].last_seq_received;
         if (diff >= PINGS_ABRUPT) {
           // they are abrupt
           printf("> Peer %d is no longer alive\n", port - MIN_PEER_PORT);
           abrupt = i;
           break;
         } else {
-          int seq = ++ping_rets[i].last_seq_sent;
-          send_ping(ip, port, PING_REQ, send_socket, seq);
+          if (diff > 0) {
+            ping->rets[i].missed++;
+            stats_ping_missed();
+          }
+          int seq = ++ping->rets[i].last_seq_sent;
+          ping->rets[i].last_sent_ns = stats_now_ns();
+          send_ping(ip, port, PING_REQ, ping->send_socket, seq);
+          stats_ping_sent();
         }
-        ping_rets[i].next_ping_event = cur + ping_interval;
-        if (!shortest) shortest = ping_interval;
-      } else if (next && (!shortest || cur - next < shortest)) {
-        // shorter time to wait upon
-        shortest = cur - next;
-      } else if (!next) {
-        ping_rets[i].next_ping_event = cur + ping_interval;
-        if (!shortest) shortest = ping_interval;
+        next = ping->rets[i].next_ping_event = cur + ping_interval;
+      } else if (port && !next) {
+        next = ping->rets[i].next_ping_event = cur + ping_interval;
       }
-    }
 
-    if (abrupt != -1) {
-      // this is explicitly non blocking...
-      // we don't want them to go looking for their second
-      // during the first, if they don't have a second then
-      // that is a big problem.
-      int left = abrupt == 1 ? clear_first_successor() : clear_second_successor();
-      int new_first = abrupt == 1 ? get_first_successor(0) : get_second_successor(0);
-
-      if (new_first == -1) {
-        fprintf(stderr, "Error: Peer %d has both successors so it can't reconnect\n", get_peer());
-        // We don't have to send a leave request because what data would we
-        // send them... both our successors are invalidated!
-        exit_handler(SIGABRT);
-      }
-
-      int new = tcp_send_abrupt(new_first, left);
-      if (new < 0) {
-        fprintf(stderr, "Error: Got invalid successor talking to %d exiting...\n", new_first);
-        exit_handler(SIGABRT);
-      }
-      printf("> My new first successor is Peer %d\n", new_first);
-      printf("> My new second successor is Peer %d\n", new);
-      clear_and_set_successors(new_first, new);
+      // shorter time to wait upon
+      if (port && (!shortest || next - cur < shortest)) shortest = next - cur;
     }
 
+    // embedded nodes with nothing left just stop pinging
+    if (abrupt != -1 && ping_successor_lost(abrupt)) break;
+
     if (!shortest) {
-      SCOPED_MTX_LOCK(&ping_lock) {
+      SCOPED_MTX_LOCK(&ping->lock) {
         // we require atleast one object to be initialised
-        while (!ping_rets[0].port) pthread_cond_wait(&ping_wait, &ping_lock);
+        while (!ping_any_active(ping)) {
+          pthread_cond_wait(&ping->wait, &ping->lock);
+        }
       }
       continue;
     }
@@ -130,11 +166,13 @@ void *ping_thrd_ticker(void *_ UNUSED_ATTR) {
   pthread_exit(NULL);
 }
 
-void *init_ping_module(void *_) {
-  memset(ping_preds, -1, sizeof(int) * MAX_PING_FDS);
+void *init_ping_module(void *node) {
+  p2p_node_enter(node);
+  ping_state *ping = ping_self();
 
   // for recv'ing pings
-  read_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  int read_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  SCOPED_MTX_LOCK(&ping->lock) ping->read_socket = read_socket;
 
   struct sockaddr_in bind_addr;
   set_sockaddr(&bind_addr, IP_ADDR, get_peer() + MIN_PEER_PORT);
@@ -151,9 +189,16 @@ void *init_ping_module(void *_) {
 }
 
 void destroy_ping_module(void) {
-  close(send_socket);
-  shutdown(read_socket, SHUT_RDWR);
-  close(read_socket);
+  ping_state *ping = ping_self();
+
+  SCOPED_MTX_LOCK(&ping->lock) {
+    if (ping->send_socket != -1) close(ping->send_socket);
+    if (ping->read_socket != -1) {
+      shutdown(ping->read_socket, SHUT_RDWR);
+      close(ping->read_socket);
+    }
+    ping->send_socket = ping->read_socket = -1;
+  }
 }
 
 int send_ping(char *ip, int port, ping_type type, int socket, int seq) {
@@ -184,21 +229,22 @@ int send_ping(char *ip, int port, ping_type type, int socket, int seq) {
 }
 
 int send_pingfd(int ping_fd, ping_type type, int seq) {
-  if (send_socket == -1) send_socket = socket(AF_INET, SOCK_DGRAM, 0);
-
+  ping_state *ping = ping_self();
   int port = 0;
   char *ip = NULL;
 
-  SCOPED_MTX_LOCK(&ping_lock) if (0 <= ping_fd && ping_fd < MAX_PING_FDS) {
-    port = ping_rets[ping_fd].port;
-    ip = ping_rets[ping_fd].ip;
+  SCOPED_MTX_LOCK(&ping->lock) if (0 <= ping_fd && ping_fd < MAX_PING_FDS) {
+    port = ping->rets[ping_fd].port;
+    ip = ping->rets[ping_fd].ip;
   }
 
-  return port && ip ? send_ping(ip, port, type, send_socket, seq) : -1;
+  return port && ip ? send_ping(ip, port, type, ping->send_socket, seq) : -1;
 }
 
 // A thread responsible for receiving pings
 void ping_receiver_thread() {
+  ping_state *ping = ping_self();
+  int read_socket = ping->read_socket;
   struct sockaddr_in in;
   socklen_t len;
   ssize_t count;
@@ -224,18 +270,26 @@ void ping_receiver_thread() {
 
     port = peer + MIN_PEER_PORT;
     if (!strcmp(buf, PING_MSG(PING_ACK))) {
-      SCOPED_MTX_LOCK(&ping_lock) {
+      SCOPED_MTX_LOCK(&ping->lock) {
         int i = 0;
         for (; i < MAX_PING_FDS; i++) {
-          if (ping_rets[i].port == port) {
+          if (ping->rets[i].port == port) {
             break;
           }
         }
 
         if (i < MAX_PING_FDS) {
           // successor
-          if (seq > ping_rets[i].last_seq_received) {
-            ping_rets[i].last_seq_received = seq;
+          if (seq > ping->rets[i].last_seq_received) {
+            ping->rets[i].last_seq_received = seq;
+          }
+          // older acks would be timed against the wrong send
+          // (and the first ping from init_peer isn't timed at all)
+          if (seq == ping->rets[i].last_seq_sent &&
+              ping->rets[i].last_sent_ns) {
+            int64_t rtt = stats_now_ns() - ping->rets[i].last_sent_ns;
+            ping->rets[i].last_rtt_ns = rtt;
+            stats_ping_acked(rtt);
           }
           printf("> Ping response received from Peer %d\n", peer);
         } else {
@@ -246,14 +300,7 @@ void ping_receiver_thread() {
     } else if (!strcmp(buf, PING_MSG(PING_REQ))) {
       // we'll send back an acknowledgement
       printf("> Ping request received from Peer %d\n", peer);
-      int swp = ping_preds[0];
-      ping_preds[0] = peer;
-
-      SCOPED_MTX_LOCK(&ping_lock) for (int i = 1; swp && i < MAX_PING_FDS; i++){
-        int tmp = ping_preds[i];
-        ping_preds[i] = swp;
-        swp = ping_preds[i];
-      }
+      ping_remember_pred(peer);
 
       inet_ntop(in.sin_family, &in.sin_addr, ip, INET_ADDRSTRLEN);
       // we don't update our 'sent' seq for this...
@@ -276,32 +323,65 @@ void ping_receiver_thread() {
   }
 }
 
+/*
+  Move the peer to the front of our predecessors.
+ */
+static void ping_remember_pred(int peer) {
+  ping_state *ping = ping_self();
+  int keep = get_successor_count();
+
+  SCOPED_MTX_LOCK(&ping->lock) {
+    int at = 0;
+    while (at < keep - 1 && ping->preds[at] != peer) at++;
+    for (; at > 0; at--) ping->preds[at] = ping->preds[at - 1];
+    ping->preds[0] = peer;
+  }
+}
+
 int get_preds(int preds[MAX_PING_FDS]) {
+  ping_state *ping = ping_self();
+  int count = 0;
+  SCOPED_MTX_LOCK(&ping->lock) for (int i = 0; i < MAX_PING_FDS; i++) {
+    if (ping->preds[i] != -1) preds[count++] = ping->preds[i];
+  }
+  return count;
+}
+
+int get_ping_stats(ping_info infos[MAX_PING_FDS]) {
+  ping_state *ping = ping_self();
   int count = 0;
-  SCOPED_MTX_LOCK(&ping_lock) for (int i = 0; i < MAX_PING_FDS; i++) {
-    preds[count++] = ping_preds[i];
+  SCOPED_MTX_LOCK(&ping->lock) for (int i = 0; i < MAX_PING_FDS; i++) {
+    if (ping->rets[i].port) infos[count++] = ping->rets[i];
   }
   return count;
 }
 
 void drop_ping_info(int port) {
-  SCOPED_MTX_LOCK(&ping_lock) for (int i = 0; i < MAX_PING_FDS; i++) {
-    if (ping_rets[i].port == port) {
+  ping_state *ping = ping_self();
+  SCOPED_MTX_LOCK(&ping->lock) for (int i = 0; i < MAX_PING_FDS; i++) {
+    if (ping->rets[i].port == port) {
       // free spot
-      ping_rets[i] = (ping_info){};
+      ping->rets[i] = (ping_info){};
       break;
     }
   }
 }
 
 int initialise_ping_info(char *ip, int peer) {
-  SCOPED_MTX_LOCK(&ping_lock) for (int i = 0; i < MAX_PING_FDS; i++) {
-    if (!ping_rets[i].port) {
-      // free spot
-      ping_rets[i] = (ping_info){.ip = ip, .port = peer + MIN_PEER_PORT};
-      pthread_cond_broadcast(&ping_wait);
-      return i;
+  ping_state *ping = ping_self();
+  // one lock for the lookup and the insert, or two callers could both
+  // miss them and take a slot each
+  SCOPED_MTX_LOCK(&ping->lock) {
+    int free_at = -1;
+    for (int i = 0; i < MAX_PING_FDS; i++) {
+      if (ping->rets[i].port == peer + MIN_PEER_PORT) return i;
+      if (!ping->rets[i].port && free_at == -1) free_at = i;
     }
+    if (free_at == -1) break;
+
+    ping->rets[free_at] = (ping_info){.ip = ip, .port = peer + MIN_PEER_PORT};
+    pthread_cond_broadcast(&ping->wait);
+    return free_at;
   }
 
   return -1;
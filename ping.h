@@ -5,6 +5,10 @@
 #ifndef __P2P_INIT_H__
 #define __P2P_INIT_H__
 
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
 #include "p2p_peer.h"
 #include "utils.h"
 
@@ -15,14 +19,66 @@
 #define IP_ADDR ("127.0.0.1")
 
 // The maximum number of ports we are sending
-// pings to!
-#define MAX_PING_FDS (2)
+// pings to! (one per successor)
+#define MAX_PING_FDS (MAX_SUCCESSORS)
 
 typedef enum ping_type_t {
   PING_ACK = 0,
   PING_REQ = 1,
 } ping_type;
 
+typedef struct ping_info_t {
+  // the IP we are sending to
+  // required ownership!
+  char *ip;
+
+  // the port we are sending to
+  int port;
+
+  // the number we have sent out
+  int last_seq_sent;
+
+  // the number we have gotten back
+  int last_seq_received;
+
+  // the time of the next ping event
+  time_t next_ping_event;
+
+  // pings that went unanswered before we sent the next one
+  int missed;
+
+  // when the last ping went out and how long the last ack took (ns)
+  int64_t last_sent_ns;
+  int64_t last_rtt_ns;
+} ping_info;
+
+typedef struct ping_state_t {
+  ping_info rets[MAX_PING_FDS];
+
+  // we'll remember the last distinct peers that pinged us
+  // (as many as we keep successors) as what predecessors we have!
+  // This does mean that when we depart we may need
+  // to wait for this to be full (i.e. if we depart
+  // very very quickly then we'll have to wait for more pings)
+  int preds[MAX_PING_FDS];
+
+  pthread_mutex_t lock;
+  pthread_cond_t wait;
+
+  int send_socket;
+  int read_socket;
+} ping_state;
+
+/*
+  Set up the ping state of a peer (opens its send socket).
+ */
+void ping_state_init(ping_state *ping);
+
+/*
+  Free the ping state's locks, the sockets go in destroy_ping_module.
+ */
+void ping_state_free(ping_state *ping);
+
 /*
   Send a ping using a ping descriptor.
 */
@@ -40,13 +96,14 @@ int send_ping(char *ip, int port, ping_type type, int socket, int seq);
 
 /*
   Reinitialises successor using given IP and peer value.
+  Returns the ping descriptor (the existing one if we already ping them).
 */
 int initialise_ping_info(char *ip, int peer);
 
 /*
-  Initialises the ping module!
+  Initialises the ping module for a node!
 */
-void *init_ping_module(void *_ UNUSED_ATTR);
+void *init_ping_module(void *node);
 
 /*
   Closes all sockets and deinitialises memory.
@@ -54,13 +111,21 @@ void *init_ping_module(void *_ UNUSED_ATTR);
 void destroy_ping_module(void);
 
 /*
-  The thread for a ping ticker.  Must be initialised separately to the module
+  The thread for a node's ping ticker.
+  Must be initialised separately to the module
 */
-void *ping_thrd_ticker(void *_ UNUSED_ATTR);
+void *ping_thrd_ticker(void *node);
 
 /*
-  Get all predecessors read returns count of preds.
+  Get the peers that have been pinging us (our predecessors),
+  returns count of preds.
 */
 int get_preds(int preds[MAX_PING_FDS]);
 
+/*
+  Copy out the successors we are pinging (for their stats),
+  returns count of successors.
+*/
+int get_ping_stats(ping_info infos[MAX_PING_FDS]);
+
 #endif
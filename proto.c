@@ -0,0 +1,270 @@
+#include "proto.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+
+static const char *type_names[] = {
+  [TCP_JOIN_REQ] = TCP_MSG(TCP_JOIN_REQ),
+  [TCP_JOIN_RESP] = TCP_MSG(TCP_JOIN_RESP),
+  [TCP_PEER_DEPART] = TCP_MSG(TCP_PEER_DEPART),
+  [TCP_SUCC] = TCP_MSG(TCP_SUCC),
+  [TCP_RETRIEVE] = TCP_MSG(TCP_RETRIEVE),
+  [TCP_STORE] = TCP_MSG(TCP_STORE),
+  [TCP_TRANSFER] = TCP_MSG(TCP_TRANSFER),
+  [TCP_FIND_SUCC] = TCP_MSG(TCP_FIND_SUCC),
+  [TCP_FIND_SUCC_RESP] = TCP_MSG(TCP_FIND_SUCC_RESP),
+  [TCP_MEMBERS] = TCP_MSG(TCP_MEMBERS),
+  [TCP_REPLICATE] = TCP_MSG(TCP_REPLICATE),
+  [TCP_STORE_ACK] = TCP_MSG(TCP_STORE_ACK),
+  [TCP_TRANSFER_OFFER] = TCP_MSG(TCP_TRANSFER_OFFER),
+  [TCP_RANGE_REQ] = TCP_MSG(TCP_RANGE_REQ),
+  [TCP_TRANSFER_RANGE] = TCP_MSG(TCP_TRANSFER_RANGE),
+  [TCP_CACHE_DROP] = TCP_MSG(TCP_CACHE_DROP),
+  [TCP_STORE_BATCH] = TCP_MSG(TCP_STORE_BATCH),
+  [TCP_RETRIEVE_BATCH] = TCP_MSG(TCP_RETRIEVE_BATCH),
+  [TCP_HANDOFF_REQ] = TCP_MSG(TCP_HANDOFF_REQ),
+  [TCP_HANDOFF] = TCP_MSG(TCP_HANDOFF),
+  [TCP_HANDOFF_DONE] = TCP_MSG(TCP_HANDOFF_DONE),
+  [TCP_HANDOFF_ACK] = TCP_MSG(TCP_HANDOFF_ACK),
+};
+
+#define TYPE_COUNT (sizeof(type_names) / sizeof(*type_names))
+
+static _Atomic proto_format send_format = PROTO_BINARY;
+static atomic_uint req_ids = 1;
+
+void proto_set_format(proto_format format) {
+  atomic_store(&send_format, format);
+}
+
+proto_format proto_get_format(void) {
+  return atomic_load(&send_format);
+}
+
+uint32_t proto_next_req_id(void) {
+  return atomic_fetch_add(&req_ids, 1);
+}
+
+const char *proto_type_name(tcp_type type) {
+  return (unsigned)type < TYPE_COUNT ? type_names[type] : NULL;
+}
+
+int proto_frame(const char *buf, size_t len, size_t *frame_len) {
+  if (!len) return 0;
+
+  if ((uint8_t)buf[0] != PROTO_MAGIC) {
+    // old text format
+    const char *end = memchr(buf, PROTO_TEXT_END, len);
+    if (!end) return len >= PROTO_MAX_MSG ? -1 : 0;
+    *frame_len = end - buf + 1;
+    return 1;
+  }
+
+  if (len < PROTO_HEADER_LEN) return 0;
+  if ((uint8_t)buf[1] != PROTO_VERSION) return -1;
+
+  uint32_t body = proto_load_le32(buf + 4);
+  if (body > PROTO_MAX_MSG - PROTO_HEADER_LEN) return -1;
+  if (len < PROTO_HEADER_LEN + body) return 0;
+
+  *frame_len = PROTO_HEADER_LEN + body;
+  return 1;
+}
+
+/*
+  strtoll without the noise, text fields that aren't integers
+  are just the trailing string.
+ */
+static int proto_text_int(const char *in, int64_t *out) {
+  char *end;
+  errno = 0;
+  long long tmp = strtoll(in, &end, 10);
+  if (in == end || *end || errno) return 0;
+  *out = tmp;
+  return 1;
+}
+
+static int proto_decode_text(char *buf, size_t frame_len, proto_msg *msg) {
+  // drop the terminator (and any \r from a hand typed msg)
+  buf[frame_len - 1] = '\0';
+  buf[strcspn(buf, "\r")] = '\0';
+
+  READ_MSG_TYPE(0, buf, " ");
+
+  unsigned type = 0;
+  for (; type < TYPE_COUNT; type++) {
+    if (type_names[type] && !strcasecmp(buf, type_names[type])) break;
+  }
+  if (type == TYPE_COUNT) {
+    fprintf(stderr, "Error: Unknown type %s\n", buf);
+    return -1;
+  }
+
+  *msg = (proto_msg){.format = PROTO_TEXT, .type = type};
+  for (char *tok; (tok = READ_MSG_STR(0));) {
+    if (!msg->str && msg->field_count < PROTO_MAX_FIELDS &&
+        proto_text_int(tok, &msg->fields[msg->field_count])) {
+      msg->field_count++;
+    } else if (!msg->str) {
+      msg->str = tok;
+      msg->str_len = strlen(tok);
+    } else {
+      fprintf(stderr, "Error: Trailing data in %s msg\n", buf);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int proto_decode(char *buf, size_t frame_len, proto_msg *msg) {
+  if ((uint8_t)buf[0] != PROTO_MAGIC) {
+    return proto_decode_text(buf, frame_len, msg);
+  }
+
+  const uint8_t *hdr = (const uint8_t *)buf;
+  uint32_t body_len = proto_load_le32(hdr + 4);
+  if (body_len < PROTO_BODY_HEADER_LEN ||
+      PROTO_HEADER_LEN + body_len != frame_len ||
+      hdr[2] >= TYPE_COUNT) {
+    fprintf(stderr, "Error: Malformed msg\n");
+    return -1;
+  }
+
+  const uint8_t *body = hdr + PROTO_HEADER_LEN;
+  uint16_t field_count = body[0] | body[1] << 8;
+  uint16_t str_len = body[2] | body[3] << 8;
+  if (field_count > PROTO_MAX_FIELDS ||
+      PROTO_BODY_HEADER_LEN + field_count * 8 + str_len != body_len) {
+    fprintf(stderr, "Error: Malformed msg body\n");
+    return -1;
+  }
+
+  msg->format = PROTO_BINARY;
+  msg->type = hdr[2];
+  msg->flags = hdr[3];
+  msg->req_id = proto_load_le32(hdr + 8);
+  msg->field_count = field_count;
+
+  const uint8_t *cur = body + PROTO_BODY_HEADER_LEN;
+  for (int i = 0; i < field_count; i++, cur += 8) {
+    msg->fields[i] = (int64_t)proto_load_le64(cur);
+  }
+
+  msg->str = str_len ? (const char *)cur : NULL;
+  msg->str_len = str_len;
+  return 0;
+}
+
+static int proto_encode_text(char *buf, size_t cap, tcp_type type,
+                             const int64_t *fields, int field_count,
+                             const char *str, size_t str_len) {
+  int len = snprintf(buf, cap, "%s", type_names[type]);
+  for (int i = 0; i < field_count && len < (int)cap; i++) {
+    len += snprintf(buf + len, cap - len, " %lld", (long long)fields[i]);
+  }
+  if (str && len < (int)cap) {
+    len += snprintf(buf + len, cap - len, " %.*s", (int)str_len, str);
+  }
+  if (len + 1 >= (int)cap) return -1;
+
+  buf[len++] = PROTO_TEXT_END;
+  buf[len] = '\0';
+  return len;
+}
+
+int proto_encode_fmt(char *buf, size_t cap, proto_format format,
+                     tcp_type type, uint8_t flags, uint32_t req_id,
+                     const int64_t *fields, int field_count,
+                     const char *str, size_t str_len) {
+  if (!proto_type_name(type) || field_count > PROTO_MAX_FIELDS) return -1;
+  if (!str) str_len = 0;
+
+  if (format == PROTO_TEXT) {
+    return proto_encode_text(buf, cap, type, fields, field_count,
+                             str, str_len);
+  }
+
+  size_t body_len = PROTO_BODY_HEADER_LEN + field_count * 8 + str_len;
+  if (str_len > UINT16_MAX || PROTO_HEADER_LEN + body_len > cap ||
+      PROTO_HEADER_LEN + body_len > PROTO_MAX_MSG) {
+    return -1;
+  }
+
+  uint8_t *out = (uint8_t *)buf;
+  out[0] = PROTO_MAGIC;
+  out[1] = PROTO_VERSION;
+  out[2] = type;
+  out[3] = flags;
+  proto_store_le32(out + 4, body_len);
+  proto_store_le32(out + 8, req_id);
+
+  uint8_t *body = out + PROTO_HEADER_LEN;
+  body[0] = field_count & 0xFF;
+  body[1] = field_count >> 8;
+  body[2] = str_len & 0xFF;
+  body[3] = str_len >> 8;
+
+  uint8_t *cur = body + PROTO_BODY_HEADER_LEN;
+  for (int i = 0; i < field_count; i++, cur += 8) {
+    proto_store_le64(cur, (uint64_t)fields[i]);
+  }
+  if (str_len) memcpy(cur, str, str_len);
+
+  return PROTO_HEADER_LEN + body_len;
+}
+
+int proto_encode(char *buf, size_t cap, tcp_type type, uint8_t flags,
+                 uint32_t req_id, const int64_t *fields, int field_count,
+                 const char *str, size_t str_len) {
+  return proto_encode_fmt(buf, cap, proto_get_format(), type, flags, req_id,
+                          fields, field_count, str, str_len);
+}
+
+size_t proto_put_keys(char *buf, const int *keys, int count) {
+  for (int i = 0; i < count; i++) {
+    proto_store_le32(buf + i * PROTO_KEY_LEN, (uint32_t)keys[i]);
+  }
+  return (size_t)count * PROTO_KEY_LEN;
+}
+
+int proto_get_keys(const proto_msg *msg, int *keys, int max) {
+  // a text msg can't carry one
+  if (msg->format != PROTO_BINARY || !msg->str ||
+      msg->str_len % PROTO_KEY_LEN || msg->str_len / PROTO_KEY_LEN > max) {
+    return -1;
+  }
+
+  int count = msg->str_len / PROTO_KEY_LEN;
+  for (int i = 0; i < count; i++) {
+    int32_t key = (int32_t)proto_load_le32(msg->str + i * PROTO_KEY_LEN);
+    if (key < 0) return -1;
+    keys[i] = key;
+  }
+  return count;
+}
+
+int proto_recv(int fd, char *buf, size_t cap, proto_msg *msg) {
+  size_t len = 0;
+  size_t frame_len = 0;
+
+  for (;;) {
+    int framed = proto_frame(buf, len, &frame_len);
+    if (framed < 0) return -1;
+    if (framed) break;
+    if (len == cap) return -1;
+
+    ssize_t bytes = recv(fd, buf + len, cap - len, 0);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    len += bytes;
+  }
+
+  return proto_decode(buf, frame_len, msg) ? -1 : (int)frame_len;
+}
@@ -0,0 +1,168 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_PROTO_H__
+#define __P2P_PROTO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tcp.h"
+
+/**                                                    **
+ * The wire format for tcp msgs.                        *
+ *                                                      *
+ * Every msg is a fixed 12 byte header followed by a    *
+ * body of length bytes, all integers are little endian *
+ *                                                      *
+ *   u8 magic | u8 version | u8 type | u8 flags         *
+ *   u32 length                                         *
+ *   u32 request id                                     *
+ *                                                      *
+ * The body is u16 field count, u16 string length then  *
+ * that many i64 fields and then the (unterminated)     *
+ * string.                                              *
+ *                                                      *
+ * The old space separated text format is still decoded *
+ * (and can be sent with --text-protocol) since the     *
+ * magic byte can never start a text msg.               *
+ **                                                    **/
+
+#define TCP_MSG(x) (#x)
+
+#define PROTO_MAGIC (0xB2)
+#define PROTO_VERSION (1)
+#define PROTO_HEADER_LEN (12)
+#define PROTO_BODY_HEADER_LEN (4)
+
+// text msgs are terminated by one of these
+#define PROTO_TEXT_END ('\n')
+
+// The largest msg (header included) we'll accept
+#define PROTO_MAX_MSG (4096)
+#define PROTO_MAX_FIELDS (8)
+// Every key of a key list (the string of a batch or handoff msg)
+#define PROTO_KEY_LEN (4)
+
+typedef enum proto_format_t {
+  PROTO_BINARY = 0,
+  PROTO_TEXT = 1,
+} proto_format;
+
+/*
+  A decoded msg, the string points into the buffer it was decoded from
+  and is NOT null terminated.
+ */
+typedef struct proto_msg_t {
+  proto_format format;
+  tcp_type type;
+  uint8_t flags;
+  uint32_t req_id;
+
+  int field_count;
+  int64_t fields[PROTO_MAX_FIELDS];
+
+  const char *str;
+  uint32_t str_len;
+} proto_msg;
+
+static inline uint32_t proto_load_le32(const void *ptr) {
+  uint32_t out;
+  memcpy(&out, ptr, sizeof(out));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  out = __builtin_bswap32(out);
+#endif
+  return out;
+}
+
+static inline uint64_t proto_load_le64(const void *ptr) {
+  uint64_t out;
+  memcpy(&out, ptr, sizeof(out));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  out = __builtin_bswap64(out);
+#endif
+  return out;
+}
+
+static inline void proto_store_le32(void *ptr, uint32_t in) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  in = __builtin_bswap32(in);
+#endif
+  memcpy(ptr, &in, sizeof(in));
+}
+
+static inline void proto_store_le64(void *ptr, uint64_t in) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  in = __builtin_bswap64(in);
+#endif
+  memcpy(ptr, &in, sizeof(in));
+}
+
+/*
+  Select the format we send msgs in, we always accept both.
+ */
+void proto_set_format(proto_format format);
+proto_format proto_get_format(void);
+
+/*
+  A new (process unique) request id.
+ */
+uint32_t proto_next_req_id(void);
+
+/*
+  The name of a msg type, NULL if it isn't valid.
+ */
+const char *proto_type_name(tcp_type type);
+
+/*
+  Check if buf starts with a complete msg.
+  Returns 1 and sets frame_len if it does, 0 if we need more bytes
+  and -1 if the bytes can never be a valid msg.
+ */
+int proto_frame(const char *buf, size_t len, size_t *frame_len);
+
+/*
+  Decode a complete msg (as found by proto_frame).
+  Text msgs are decoded destructively.
+
+  Returns -1 if the msg is invalid.
+ */
+int proto_decode(char *buf, size_t frame_len, proto_msg *msg);
+
+/*
+  Encode a msg in the given format.
+  Returns the encoded length or -1 if it doesn't fit.
+ */
+int proto_encode_fmt(char *buf, size_t cap, proto_format format,
+                     tcp_type type, uint8_t flags, uint32_t req_id,
+                     const int64_t *fields, int field_count,
+                     const char *str, size_t str_len);
+
+/*
+  Encode a msg in the currently selected format.
+ */
+int proto_encode(char *buf, size_t cap, tcp_type type, uint8_t flags,
+                 uint32_t req_id, const int64_t *fields, int field_count,
+                 const char *str, size_t str_len);
+
+/*
+  Write keys into buf as a key list, each a little endian i32 (buf needs
+  count * PROTO_KEY_LEN bytes).  Returns the length of the list.
+ */
+size_t proto_put_keys(char *buf, const int *keys, int count);
+
+/*
+  Read the key list that is the string of a binary msg into keys.
+  Returns how many keys or -1 if it isn't a key list or has more than max.
+ */
+int proto_get_keys(const proto_msg *msg, int *keys, int max);
+
+/*
+  Blocking read of a single msg from fd into buf.
+  Returns the frame length or -1.
+ */
+int proto_recv(int fd, char *buf, size_t cap, proto_msg *msg);
+
+#endif
@@ -0,0 +1,99 @@
+#include "reactor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+static void *reactor_loop(void *arg);
+static void *reactor_thread(void *arg);
+
+int reactor_init(reactor *r, int thread_count, reactor_thread_fn on_thread,
+                 void *thread_arg) {
+  if (thread_count < 1) thread_count = 1;
+  if (thread_count > REACTOR_MAX_THREADS) thread_count = REACTOR_MAX_THREADS;
+
+  memset(r, 0, sizeof(*r));
+  r->thread_count = thread_count;
+  r->on_thread = on_thread;
+  r->thread_arg = thread_arg;
+  r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epoll_fd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int reactor_add(reactor *r, reactor_handle *handle, uint32_t events) {
+  struct epoll_event ev = {
+    .events = events | EPOLLONESHOT,
+    .data = {.ptr = handle},
+  };
+  return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, handle->fd, &ev);
+}
+
+int reactor_rearm(reactor *r, reactor_handle *handle, uint32_t events) {
+  struct epoll_event ev = {
+    .events = events | EPOLLONESHOT,
+    .data = {.ptr = handle},
+  };
+  return epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, handle->fd, &ev);
+}
+
+int reactor_remove(reactor *r, reactor_handle *handle) {
+  return epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, handle->fd, NULL);
+}
+
+void reactor_run(reactor *r) {
+  // thread 0 is always the caller
+  r->threads[0] = pthread_self();
+  for (int i = 1; i < r->thread_count; i++) {
+    pthread_create(&r->threads[i], NULL, reactor_thread, r);
+  }
+
+  reactor_loop(r);
+}
+
+void reactor_destroy(reactor *r) {
+  for (int i = 1; i < r->thread_count; i++) {
+    if (!pthread_cancel(r->threads[i])) pthread_join(r->threads[i], NULL);
+  }
+  close(r->epoll_fd);
+}
+
+static void *reactor_thread(void *arg) {
+  reactor *r = arg;
+  if (r->on_thread) r->on_thread(r->thread_arg);
+  return reactor_loop(r);
+}
+
+static void *reactor_loop(void *arg) {
+  reactor *r = arg;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  for (;;) {
+    // epoll_wait is a cancellation point so we can be torn down here
+    int count = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < count; i++) {
+      reactor_handle *handle = events[i].data.ptr;
+      handle->on_event(handle, events[i].events);
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,91 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_REACTOR_H__
+#define __P2P_REACTOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/**                                                    **
+ * An epoll based reactor that drives non blocking fds  *
+ * from a small fixed set of threads.                   *
+ **                                                    **/
+
+// The maximum number of threads a reactor will run
+#define REACTOR_MAX_THREADS (16)
+
+// How many events we pull out of epoll per wakeup
+#define REACTOR_MAX_EVENTS (64)
+
+typedef struct reactor_handle_t reactor_handle;
+
+/*
+  Called when the handle is ready, events is the epoll event mask.
+  Handles are registered as oneshot so only one thread ever runs a
+  handle at a time, the callback has to rearm (or remove) the handle
+  once it is done with it.
+ */
+typedef void (*reactor_event_fn)(reactor_handle *handle, uint32_t events);
+
+struct reactor_handle_t {
+  int fd;
+  reactor_event_fn on_event;
+};
+
+/*
+  Run first on every thread reactor_run spawns.
+ */
+typedef void (*reactor_thread_fn)(void *arg);
+
+typedef struct reactor_t {
+  int epoll_fd;
+  int thread_count;
+  pthread_t threads[REACTOR_MAX_THREADS];
+
+  reactor_thread_fn on_thread;
+  void *thread_arg;
+} reactor;
+
+/*
+  Initialise a reactor, on_thread can be NULL.
+  Returns -1 on failure.
+ */
+int reactor_init(reactor *r, int thread_count, reactor_thread_fn on_thread,
+                 void *thread_arg);
+
+/*
+  Set a fd to be non blocking.
+ */
+int reactor_set_nonblock(int fd);
+
+/*
+  Register a handle for the given events (EPOLLONESHOT is implied).
+ */
+int reactor_add(reactor *r, reactor_handle *handle, uint32_t events);
+
+/*
+  Rearm a oneshot handle after its callback has finished with it.
+ */
+int reactor_rearm(reactor *r, reactor_handle *handle, uint32_t events);
+
+/*
+  Remove a handle from the reactor, doesn't close the fd.
+ */
+int reactor_remove(reactor *r, reactor_handle *handle);
+
+/*
+  Run the event loop on the calling thread, never returns.
+  Spawns the other thread_count - 1 threads first.
+ */
+void reactor_run(reactor *r);
+
+/*
+  Stops the helper threads and closes the epoll fd.
+ */
+void reactor_destroy(reactor *r);
+
+#endif
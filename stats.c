@@ -0,0 +1,372 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "handoff.h"
+#include "p2p_node.h"
+#include "p2p_peer.h"
+#include "ping.h"
+#include "proto.h"
+
+#define STATS_TMP_SUFFIX (".tmp")
+
+// the quantiles every histogram reports
+static const double stats_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+#define STATS_QUANTILE_COUNT \
+  (sizeof(stats_quantiles) / sizeof(*stats_quantiles))
+
+/*
+  The stats of the node this thread works for.
+ */
+static inline stats_state *stats_self(void) {
+  return &p2p_node_current()->stats;
+}
+
+void stats_state_init(stats_state *stats, const char *path) {
+  memset(stats, 0, sizeof(*stats));
+  stats->started_ns = stats_now_ns();
+  for (int i = 0; i < STATS_MAX_PENDING; i++) stats->pending[i].file = -1;
+  pthread_mutex_init(&stats->pending_lock, NULL);
+  if (path) snprintf(stats->path, sizeof(stats->path), "%s", path);
+}
+
+void stats_state_free(stats_state *stats) {
+  pthread_mutex_destroy(&stats->pending_lock);
+}
+
+/*
+  The bucket a value lands in, the first 2^STATS_SUB_BITS are exact
+  after that each power of 2 gets split into STATS_SUB_BUCKETS.
+ */
+static int stats_bucket(uint64_t v) {
+  if (v < STATS_SUB_BUCKETS) return v;
+
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - STATS_SUB_BITS;
+  int bucket = (shift + 1) * STATS_SUB_BUCKETS +
+               ((v >> shift) & (STATS_SUB_BUCKETS - 1));
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/*
+  The largest value that lands in a bucket.
+ */
+static uint64_t stats_bucket_upper(int bucket) {
+  if (bucket < STATS_SUB_BUCKETS) return bucket;
+
+  int shift = bucket / STATS_SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS)
+                   << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void stats_hist_record(stats_hist *hist, int64_t ns) {
+  uint64_t v = ns > 0 ? ns : 0;
+  atomic_fetch_add_explicit(&hist->buckets[stats_bucket(v)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->sum, v, memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+  while (v > max && !atomic_compare_exchange_weak_explicit(
+                        &hist->max, &max, v, memory_order_relaxed,
+                        memory_order_relaxed)) {
+  }
+}
+
+uint64_t stats_hist_quantile(const stats_hist *hist, double quantile) {
+  // the buckets might be ahead of the count so we total them ourselves
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t total = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    counts[i] = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    total += counts[i];
+  }
+  if (!total) return 0;
+
+  uint64_t rank = quantile * total;
+  if (rank >= total) rank = total - 1;
+
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > rank) {
+      uint64_t upper = stats_bucket_upper(i);
+      return upper < max ? upper : max;
+    }
+  }
+  return max;
+}
+
+static inline void stats_inc(_Atomic uint64_t *counter, uint64_t by) {
+  atomic_fetch_add_explicit(counter, by, memory_order_relaxed);
+}
+
+void stats_handled(tcp_type type, int64_t ns) {
+  if ((unsigned)type >= TCP_TYPE_COUNT) return;
+  stats_state *stats = stats_self();
+  stats_inc(&stats->handled[type], 1);
+  stats_hist_record(&stats->handler_ns[type], ns);
+}
+
+void stats_forwarded(tcp_type type) {
+  if ((unsigned)type >= TCP_TYPE_COUNT) return;
+  stats_inc(&stats_self()->forwarded[type], 1);
+}
+
+void stats_file_sent(int64_t bytes) {
+  stats_state *stats = stats_self();
+  stats_inc(&stats->files_sent, 1);
+  stats_inc(&stats->bytes_sent, bytes);
+}
+
+void stats_file_received(int64_t bytes) {
+  stats_state *stats = stats_self();
+  stats_inc(&stats->files_received, 1);
+  stats_inc(&stats->bytes_received, bytes);
+}
+
+void stats_segment_sent(int64_t bytes) {
+  stats_state *stats = stats_self();
+  stats_inc(&stats->segments_sent, 1);
+  stats_inc(&stats->bytes_sent, bytes);
+}
+
+void stats_segment_received(int64_t bytes) {
+  stats_state *stats = stats_self();
+  stats_inc(&stats->segments_received, 1);
+  stats_inc(&stats->bytes_received, bytes);
+}
+
+void stats_checksum_failed(void) {
+  stats_inc(&stats_self()->checksum_failures, 1);
+}
+
+void stats_locate_hit(void) {
+  stats_inc(&stats_self()->locate_hits, 1);
+}
+
+void stats_locate_miss(void) {
+  stats_inc(&stats_self()->locate_misses, 1);
+}
+
+void stats_cache_hit(void) {
+  stats_inc(&stats_self()->cache_hits, 1);
+}
+
+void stats_cache_filled(void) {
+  stats_inc(&stats_self()->cache_fills, 1);
+}
+
+void stats_task_ran(int stolen) {
+  stats_state *stats = stats_self();
+  stats_inc(&stats->tasks_run, 1);
+  if (stolen) stats_inc(&stats->tasks_stolen, 1);
+}
+
+void stats_task_inline(void) {
+  stats_inc(&stats_self()->tasks_inline, 1);
+}
+
+void stats_conn_opened(void) {
+  stats_state *stats = stats_self();
+  atomic_fetch_add_explicit(&stats->conns_open, 1, memory_order_relaxed);
+  stats_inc(&stats->conns_accepted, 1);
+}
+
+void stats_conn_closed(void) {
+  atomic_fetch_sub_explicit(&stats_self()->conns_open, 1,
+                            memory_order_relaxed);
+}
+
+void stats_ping_sent(void) {
+  stats_inc(&stats_self()->pings_sent, 1);
+}
+
+void stats_ping_acked(int64_t rtt_ns) {
+  stats_state *stats = stats_self();
+  stats_inc(&stats->pings_acked, 1);
+  stats_hist_record(&stats->ping_rtt_ns, rtt_ns);
+}
+
+void stats_ping_missed(void) {
+  stats_inc(&stats_self()->pings_missed, 1);
+}
+
+void stats_begin(stats_op op, int file) {
+  stats_state *stats = stats_self();
+  int64_t now = stats_now_ns();
+
+  SCOPED_MTX_LOCK(&stats->pending_lock) {
+    // a free slot, else the one we have been waiting on the longest
+    int slot = 0;
+    for (int i = 0; i < STATS_MAX_PENDING; i++) {
+      if (stats->pending[i].file == -1) {
+        slot = i;
+        break;
+      }
+      if (stats->pending[i].start_ns < stats->pending[slot].start_ns) slot = i;
+    }
+    stats->pending[slot] = (stats_pending){op, file, now};
+  }
+}
+
+void stats_end(stats_op op, int file) {
+  stats_state *stats = stats_self();
+  int64_t start = -1;
+
+  SCOPED_MTX_LOCK(&stats->pending_lock) {
+    for (int i = 0; i < STATS_MAX_PENDING; i++) {
+      stats_pending *pending = &stats->pending[i];
+      if (pending->file != file || pending->op != op) continue;
+      start = pending->start_ns;
+      pending->file = -1;
+      break;
+    }
+  }
+
+  // someone else asked for it (or we gave up remembering)
+  if (start < 0) return;
+  stats_hist_record(op == STATS_STORE ? &stats->store_ns : &stats->retrieve_ns,
+                    stats_now_ns() - start);
+}
+
+static uint64_t stats_load(_Atomic uint64_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*
+  Write the quantiles, count, sum and max of a histogram,
+  labels are the extra labels after the peer (can be empty).
+ */
+static void stats_dump_hist(FILE *out, const char *name, int peer,
+                            const char *labels, stats_hist *hist) {
+  for (size_t i = 0; i < STATS_QUANTILE_COUNT; i++) {
+    fprintf(out, "%s{peer=\"%d\"%s,quantile=\"%g\"} %llu\n", name, peer,
+            labels, stats_quantiles[i],
+            (unsigned long long)stats_hist_quantile(hist, stats_quantiles[i]));
+  }
+  fprintf(out, "%s_count{peer=\"%d\"%s} %llu\n", name, peer, labels,
+          (unsigned long long)stats_load(&hist->count));
+  fprintf(out, "%s_sum{peer=\"%d\"%s} %llu\n", name, peer, labels,
+          (unsigned long long)stats_load(&hist->sum));
+  fprintf(out, "%s_max{peer=\"%d\"%s} %llu\n", name, peer, labels,
+          (unsigned long long)stats_load(&hist->max));
+}
+
+static void stats_dump_counter(FILE *out, const char *name, int peer,
+                               uint64_t value) {
+  fprintf(out, "%s{peer=\"%d\"} %llu\n", name, peer,
+          (unsigned long long)value);
+}
+
+void stats_dump(FILE *out) {
+  stats_state *stats = stats_self();
+  int peer = get_peer();
+
+  fprintf(out, "p2p_uptime_seconds{peer=\"%d\"} %.3f\n", peer,
+          (stats_now_ns() - stats->started_ns) / 1e9);
+
+  // only the types we have actually seen
+  char labels[64];
+  for (int type = 0; type < TCP_TYPE_COUNT; type++) {
+    uint64_t handled = stats_load(&stats->handled[type]);
+    uint64_t forwarded = stats_load(&stats->forwarded[type]);
+    if (!handled && !forwarded) continue;
+
+    const char *name = proto_type_name(type);
+    snprintf(labels, sizeof(labels), ",type=\"%s\"", name ? name : "?");
+    fprintf(out, "p2p_msgs_handled_total{peer=\"%d\"%s} %llu\n", peer, labels,
+            (unsigned long long)handled);
+    fprintf(out, "p2p_msgs_forwarded_total{peer=\"%d\"%s} %llu\n", peer,
+            labels, (unsigned long long)forwarded);
+    stats_dump_hist(out, "p2p_handler_ns", peer, labels,
+                    &stats->handler_ns[type]);
+  }
+
+  stats_dump_counter(out, "p2p_files_sent_total", peer,
+                     stats_load(&stats->files_sent));
+  stats_dump_counter(out, "p2p_bytes_sent_total", peer,
+                     stats_load(&stats->bytes_sent));
+  stats_dump_counter(out, "p2p_files_received_total", peer,
+                     stats_load(&stats->files_received));
+  stats_dump_counter(out, "p2p_bytes_received_total", peer,
+                     stats_load(&stats->bytes_received));
+  stats_dump_counter(out, "p2p_segments_sent_total", peer,
+                     stats_load(&stats->segments_sent));
+  stats_dump_counter(out, "p2p_segments_received_total", peer,
+                     stats_load(&stats->segments_received));
+  stats_dump_counter(out, "p2p_checksum_failures_total", peer,
+                     stats_load(&stats->checksum_failures));
+  stats_dump_counter(out, "p2p_locate_hits_total", peer,
+                     stats_load(&stats->locate_hits));
+  stats_dump_counter(out, "p2p_locate_misses_total", peer,
+                     stats_load(&stats->locate_misses));
+  stats_dump_counter(out, "p2p_cache_hits_total", peer,
+                     stats_load(&stats->cache_hits));
+  stats_dump_counter(out, "p2p_cache_fills_total", peer,
+                     stats_load(&stats->cache_fills));
+  stats_dump_counter(out, "p2p_tasks_run_total", peer,
+                     stats_load(&stats->tasks_run));
+  stats_dump_counter(out, "p2p_tasks_stolen_total", peer,
+                     stats_load(&stats->tasks_stolen));
+  stats_dump_counter(out, "p2p_tasks_inline_total", peer,
+                     stats_load(&stats->tasks_inline));
+
+  // where our keys are at, a join is over once these settle
+  fprintf(out, "p2p_keys_stored{peer=\"%d\"} %zu\n", peer,
+          key_store_count(&p2p_node_current()->tcp.store));
+  fprintf(out, "p2p_joining{peer=\"%d\"} %d\n", peer, hash_ring_joining());
+  fprintf(out, "p2p_handoffs_open{peer=\"%d\"} %d\n", peer,
+          handoff_open_count());
+
+  fprintf(out, "p2p_conns_open{peer=\"%d\"} %lld\n", peer,
+          (long long)atomic_load_explicit(&stats->conns_open,
+                                          memory_order_relaxed));
+  stats_dump_counter(out, "p2p_conns_accepted_total", peer,
+                     stats_load(&stats->conns_accepted));
+
+  stats_dump_counter(out, "p2p_pings_sent_total", peer,
+                     stats_load(&stats->pings_sent));
+  stats_dump_counter(out, "p2p_pings_acked_total", peer,
+                     stats_load(&stats->pings_acked));
+  stats_dump_counter(out, "p2p_pings_missed_total", peer,
+                     stats_load(&stats->pings_missed));
+  stats_dump_hist(out, "p2p_ping_rtt_ns", peer, "", &stats->ping_rtt_ns);
+
+  ping_info succs[MAX_PING_FDS];
+  int count = get_ping_stats(succs);
+  for (int i = 0; i < count; i++) {
+    int succ = succs[i].port - MIN_PEER_PORT;
+    fprintf(out, "p2p_successor_pings_missed_total{peer=\"%d\","
+                 "successor=\"%d\"} %d\n", peer, succ, succs[i].missed);
+    fprintf(out, "p2p_successor_ping_rtt_ns{peer=\"%d\",successor=\"%d\"} "
+                 "%lld\n", peer, succ, (long long)succs[i].last_rtt_ns);
+  }
+
+  stats_dump_hist(out, "p2p_store_ns", peer, "", &stats->store_ns);
+  stats_dump_hist(out, "p2p_retrieve_ns", peer, "", &stats->retrieve_ns);
+}
+
+void stats_tick(void) {
+  stats_state *stats = stats_self();
+  if (!stats->path[0]) return;
+
+  // written to the side so readers never see half a dump
+  char tmp[STATS_PATH_LEN + sizeof(STATS_TMP_SUFFIX)];
+  snprintf(tmp, sizeof(tmp), "%s%s", stats->path, STATS_TMP_SUFFIX);
+
+  FILE *out = fopen(tmp, "w");
+  if (!out) {
+    perror("fopen");
+    return;
+  }
+  stats_dump(out);
+  if (fclose(out) || rename(tmp, stats->path)) {
+    perror("stats");
+    remove(tmp);
+  }
+}
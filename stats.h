@@ -0,0 +1,206 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_STATS_H__
+#define __P2P_STATS_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tcp.h"
+#include "utils.h"
+
+/**                                                    **
+ * Counters and latency histograms for a peer.          *
+ *                                                      *
+ * Everything is a relaxed atomic so recording is cheap *
+ * enough to leave on, a dump is a consistent enough    *
+ * snapshot to see where time goes.                     *
+ **                                                    **/
+
+// Histograms are log linear (like HDR histograms), every power of 2
+// is split into 2^STATS_SUB_BITS buckets so a value is off by <= 1/8.
+#define STATS_SUB_BITS (3)
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+// anything over 2^STATS_MAX_BITS ns (~18 minutes) shares the last bucket
+#define STATS_MAX_BITS (40)
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// store / retrieves we remember the start of, the oldest get replaced
+#define STATS_MAX_PENDING (64)
+
+#define STATS_PATH_LEN (256)
+
+typedef struct stats_hist_t {
+  _Atomic uint64_t buckets[STATS_BUCKETS];
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+} stats_hist;
+
+typedef enum stats_op_t {
+  STATS_STORE,
+  STATS_RETRIEVE,
+} stats_op;
+
+typedef struct stats_pending_t {
+  stats_op op;
+  // -1 if the slot is free
+  int file;
+  int64_t start_ns;
+} stats_pending;
+
+typedef struct stats_state_t {
+  int64_t started_ns;
+
+  // msgs by tcp_type
+  _Atomic uint64_t handled[TCP_TYPE_COUNT];
+  _Atomic uint64_t forwarded[TCP_TYPE_COUNT];
+  stats_hist handler_ns[TCP_TYPE_COUNT];
+
+  _Atomic uint64_t files_sent;
+  _Atomic uint64_t files_received;
+  // ranges of segmented downloads
+  _Atomic uint64_t segments_sent;
+  _Atomic uint64_t segments_received;
+  _Atomic uint64_t bytes_sent;
+  _Atomic uint64_t bytes_received;
+  // blocks that didn't match their crc
+  _Atomic uint64_t checksum_failures;
+
+  // retrieves sent straight to who last served the key / routed
+  _Atomic uint64_t locate_hits;
+  _Atomic uint64_t locate_misses;
+
+  // retrieves we served from our copy of a hot file / copies we pulled
+  _Atomic uint64_t cache_hits;
+  _Atomic uint64_t cache_fills;
+
+  // tasks the workers ran / stole from each other / the pool was too
+  // full for (so the submitter ran them)
+  _Atomic uint64_t tasks_run;
+  _Atomic uint64_t tasks_stolen;
+  _Atomic uint64_t tasks_inline;
+
+  _Atomic int64_t conns_open;
+  _Atomic uint64_t conns_accepted;
+
+  _Atomic uint64_t pings_sent;
+  _Atomic uint64_t pings_acked;
+  _Atomic uint64_t pings_missed;
+  stats_hist ping_rtt_ns;
+
+  // from asking to the owner acking (store) / the file landing (retrieve)
+  stats_hist store_ns;
+  stats_hist retrieve_ns;
+
+  stats_pending pending[STATS_MAX_PENDING];
+  pthread_mutex_t pending_lock;
+
+  // where the ticker dumps us, empty for nowhere
+  char path[STATS_PATH_LEN];
+} stats_state;
+
+static inline int64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+  Set up empty stats, path (can be NULL) is where stats_tick dumps them.
+ */
+void stats_state_init(stats_state *stats, const char *path);
+
+/*
+  Free the stats' lock.
+ */
+void stats_state_free(stats_state *stats);
+
+/*
+  Record a value (in ns) in a histogram.
+ */
+void stats_hist_record(stats_hist *hist, int64_t ns);
+
+/*
+  The value at or below which quantile (0 - 1) of the values fall.
+ */
+uint64_t stats_hist_quantile(const stats_hist *hist, double quantile);
+
+/*
+  A msg was handled (taking ns) / passed on to another peer.
+ */
+void stats_handled(tcp_type type, int64_t ns);
+void stats_forwarded(tcp_type type);
+
+/*
+  A whole file went out / came in.
+ */
+void stats_file_sent(int64_t bytes);
+void stats_file_received(int64_t bytes);
+
+/*
+  A range of a file went out / came in.
+ */
+void stats_segment_sent(int64_t bytes);
+void stats_segment_received(int64_t bytes);
+
+/*
+  A block of a file we were receiving was corrupt.
+ */
+void stats_checksum_failed(void);
+
+/*
+  A retrieve we asked for went straight to a cached holder / was routed.
+ */
+void stats_locate_hit(void);
+void stats_locate_miss(void);
+
+/*
+  We served a retrieve from our copy of a file / filled a copy.
+ */
+void stats_cache_hit(void);
+void stats_cache_filled(void);
+
+/*
+  A worker ran a task (stolen from another worker or not) / a task
+  ran on its submitter because every worker was full.
+ */
+void stats_task_ran(int stolen);
+void stats_task_inline(void);
+
+/*
+  An incoming connection was accepted / closed.
+ */
+void stats_conn_opened(void);
+void stats_conn_closed(void);
+
+/*
+  A ping went out, came back (after rtt ns) or went unanswered.
+ */
+void stats_ping_sent(void);
+void stats_ping_acked(int64_t rtt_ns);
+void stats_ping_missed(void);
+
+/*
+  We asked for a store / retrieve of file and it has now completed.
+ */
+void stats_begin(stats_op op, int file);
+void stats_end(stats_op op, int file);
+
+/*
+  Write every stat in a text format
+  (name{labels} value, one per line).
+ */
+void stats_dump(FILE *out);
+
+/*
+  Dump to our stats file if we have one (called every ping interval).
+ */
+void stats_tick(void);
+
+#endif
@@ -0,0 +1,235 @@
+#include "store_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "p2p_node.h"
+
+#define INDEX_HEADER(idx) ((store_index_header *)(idx)->map)
+#define INDEX_RECORDS(idx) \
+  ((store_index_record *)((char *)(idx)->map + sizeof(store_index_header)))
+
+/*
+  The index of the node this thread works for.
+ */
+static inline store_index_state *store_index_self(void) {
+  return &p2p_node_current()->index;
+}
+
+void store_index_state_init(store_index_state *idx) {
+  *idx = (store_index_state){.fd = -1};
+  pthread_mutex_init(&idx->lock, NULL);
+}
+
+void store_index_state_free(store_index_state *idx) {
+  pthread_mutex_destroy(&idx->lock);
+}
+
+static size_t store_index_len(uint64_t cap) {
+  return sizeof(store_index_header) + cap * sizeof(store_index_record);
+}
+
+static int store_index_push_free(store_index_state *idx, uint32_t slot) {
+  if (idx->free_count == idx->free_cap) {
+    size_t cap = idx->free_cap ? idx->free_cap * 2 : STORE_INDEX_MIN_CAP;
+    uint32_t *slots = realloc(idx->free_slots, cap * sizeof(*slots));
+    if (!slots) return -1;
+    idx->free_slots = slots;
+    idx->free_cap = cap;
+  }
+  idx->free_slots[idx->free_count++] = slot;
+  return 0;
+}
+
+int store_index_open(int peer) {
+  char path[64];
+  snprintf(path, sizeof(path), STORE_INDEX_PATH_FMT, peer);
+
+  store_index_state *idx = store_index_self();
+  SCOPED_MTX_LOCK(&idx->lock) {
+    if (idx->map) return 0;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+      close(fd);
+      return -1;
+    }
+
+    int fresh = st.st_size == 0;
+    size_t len = fresh ? store_index_len(STORE_INDEX_MIN_CAP) : st.st_size;
+    if (fresh && ftruncate(fd, len)) {
+      close(fd);
+      return -1;
+    }
+
+    void *map = len < sizeof(store_index_header) ? MAP_FAILED :
+                mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+
+    store_index_header *hdr = map;
+    if (fresh) {
+      *hdr = (store_index_header){
+        .magic = STORE_INDEX_MAGIC, .version = STORE_INDEX_VERSION,
+        .peer = peer, .cap = STORE_INDEX_MIN_CAP,
+      };
+    } else if (hdr->magic != STORE_INDEX_MAGIC ||
+               hdr->version != STORE_INDEX_VERSION || hdr->peer != peer ||
+               hdr->used > hdr->cap || store_index_len(hdr->cap) > len) {
+      fprintf(stderr, "Error: %s isn't a valid index for peer %d\n",
+              path, peer);
+      munmap(map, len);
+      close(fd);
+      return -1;
+    }
+
+    idx->fd = fd;
+    idx->map = map;
+    idx->len = len;
+
+    idx->free_count = 0;
+    store_index_record *records = INDEX_RECORDS(idx);
+    for (uint64_t i = 0; i < hdr->used; i++) {
+      if (records[i].key < 0) store_index_push_free(idx, i);
+    }
+  }
+
+  return 0;
+}
+
+void store_index_close(void) {
+  store_index_state *idx = store_index_self();
+  SCOPED_MTX_LOCK(&idx->lock) if (idx->map) {
+    msync(idx->map, idx->len, MS_SYNC);
+    munmap(idx->map, idx->len);
+    close(idx->fd);
+    idx->map = NULL;
+    idx->fd = -1;
+    idx->len = 0;
+
+    free(idx->free_slots);
+    idx->free_slots = NULL;
+    idx->free_count = idx->free_cap = 0;
+  }
+}
+
+int store_index_load(key_store *store) {
+  store_index_state *idx = store_index_self();
+  int loaded = 0;
+
+  SCOPED_MTX_LOCK(&idx->lock) if (idx->map) {
+    store_index_header *hdr = INDEX_HEADER(idx);
+    store_index_record *records = INDEX_RECORDS(idx);
+
+    for (uint64_t i = 0; i < hdr->used; i++) {
+      if (records[i].key < 0) continue;
+
+      key_entry entry = {
+        .key = records[i].key, .stored_at = records[i].stored_at, .slot = i,
+      };
+      key_entry old;
+      int ret = key_store_insert(store, &entry, &old);
+      if (ret > 0) {
+        loaded++;
+      } else if (!ret) {
+        // a key can only have one record, drop the older one
+        records[old.slot].key = KEY_STORE_EMPTY;
+        store_index_push_free(idx, old.slot);
+      }
+    }
+  }
+
+  return loaded;
+}
+
+/*
+  Double the file, the mapping may move.
+ */
+static int store_index_grow(store_index_state *idx) {
+  store_index_header *hdr = INDEX_HEADER(idx);
+  uint64_t cap = hdr->cap * 2;
+  size_t len = store_index_len(cap);
+
+  if (ftruncate(idx->fd, len)) return -1;
+  void *map = mremap(idx->map, idx->len, len, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) return -1;
+
+  idx->map = map;
+  idx->len = len;
+  INDEX_HEADER(idx)->cap = cap;
+  return 0;
+}
+
+int store_index_put(key_entry *entry) {
+  store_index_state *idx = store_index_self();
+  entry->slot = KEY_NO_SLOT;
+
+  SCOPED_MTX_LOCK(&idx->lock) if (idx->map) {
+    uint32_t slot;
+    if (idx->free_count) {
+      slot = idx->free_slots[--idx->free_count];
+    } else {
+      store_index_header *hdr = INDEX_HEADER(idx);
+      if (hdr->used >= KEY_NO_SLOT) return -1;
+      if (hdr->used == hdr->cap && store_index_grow(idx)) return -1;
+      slot = INDEX_HEADER(idx)->used++;
+    }
+
+    INDEX_RECORDS(idx)[slot] = (store_index_record){
+      .key = entry->key, .stored_at = entry->stored_at,
+    };
+    entry->slot = slot;
+  }
+
+  return entry->slot == KEY_NO_SLOT ? -1 : 0;
+}
+
+void store_index_free(uint32_t slot) {
+  store_index_state *idx = store_index_self();
+  SCOPED_MTX_LOCK(&idx->lock) {
+    if (!idx->map || slot == KEY_NO_SLOT ||
+        slot >= INDEX_HEADER(idx)->used) {
+      break;
+    }
+
+    INDEX_RECORDS(idx)[slot].key = KEY_STORE_EMPTY;
+    store_index_push_free(idx, slot);
+  }
+}
+
+void store_index_save_successors(const int *succs, int count) {
+  if (count > STORE_INDEX_SUCCS) count = STORE_INDEX_SUCCS;
+
+  store_index_state *idx = store_index_self();
+  SCOPED_MTX_LOCK(&idx->lock) if (idx->map) {
+    store_index_header *hdr = INDEX_HEADER(idx);
+    for (int i = 0; i < count; i++) hdr->succs[i] = succs[i];
+    hdr->succ_count = count;
+  }
+}
+
+int store_index_get_successors(int *succs, int max) {
+  store_index_state *idx = store_index_self();
+  int count = 0;
+
+  SCOPED_MTX_LOCK(&idx->lock) if (idx->map) {
+    store_index_header *hdr = INDEX_HEADER(idx);
+    for (; count < hdr->succ_count && count < max; count++) {
+      succs[count] = hdr->succs[count];
+    }
+  }
+
+  return count;
+}
@@ -0,0 +1,115 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_STORE_INDEX_H__
+#define __P2P_STORE_INDEX_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "key_store.h"
+#include "utils.h"
+
+/**                                                   **
+ * A memory mapped file holding every key this peer    *
+ * stores plus the last successors it knew about, so a *
+ * restarted peer can pick up exactly where it was.    *
+ **                                                   **/
+
+#define STORE_INDEX_PATH_FMT "peer_%d.idx"
+
+#define STORE_INDEX_MAGIC (0x49503250) // P2PI
+#define STORE_INDEX_VERSION (1)
+
+// records the file starts out with room for, it doubles from here
+#define STORE_INDEX_MIN_CAP (1024)
+
+// how many successors we snapshot
+#define STORE_INDEX_SUCCS (8)
+
+typedef struct store_index_header_t {
+  uint32_t magic;
+  uint32_t version;
+  int32_t peer;
+
+  // the last successors we knew about (-1 if unknown)
+  int32_t succ_count;
+  int32_t succs[STORE_INDEX_SUCCS];
+
+  // records the file has room for
+  uint64_t cap;
+  // records ever handed out, nothing past this is valid
+  uint64_t used;
+} store_index_header;
+
+typedef struct store_index_record_t {
+  // KEY_STORE_EMPTY if the record is free
+  int64_t key;
+  int64_t stored_at;
+} store_index_record;
+
+typedef struct store_index_state_t {
+  int fd;
+  void *map;
+  size_t len;
+
+  // freed records below used, handed out before we grow used
+  uint32_t *free_slots;
+  size_t free_count;
+  size_t free_cap;
+
+  pthread_mutex_t lock;
+} store_index_state;
+
+/*
+  Set up an index that isn't mapped yet.
+ */
+void store_index_state_init(store_index_state *idx);
+
+/*
+  Free the index's lock, close it first (store_index_close).
+ */
+void store_index_state_free(store_index_state *idx);
+
+/*
+  Map (creating it if needed) the index for a peer.
+  Returns -1 if it couldn't be opened or belongs to someone else.
+ */
+int store_index_open(int peer);
+
+/*
+  Flush and unmap the index.
+ */
+void store_index_close(void);
+
+/*
+  Insert every key in the index into the store.
+  Returns the number of keys loaded.
+ */
+int store_index_load(key_store *store);
+
+/*
+  Write an entry to a new record, setting its slot.
+  Returns -1 (and leaves slot as KEY_NO_SLOT) if there is no index
+  or it couldn't grow.
+ */
+int store_index_put(key_entry *entry);
+
+/*
+  Free the record behind a slot.
+ */
+void store_index_free(uint32_t slot);
+
+/*
+  Snapshot our current successors.
+ */
+void store_index_save_successors(const int *succs, int count);
+
+/*
+  Read the snapshotted successors, returns how many there are.
+ */
+int store_index_get_successors(int *succs, int max);
+
+#endif
@@ -6,41 +6,163 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <time.h>
 #include <strings.h>
 #include <unistd.h>
 
+#include "finger.h"
+#include "handoff.h"
+#include "hash_ring.h"
+#include "p2p_node.h"
 #include "p2p_peer.h"
 #include "ping.h"
+#include "proto.h"
+#include "key_store.h"
+#include "locate_cache.h"
+#include "obj_cache.h"
+#include "reactor.h"
+#include "stats.h"
+#include "store_index.h"
+#include "tcp_pool.h"
+#include "transfer.h"
 #include "utils.h"
+#include "work_pool.h"
 
 #define BUF_LEN (2048)
 
-#define TCP_MSG(x) (#x)
+#define TCP_CONN_EVENTS (EPOLLIN | EPOLLRDHUP)
 
-typedef struct file_node_t {
-  struct file_node_t *next;
-  int fileId;
-} file_node;
+// The state of an accepted connection
+typedef enum tcp_conn_state_t {
+  // waiting for a full control msg
+  CONN_READ_MSG,
 
-static file_node *head = NULL;
-static pthread_mutex_t head_lock = PTHREAD_MUTEX_INITIALIZER;
+  // streaming the body of a TCP_TRANSFER into a file
+  CONN_RECV_FILE,
+} tcp_conn_state;
 
-static void *client_accept(void *client_id);
-static int tcp_perform_send(int socket, int peer, char buf[]);
+typedef struct tcp_conn_t {
+  // has to be first so we can cast from the reactor handle
+  reactor_handle handle;
+  tcp_conn_state state;
 
-void cleanup_handler(void *arg) { 
+  // partially read msgs
+  size_t len;
+  char buf[PROTO_MAX_MSG];
+
+  // only valid in CONN_RECV_FILE
+  transfer_recv rx;
+  int file;
+  // set if rx is a copy for our object cache
+  int fill;
+  // set if rx is one segment of a download (and which download)
+  int range;
+  uint32_t download;
+  // how much of the segment the download has marked as on disk
+  int64_t marked;
+  // set if rx is one of the files of a handoff
+  int handed;
+
+  // the keys of the handoff coming in on this connection (if any)
+  handoff_rx *handoff;
+} tcp_conn;
+
+/*
+  Handles a single decoded msg.
+  Returns -1 if the connection should be closed.
+ */
+typedef int (*tcp_handler_fn)(tcp_conn *conn, const proto_msg *msg);
+
+static void tcp_listener_event(reactor_handle *handle, uint32_t events);
+static void tcp_conn_event(reactor_handle *handle, uint32_t events);
+static int tcp_dispatch(tcp_conn *conn, char *buf, size_t len);
+static int tcp_perform_send(int socket, int peer, const char *buf, size_t len);
+
+// Set on the reactor threads, anything they send goes out on a worker
+// so connecting to a slow (or dead) peer never holds a reactor up
+static _Thread_local int tcp_on_reactor;
+
+/*
+  The tcp state of the node this thread works for.
+ */
+static inline tcp_state *tcp_self(void) {
+  return &p2p_node_current()->tcp;
+}
+
+void tcp_state_init(tcp_state *tcp, int reactor_threads) {
+  key_store_init(&tcp->store);
+  tcp->reactor_threads = reactor_threads;
+  tcp->listener = (reactor_handle){.fd = -1};
+  for (int i = 0; i < TCP_MAX_DOWNLOADS; i++) {
+    tcp->downloads[i] = (transfer_download){.file = -1, .fd = -1};
+  }
+  pthread_mutex_init(&tcp->download_lock, NULL);
+}
+
+void tcp_state_free(tcp_state *tcp) {
+  for (int i = 0; i < TCP_MAX_DOWNLOADS; i++) {
+    // keep what we have, the next retrieve picks it up
+    if (tcp->downloads[i].file != -1) {
+      transfer_download_suspend(&tcp->downloads[i]);
+    }
+  }
+  pthread_mutex_destroy(&tcp->download_lock);
+  key_store_destroy(&tcp->store);
+}
+
+void cleanup_handler(void *arg) {
   int sock = (size_t)arg;
+  reactor_destroy(&tcp_self()->reactor);
   shutdown(sock, SHUT_RDWR);
   close(sock);
 }
 
-void *tcp_watcher(void *_) {
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  int on = 1;
+/*
+  Reactor helper threads work for the same node as the watcher.
+ */
+static void tcp_reactor_thread(void *node) {
+  p2p_node_enter(node);
+  tcp_on_reactor = 1;
+}
 
-  pthread_cleanup_push(cleanup_handler, (void*)(size_t)sock);
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+int tcp_open_store(int peer) {
+  if (store_index_open(peer)) {
+    fprintf(stderr, "Error: Couldn't open the store index for %d, "
+                    "stored keys won't survive a restart\n", peer);
+    return -1;
+  }
+
+  int loaded = store_index_load(&tcp_self()->store);
+  if (loaded) printf("> Restored %d stored keys\n", loaded);
+  return loaded;
+}
+
+int tcp_store_key(int64_t key) {
+  key_entry entry = {.key = key, .stored_at = time(NULL)};
+  key_entry old;
+
+  // fine if we have no index, the key just won't be persisted
+  store_index_put(&entry);
+  int ret = key_store_insert(&tcp_self()->store, &entry, &old);
+  if (ret < 0) {
+    store_index_free(entry.slot);
+  } else if (!ret && old.slot != entry.slot) {
+    store_index_free(old.slot);
+  }
+  if (ret >= 0) handoff_track(key);
+  return ret;
+}
+
+int tcp_listen(void) {
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int on = 1;
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
 
   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) {
     perror("setsockopt");
@@ -60,101 +182,1138 @@ void *tcp_watcher(void *_) {
     perror("bind");
   }
 
+  // from here on connections queue up till the reactor accepts them
   listen(sock, MAX_PENDING);
+  tcp_self()->listener.fd = sock;
+  return 0;
+}
 
-  socklen_t addr_bytes = sizeof(addr);
-  for (;;) {
-    int client_fd = accept(sock, NULL, NULL);
-    pthread_t thrd;
-    pthread_create(&thrd, NULL, client_accept, (void *)(size_t)client_fd);
+void *tcp_watcher(void *node) {
+  p2p_node_enter(node);
+  tcp_state *tcp = tcp_self();
+  int sock = tcp->listener.fd;
+
+  if (reactor_init(&tcp->reactor, tcp->reactor_threads, tcp_reactor_thread,
+                   node)) {
+    fprintf(stderr, "Error: Couldn't create the tcp reactor\n");
+    close(sock);
+    pthread_exit(NULL);
   }
 
+  pthread_cleanup_push(cleanup_handler, (void*)(size_t)sock);
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+  tcp->listener = (reactor_handle){
+    .fd = sock, .on_event = tcp_listener_event
+  };
+  if (reactor_add(&tcp->reactor, &tcp->listener, EPOLLIN)) perror("epoll_ctl");
+
+  // this thread becomes one of the reactor threads
+  tcp_on_reactor = 1;
+  reactor_run(&tcp->reactor);
+
   pthread_cleanup_pop(1);
 
   pthread_exit(NULL);
 }
 
-int tcp_send_store_req(int file, int peer_requesting, int peer) {
-  char buf[BUF_LEN];
-  snprintf(buf, BUF_LEN, "%s %d %d", TCP_MSG(TCP_STORE), file, peer_requesting);
-  return tcp_send_new_socket(peer, buf);
+static void tcp_listener_event(reactor_handle *handle, uint32_t events) {
+  reactor *r = &tcp_self()->reactor;
+
+  for (;;) {
+    int client_fd = accept4(handle->fd, NULL, NULL,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      // EAGAIN is the normal case, anything else (i.e. EMFILE) we just
+      // retry on the next wakeup rather than spinning here.
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+      break;
+    }
+
+    tcp_conn *conn = malloc(sizeof(*conn));
+    if (!conn) {
+      close(client_fd);
+      continue;
+    }
+    conn->handle = (reactor_handle){
+      .fd = client_fd, .on_event = tcp_conn_event
+    };
+    conn->state = CONN_READ_MSG;
+    conn->len = 0;
+    conn->range = 0;
+    conn->fill = 0;
+    conn->handed = 0;
+    conn->handoff = NULL;
+
+    if (reactor_add(r, &conn->handle, TCP_CONN_EVENTS)) {
+      perror("epoll_ctl");
+      close(client_fd);
+      free(conn);
+      continue;
+    }
+    stats_conn_opened();
+  }
+
+  reactor_rearm(r, handle, EPOLLIN);
 }
 
-int tcp_send_retrieve_req(int file, int peer_requesting, int peer) {
-  char buf[BUF_LEN];
-  snprintf(buf, BUF_LEN, "%s %d %d", TCP_MSG(TCP_RETRIEVE), file, peer_requesting);
-  return tcp_send_new_socket(peer, buf);
+static void tcp_download_segment(const transfer_recv *rx, int64_t marked,
+                                 uint32_t id, int ok);
+static void tcp_download_checkpoint(tcp_conn *conn);
+
+/*
+  Finish off the file we are receiving and go back to reading msgs.
+ */
+static void tcp_conn_file_done(tcp_conn *conn, int ok) {
+  conn->state = CONN_READ_MSG;
+  if (conn->rx.corrupt) {
+    fprintf(stderr, "Error: %s failed its checksum at byte %lld\n",
+            conn->rx.path, (long long)(conn->rx.offset + conn->rx.received));
+    stats_checksum_failed();
+  }
+
+  if (conn->range) {
+    conn->range = 0;
+    if (ok) {
+      ok = !transfer_recv_finish_range(&conn->rx);
+    } else {
+      transfer_recv_abort(&conn->rx);
+    }
+    tcp_download_segment(&conn->rx, conn->marked, conn->download, ok);
+    return;
+  }
+
+  if (conn->handed) {
+    conn->handed = 0;
+    if (ok && !transfer_recv_finish(&conn->rx)) {
+      stats_file_received(conn->rx.received);
+    } else {
+      fprintf(stderr, "Error: Handoff of %s failed\n", conn->rx.path);
+      transfer_recv_abort(&conn->rx);
+      // so its keys aren't taken without it
+      if (conn->handoff) conn->handoff->failed = 1;
+    }
+    return;
+  }
+
+  if (conn->fill) {
+    conn->fill = 0;
+    if (ok && !transfer_recv_finish(&conn->rx)) {
+      if (obj_cache_filled(conn->file, conn->rx.received)) {
+        unlink(conn->rx.path);
+      } else {
+        printf("> Cached %s\n", conn->rx.path);
+        stats_cache_filled();
+      }
+    } else {
+      transfer_recv_abort(&conn->rx);
+      obj_cache_fill_failed(conn->file);
+    }
+    return;
+  }
+
+  if (ok && !transfer_recv_finish(&conn->rx)) {
+    printf("> Receieved %s\n", conn->rx.path);
+    stats_file_received(conn->rx.received);
+    // a retrieve is done once the first of its files lands
+    stats_end(STATS_RETRIEVE, conn->file);
+  } else {
+    if (ok) perror("rename");
+    fprintf(stderr, "Error: Transfer of %s failed\n", conn->rx.path);
+    transfer_recv_abort(&conn->rx);
+  }
 }
 
-void tcp_transfer_send(int file, char *ext, int peer) {
-  char buf[BUF_LEN];
-  int send_socket = socket(AF_INET, SOCK_STREAM, 0);
+static void tcp_conn_close(tcp_conn *conn) {
+  // old peers that don't send a size are done once they close
+  if (conn->state == CONN_RECV_FILE) {
+    tcp_conn_file_done(conn, conn->rx.size < 0);
+  }
+  handoff_rx_abort(&conn->handoff);
+
+  reactor_remove(&tcp_self()->reactor, &conn->handle);
+  shutdown(conn->handle.fd, SHUT_RDWR);
+  close(conn->handle.fd);
+  free(conn);
+  stats_conn_closed();
+}
 
-  snprintf(buf, BUF_LEN, "%d.%s", file, ext);
+/*
+  Pulls every complete msg out of the connection buffer
+  and leaves any partial msg at the front of it.
 
-  SCOPED_FILE(f, buf, "r") {
-    if (!f) return;
+  Returns -1 if the connection should be closed.
+ */
+static int tcp_conn_process(tcp_conn *conn) {
+  char *start = conn->buf;
+  char *end = conn->buf + conn->len;
 
-    printf("> Sending %s\n", buf);
-    snprintf(buf, BUF_LEN, "%s %d %d.%s ", TCP_MSG(TCP_TRANSFER), file, file, ext);
-    tcp_perform_send(send_socket, peer, buf);
+  while (start < end) {
+    if (conn->state == CONN_RECV_FILE) {
+      size_t len = transfer_recv_want(&conn->rx, end - start);
+      if (transfer_recv_write(&conn->rx, start, len)) return -1;
+      if (transfer_recv_done(&conn->rx)) tcp_conn_file_done(conn, 1);
+      start += len;
+      continue;
+    }
 
-    while (fgets(buf, BUF_LEN, f) != NULL) {
-      tcp_perform_send(send_socket, peer, buf);
+    size_t frame_len;
+    int framed = proto_frame(start, end - start, &frame_len);
+    if (framed < 0) {
+      fprintf(stderr, "Error: Invalid msg closing connection\n");
+      return -1;
+    } else if (!framed) {
+      break;
     }
 
-    shutdown(send_socket, SHUT_RD);
-    close(send_socket);
+    if (tcp_dispatch(conn, start, frame_len) < 0) return -1;
+    start += frame_len;
+  }
+
+  conn->len = end - start;
+  memmove(conn->buf, start, conn->len);
+  return 0;
+}
+
+static void tcp_conn_event(reactor_handle *handle, uint32_t events) {
+  tcp_conn *conn = (tcp_conn *)handle;
+
+  for (;;) {
+    if (conn->state == CONN_RECV_FILE) {
+      int done = transfer_recv_socket(&conn->rx, handle->fd);
+      if (!done) {
+        if (conn->range &&
+            conn->rx.received - conn->marked >= TRANSFER_MARK_EVERY) {
+          tcp_download_checkpoint(conn);
+        }
+        break;
+      }
+      if (done < 0) {
+        tcp_conn_file_done(conn, 0);
+      } else if (conn->rx.size >= 0) {
+        tcp_conn_file_done(conn, 1);
+        continue;
+      }
+
+      // files without a size are finished off by the close
+      tcp_conn_close(conn);
+      return;
+    }
+
+    ssize_t bytes = recv(handle->fd, conn->buf + conn->len,
+                         PROTO_MAX_MSG - conn->len, 0);
+    if (bytes > 0) {
+      conn->len += bytes;
+      if (tcp_conn_process(conn) < 0) {
+        tcp_conn_close(conn);
+        return;
+      }
+    } else if (bytes < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      // old peers that don't terminate their final text msg
+      // still get it handled once they close.
+      if (bytes == 0 && conn->len && conn->len < PROTO_MAX_MSG &&
+          (uint8_t)conn->buf[0] != PROTO_MAGIC) {
+        conn->buf[conn->len++] = PROTO_TEXT_END;
+        tcp_dispatch(conn, conn->buf, conn->len);
+      }
+      tcp_conn_close(conn);
+      return;
+    }
+  }
+
+  reactor_rearm(&tcp_self()->reactor, handle, TCP_CONN_EVENTS);
+}
+
+/*
+  Encode and send a msg to a peer.
+ */
+static int tcp_send_type(int peer, tcp_type type, const int64_t *fields,
+                         int field_count, const char *str) {
+  char buf[PROTO_MAX_MSG];
+  int len = proto_encode(buf, sizeof(buf), type, 0, proto_next_req_id(),
+                         fields, field_count, str, str ? strlen(str) : 0);
+  return len < 0 ? -1 : tcp_send_msg(peer, buf, len);
+}
+
+/*
+  Encode and send a msg whose string is a key list (or NULL) to a peer.
+  A key list is binary, so it goes in the binary format even with
+  --text-protocol (every peer reads both).
+ */
+static int tcp_send_keys(int peer, tcp_type type, const int64_t *fields,
+                         int field_count, const char *keys, size_t len) {
+  char buf[PROTO_MAX_MSG];
+  int msg_len = proto_encode_fmt(buf, sizeof(buf),
+                                 keys ? PROTO_BINARY : proto_get_format(),
+                                 type, 0, proto_next_req_id(), fields,
+                                 field_count, keys, len);
+  return msg_len < 0 ? -1 : tcp_send_msg(peer, buf, msg_len);
+}
+
+/*
+  Work out the next hop for a msg about a ring position.
+  owner is set if the next hop is responsible for pos (-1 otherwise).
+ */
+static int tcp_next_hop(int pos, int *owner) {
+  int self = get_peer();
+  int succ = get_first_successor(1);
+
+  if (ring_in_range(pos, self, succ)) {
+    *owner = succ;
+    return succ;
+  }
+
+  *owner = -1;
+  int next = finger_closest_preceding(pos);
+  return next != -1 ? next : succ;
+}
+
+/*
+  Send a routed msg, if the hop was a finger that has since gone
+  away we forget it and fall back to our successor.
+  Returns the peer it was sent to or -1.
+ */
+static int tcp_send_routed(int next, tcp_type type, const int64_t *fields,
+                           int field_count, const char *keys, size_t len) {
+  if (tcp_send_keys(next, type, fields, field_count, keys, len) >= 0) {
+    return next;
+  }
+
+  int succ = get_first_successor(1);
+  if (next == succ) return -1;
+
+  finger_drop(next);
+  return tcp_send_keys(succ, type, fields, field_count, keys, len) >= 0 ?
+         succ : -1;
+}
+
+/*
+  Route a store / retrieve towards the peer owning the file,
+  if that is us we just send it to ourselves.
+ */
+static int tcp_route_key(tcp_type type, int file, int peer_requesting,
+                         int target, int flags) {
+  if (target < 0) target = hash_ring_owner(file);
+
+  int owner = get_peer();
+  int next = target == owner ? owner : tcp_next_hop(target, &owner);
+  return tcp_send_routed(
+      next, type, (int64_t[]){file, peer_requesting, owner, target, flags}, 5,
+      NULL, 0);
+}
+
+int tcp_send_store_req(int file, int peer_requesting, int target) {
+  // any copy of the old file we have is stale now
+  obj_cache_drop(file);
+  return tcp_route_key(TCP_STORE, file, peer_requesting, target, 0);
+}
+
+/*
+  The replica the fewest hops away, routes only go clockwise
+  so that is the one closest after us on the peer ring.
+ */
+static int tcp_nearest_replica(int file) {
+  int replicas[HASH_RING_MAX_REPLICAS];
+  int count = hash_ring_replicas(file, replicas, hash_ring_replica_count());
+  int self = get_peer();
+
+  int best = -1, best_dist = RING_SIZE;
+  for (int i = 0; i < count; i++) {
+    int dist = (replicas[i] - self + RING_SIZE) % RING_SIZE;
+    if (dist < best_dist) best = replicas[i], best_dist = dist;
+  }
+  return best;
+}
+
+/*
+  Send our own retrieve straight to whoever served the key last,
+  as the target (and owner) so a miss there still gets routed on.
+  Returns the peer or -1 if we have to route it.
+ */
+static int tcp_send_located(int file, int flags) {
+  int holder = locate_cache_get(file);
+  if (holder < 0 || holder == get_peer()) {
+    stats_locate_miss();
+    return -1;
+  }
+
+  int64_t fields[] = {file, get_peer(), holder, holder, flags};
+  if (tcp_send_type(holder, TCP_RETRIEVE, fields, 5, NULL) < 0) {
+    // they've gone, the ring will catch up
+    locate_cache_forget(file);
+    stats_locate_miss();
+    return -1;
+  }
+  stats_locate_hit();
+  return holder;
+}
+
+int tcp_send_retrieve_req(int file, int peer_requesting, int target,
+                          int flags) {
+  if (target < 0 && peer_requesting == get_peer()) {
+    int holder = tcp_send_located(file, flags);
+    if (holder >= 0) return holder;
+  }
+
+  if (target < 0) target = tcp_nearest_replica(file);
+  return tcp_route_key(TCP_RETRIEVE, file, peer_requesting, target, flags);
+}
+
+int tcp_send_store_ack(int file, int peer) {
+  return tcp_send_type(peer, TCP_STORE_ACK, (int64_t[]){file, get_peer()}, 2,
+                       NULL);
+}
+
+int tcp_send_replicate(int file, int peer) {
+  return tcp_send_type(peer, TCP_REPLICATE, (int64_t[]){file, get_peer()}, 2,
+                       NULL);
+}
+
+int tcp_send_members(int peer) {
+  char members[PROTO_MAX_MSG - PROTO_HEADER_LEN - PROTO_BODY_HEADER_LEN];
+  hash_ring_encode(members, sizeof(members));
+  return tcp_send_type(peer, TCP_MEMBERS, NULL, 0, members);
+}
+
+int tcp_send_find_succ(int pos, int finger) {
+  int owner;
+  int next = tcp_next_hop(pos, &owner);
+  if (owner != -1) {
+    finger_set(finger, owner);
+    return owner;
+  }
+
+  return tcp_send_routed(next, TCP_FIND_SUCC,
+                         (int64_t[]){pos, get_peer(), finger}, 3, NULL, 0);
+}
+
+/*
+  The transfer flags for the TCP_RETRIEVE flags a peer asked with.
+ */
+static int tcp_transfer_flags(int flags) {
+  return (flags & TCP_RETRIEVE_COMPRESSED ? TRANSFER_COMPRESSED : 0) |
+         (flags & TCP_RETRIEVE_CHECKSUM ? TRANSFER_CHECKSUM : 0) |
+         (flags & TCP_RETRIEVE_FILL ? TRANSFER_FILL : 0);
+}
+
+void tcp_transfer_send(int file, char *ext, int peer, int flags) {
+  char name[BUF_LEN];
+  snprintf(name, BUF_LEN, "%d.%s", file, ext);
+
+  // we don't have every extension of every file
+  struct stat st;
+  if (access(name, R_OK) || stat(name, &st)) return;
+
+  // a peer along the way wants a copy, so we can tell it when it's stale
+  if (flags & TCP_RETRIEVE_FILL) {
+    if (st.st_size > OBJ_CACHE_MAX_OBJECT) return;
+    obj_cache_watch_fill(file, peer);
+  }
+
+  // they pull it themselves, from us and the other replicas
+  if (flags & TCP_RETRIEVE_SEGMENTED && st.st_size >= TRANSFER_SEGMENT_MIN) {
+    printf("> Offering %s to Peer %d\n", name, peer);
+    int64_t fields[] = {file, st.st_size, get_peer(), flags};
+    if (tcp_send_type(peer, TCP_TRANSFER_OFFER, fields, 4, name) < 0) {
+      fprintf(stderr, "Error: Failed to offer %s to %d\n", name, peer);
+    }
+    return;
+  }
+
+  printf("> Sending %s\n", name);
+  ssize_t sent = transfer_send(peer, file, name, name,
+                               tcp_transfer_flags(flags));
+  if (sent < 0) {
+    fprintf(stderr, "Error: Failed to send %s to %d\n", name, peer);
+  } else {
+    stats_file_sent(sent);
+  }
+}
+
+/*
+  Send our copy of a file, always whole since the other
+  replicas won't have our copy to pull segments from.
+ */
+static void tcp_send_copy(int file, int peer, int flags) {
+  static const char *exts[] = {"txt", "pdf"};
+  for (int i = 0; i < 2; i++) {
+    char name[BUF_LEN], path[BUF_LEN];
+    snprintf(name, BUF_LEN, "%d.%s", file, exts[i]);
+    if (obj_cache_path(name, path, sizeof(path)) || access(path, R_OK)) {
+      continue;
+    }
+
+    printf("> Sending our copy of %s\n", name);
+    ssize_t bytes = transfer_send(peer, file, path, name,
+                                  tcp_transfer_flags(flags));
+    if (bytes >= 0) stats_file_sent(bytes);
+  }
+}
+
+typedef struct tcp_send_task_t {
+  int file;
+  int peer;
+  int flags;
+  // send our copy rather than the key we hold
+  int copy;
+} tcp_send_task;
+
+static void tcp_send_files_task(void *arg) {
+  tcp_send_task *task = arg;
+  if (task->copy) {
+    tcp_send_copy(task->file, task->peer, task->flags);
+  } else {
+    tcp_transfer_send(task->file, "txt", task->peer, task->flags);
+    tcp_transfer_send(task->file, "pdf", task->peer, task->flags);
+  }
+  free(task);
+}
+
+/*
+  Hand sending every file of a key (or our copy of it) to a worker,
+  so whoever asked doesn't wait on the transfer.
+ */
+static void tcp_send_files(int file, int peer, int flags, int copy) {
+  tcp_send_task *task = malloc(sizeof(*task));
+  if (!task) {
+    fprintf(stderr, "Error: Failed to send %d to %d\n", file, peer);
+    return;
+  }
+  *task = (tcp_send_task){
+    .file = file, .peer = peer, .flags = flags, .copy = copy,
+  };
+  work_submit(tcp_send_files_task, task);
+}
+
+/*
+  Serve a retrieve from our copy of a file.
+  Returns 1 if we have one (it is sent by a worker).
+ */
+static int tcp_send_cached(int file, int peer, int flags) {
+  if (flags & TCP_RETRIEVE_FILL || !obj_cache_has(file)) return 0;
+  tcp_send_files(file, peer, flags, 1);
+  return 1;
+}
+
+/*
+  A key we keep forwarding retrieves for, pull a copy of our own.
+ */
+static void tcp_cache_fill(int file) {
+  printf("> Retrieve %d is hot, filling a copy\n", file);
+  if (tcp_send_retrieve_req(file, get_peer(), -1,
+                            TCP_RETRIEVE_FILL | TCP_RETRIEVE_CHECKSUM) < 0) {
+    obj_cache_fill_failed(file);
+  }
+}
+
+/*
+  A key we hold was stored again, the peers with a copy from us drop it.
+ */
+static void tcp_drop_copies(int file) {
+  int cachers[OBJ_CACHE_MAX_CACHERS];
+  int count = obj_cache_take_cachers(file, cachers);
+  for (int i = 0; i < count; i++) {
+    printf("> Telling Peer %d to drop its copy of %d\n", cachers[i], file);
+    tcp_send_type(cachers[i], TCP_CACHE_DROP, (int64_t[]){file}, 1, NULL);
+  }
+}
+
+/*
+  The keys of a batch headed for one next hop.
+ */
+typedef struct tcp_batch_t {
+  int next;
+  // who accepts every key in it, -1 if each is checked
+  int owner;
+  int count;
+  int keys[TCP_BATCH_MAX_KEYS];
+} tcp_batch;
+
+/*
+  Splits the keys of a batched store / retrieve up by next hop.
+ */
+typedef struct tcp_batcher_t {
+  tcp_type type;
+  int peer_requesting;
+  int flags;
+
+  tcp_batch batches[TCP_BATCH_HOPS];
+  int hops;
+
+  // keys sent on, -1 once a batch couldn't be
+  int sent;
+} tcp_batcher;
+
+static void tcp_batcher_init(tcp_batcher *b, tcp_type type,
+                             int peer_requesting, int flags) {
+  b->type = type;
+  b->peer_requesting = peer_requesting;
+  b->flags = flags;
+  b->hops = 0;
+  b->sent = 0;
+}
+
+/*
+  Send off the keys a batch has so far (it keeps its hop).
+ */
+static void tcp_batch_flush(tcp_batcher *b, tcp_batch *batch) {
+  if (!batch->count) return;
+
+  int64_t fields[] = {b->peer_requesting, batch->owner, b->flags};
+  char keys[TCP_BATCH_MAX_KEYS * PROTO_KEY_LEN];
+  size_t len = proto_put_keys(keys, batch->keys, batch->count);
+  int next = tcp_send_routed(batch->next, b->type, fields, 3, keys, len);
+  if (next < 0) {
+    fprintf(stderr, "Error: Failed to send a batch of %d keys to %d\n",
+            batch->count, batch->next);
+    b->sent = -1;
+  } else if (b->sent >= 0) {
+    b->sent += batch->count;
+  }
+
+  batch->count = 0;
+}
+
+/*
+  Add a key to the batch for next (and owner), sending it
+  off first if the key won't fit.
+ */
+static void tcp_batch_add(tcp_batcher *b, int file, int next, int owner) {
+  tcp_batch *batch = NULL;
+  for (int i = 0; i < b->hops && !batch; i++) {
+    tcp_batch *at = &b->batches[i];
+    if (at->next == next && at->owner == owner) batch = at;
+  }
+  if (!batch) {
+    if (b->hops == TCP_BATCH_HOPS) {
+      // more hops than we track, the last one goes out early
+      batch = &b->batches[TCP_BATCH_HOPS - 1];
+      tcp_batch_flush(b, batch);
+    } else {
+      batch = &b->batches[b->hops++];
+      batch->count = 0;
+    }
+    batch->next = next;
+    batch->owner = owner;
+  }
+
+  if (batch->count == TCP_BATCH_MAX_KEYS) tcp_batch_flush(b, batch);
+  batch->keys[batch->count++] = file;
+}
+
+/*
+  Add a key to the batch for the next hop towards its owner.
+ */
+static void tcp_batch_route(tcp_batcher *b, int file) {
+  int owner;
+  int next = tcp_next_hop(hash_ring_owner(file), &owner);
+  tcp_batch_add(b, file, next, owner);
+}
+
+/*
+  Send off every batch, returns how many keys were sent or -1.
+ */
+static int tcp_batcher_flush(tcp_batcher *b) {
+  for (int i = 0; i < b->hops; i++) tcp_batch_flush(b, &b->batches[i]);
+  b->hops = 0;
+  return b->sent;
+}
+
+/*
+  Whether a key of a batch is ours to handle.
+ */
+static int tcp_batch_ours(int file, int owner) {
+  return owner == get_peer() || hash_ring_owner(file) == get_peer();
+}
+
+/*
+  Store the keys of a batch we own and pass the rest on,
+  owner is the peer that accepts every key (-1 to check each).
+  Returns how many keys were sent on or -1.
+ */
+static int tcp_store_batch(const int *files, int count, int peer_requesting,
+                           int owner, int *accepted) {
+  tcp_batcher *route = malloc(sizeof(*route) * 2);
+  if (!route) return -1;
+  tcp_batcher *copies = route + 1;
+  tcp_batcher_init(route, TCP_STORE_BATCH, peer_requesting, 0);
+  tcp_batcher_init(copies, TCP_STORE_BATCH, get_peer(),
+                   TCP_STORE_BATCH_REPLICA);
+
+  *accepted = 0;
+  int replicas[HASH_RING_MAX_REPLICAS];
+  for (int i = 0; i < count; i++) {
+    int file = files[i];
+    // any copy of the old file we have is stale now
+    obj_cache_drop(file);
+    if (!tcp_batch_ours(file, owner)) {
+      tcp_batch_route(route, file);
+      continue;
+    }
+
+    if (tcp_store_key(file) < 0) {
+      fprintf(stderr, "Error: Failed to store %d\n", file);
+    }
+    tcp_drop_copies(file);
+    (*accepted)++;
+
+    // the rest of the replicas get theirs batched straight from us
+    int replica_count = hash_ring_replicas(file, replicas,
+                                           hash_ring_replica_count());
+    for (int r = 0; r < replica_count; r++) {
+      if (replicas[r] != get_peer()) {
+        tcp_batch_add(copies, file, replicas[r], replicas[r]);
+      }
+    }
+  }
+
+  if (tcp_batcher_flush(copies) < 0) {
+    fprintf(stderr, "Error: Failed to replicate some of a store batch\n");
+  }
+  int sent = tcp_batcher_flush(route);
+  free(route);
+  return sent;
+}
+
+/*
+  Send the files of a batch we hold (or have a copy of) and pass
+  the rest on, owner is the peer that has the last say (-1 to check each).
+  Returns how many keys were sent on or -1.
+ */
+static int tcp_retrieve_batch(const int *files, int count,
+                              int peer_requesting, int owner, int flags,
+                              int *served) {
+  tcp_batcher *route = malloc(sizeof(*route));
+  if (!route) return -1;
+  tcp_batcher_init(route, TCP_RETRIEVE_BATCH, peer_requesting, flags);
+
+  *served = 0;
+  for (int i = 0; i < count; i++) {
+    int file = files[i];
+    if (key_store_lookup(&tcp_self()->store, file, NULL)) {
+      tcp_send_files(file, peer_requesting, flags, 0);
+      (*served)++;
+    } else if (tcp_send_cached(file, peer_requesting, flags)) {
+      stats_cache_hit();
+      (*served)++;
+    } else if (tcp_batch_ours(file, owner)) {
+      if (!handoff_forward(file, peer_requesting, flags)) {
+        printf("> Couldn't find file! %d\n", file);
+      }
+    } else {
+      tcp_batch_route(route, file);
+    }
+  }
+
+  int sent = tcp_batcher_flush(route);
+  free(route);
+  return sent;
+}
+
+int tcp_send_store_batch(const int *files, int count, int peer_requesting) {
+  int accepted;
+  int sent = tcp_store_batch(files, count, peer_requesting, -1, &accepted);
+  if (accepted) printf("> Store batch: %d keys accepted\n", accepted);
+  return sent;
+}
+
+int tcp_send_retrieve_batch(const int *files, int count, int peer_requesting,
+                            int flags) {
+  int served;
+  return tcp_retrieve_batch(files, count, peer_requesting, -1, flags,
+                            &served);
+}
+
+/*
+  The download saving into path (or a free slot if path is NULL).
+  Requires tcp->download_lock.
+ */
+static transfer_download *tcp_download_find(tcp_state *tcp,
+                                            const char *path) {
+  for (int i = 0; i < TCP_MAX_DOWNLOADS; i++) {
+    transfer_download *dl = &tcp->downloads[i];
+    if (path ? dl->file != -1 && !strcmp(dl->path, path) : dl->file == -1) {
+      return dl;
+    }
+  }
+  return NULL;
+}
+
+/*
+  Ask a peer for a range of a file, on its own connection so
+  every range can be sent at the same time.
+ */
+static int tcp_send_range_req(int peer, int file, const char *name,
+                              int64_t offset, int64_t len, int requester,
+                              int fallback, uint32_t id, int flags) {
+  char buf[PROTO_MAX_MSG];
+  int64_t fields[] = {file, offset, len, requester, fallback, id, flags};
+  int msg_len = proto_encode(buf, sizeof(buf), TCP_RANGE_REQ, 0,
+                             proto_next_req_id(), fields, 7, name,
+                             strlen(name));
+  return msg_len < 0 ? -1 : tcp_send_new_socket(peer, buf, msg_len);
+}
+
+/*
+  Give up on a download, i.e. none of the holders will send it.
+  What we did get is kept so asking for it again resumes.
+ */
+static void tcp_download_fail(const char *path, uint32_t id) {
+  tcp_state *tcp = tcp_self();
+  SCOPED_MTX_LOCK(&tcp->download_lock) {
+    transfer_download *dl = tcp_download_find(tcp, path);
+    if (dl && dl->id == id) {
+      transfer_download_suspend(dl);
+      dl->file = -1;
+    }
+  }
+  fprintf(stderr, "Error: Transfer of %s failed, request it again to resume\n",
+          path);
+}
+
+/*
+  Move a completed download into place.
+ */
+static void tcp_download_finish(transfer_download *dl) {
+  if (!transfer_download_finish(dl)) {
+    printf("> Receieved %s\n", dl->path);
+    // the segments already counted the bytes
+    stats_file_received(0);
+    stats_end(STATS_RETRIEVE, dl->file);
+  } else {
+    perror("rename");
+    fprintf(stderr, "Error: Transfer of %s failed\n", dl->path);
+  }
+}
+
+/*
+  Start pulling a file a holder offered us, whatever an earlier attempt
+  didn't get is split into ranges (up to TRANSFER_SEGMENTS each) spread
+  over every replica of the file.
+ */
+static int tcp_download_start(int file, const char *name, int64_t size,
+                              int holder, int flags) {
+  tcp_state *tcp = tcp_self();
+  char path[BUF_LEN];
+  snprintf(path, BUF_LEN, "received_%s", name);
+
+  transfer_range missing[TRANSFER_MAX_MISSING];
+  int missing_count = -1;
+  int64_t resumed = 0;
+  transfer_download done = {.file = -1};
+  uint32_t id = 0;
+  SCOPED_MTX_LOCK(&tcp->download_lock) {
+    // asking for the same file again picks up from what is on disk,
+    // ranges still coming for the old one are ignored
+    transfer_download *dl = tcp_download_find(tcp, path);
+    if (dl) {
+      transfer_download_suspend(dl);
+    } else {
+      dl = tcp_download_find(tcp, NULL);
+    }
+
+    if (dl) {
+      missing_count = transfer_download_begin(dl, file, name, path, size,
+                                              missing, TRANSFER_MAX_MISSING);
+      dl->id = id = ++tcp->download_ids;
+      dl->holder = holder;
+      dl->flags = flags;
+      resumed = dl->received;
+      if (missing_count < 0) {
+        dl->file = -1;
+      } else if (!missing_count) {
+        done = *dl;
+        dl->file = -1;
+      }
+    }
+  }
+  if (missing_count < 0) {
+    fprintf(stderr, "Error: Can't start the download of %s\n", path);
+    return -1;
+  }
+  if (resumed) {
+    printf("> Resuming %s with %lld of %lld bytes\n", name,
+           (long long)resumed, (long long)size);
+  }
+  if (done.file != -1) {
+    tcp_download_finish(&done);
+    return 0;
+  }
+
+  // the holder surely has it, the other replicas should
+  int sources[HASH_RING_MAX_REPLICAS + 1] = {holder};
+  int source_count = 1;
+  int replicas[HASH_RING_MAX_REPLICAS];
+  int count = hash_ring_replicas(file, replicas, hash_ring_replica_count());
+  for (int i = 0; i < count; i++) {
+    if (replicas[i] == holder || replicas[i] == get_peer()) continue;
+    sources[source_count++] = replicas[i];
+  }
+
+  int next = 0;
+  for (int m = 0; m < missing_count; m++) {
+    int64_t span = missing[m].len;
+    int64_t segments = (span + TRANSFER_SEGMENT_MIN - 1) / TRANSFER_SEGMENT_MIN;
+    if (segments > TRANSFER_SEGMENTS) segments = TRANSFER_SEGMENTS;
+    if (segments < 1) segments = 1;
+
+    for (int64_t i = 0; i < segments; i++) {
+      int64_t from = missing[m].offset + span * i / segments;
+      int64_t len = span * (i + 1) / segments - span * i / segments;
+      int peer = sources[next++ % source_count];
+
+      printf("> Requesting %s [%lld, %lld) from Peer %d\n", name,
+             (long long)from, (long long)(from + len), peer);
+      if (tcp_send_range_req(peer, file, name, from, len, get_peer(), holder,
+                             id, flags) >= 0) {
+        continue;
+      }
+      if (peer == holder || tcp_send_range_req(holder, file, name, from, len,
+                                               get_peer(), -1, id,
+                                               flags) < 0) {
+        tcp_download_fail(path, id);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+  Mark the part of a segment we haven't yet, so it survives us going down.
+  Requires tcp->download_lock.
+ */
+static void tcp_download_mark(transfer_download *dl, const transfer_recv *rx,
+                              int64_t marked) {
+  if (rx->received > marked &&
+      transfer_download_mark(dl, rx->offset + marked,
+                             rx->received - marked)) {
+    perror("fdatasync");
+  }
+}
+
+/*
+  A segment is part way through, mark what it has so far.
+ */
+static void tcp_download_checkpoint(tcp_conn *conn) {
+  tcp_state *tcp = tcp_self();
+  SCOPED_MTX_LOCK(&tcp->download_lock) {
+    transfer_download *dl = tcp_download_find(tcp, conn->rx.path);
+    if (dl && dl->id == conn->download) {
+      tcp_download_mark(dl, &conn->rx, conn->marked);
+    }
+  }
+  conn->marked = conn->rx.received;
+}
+
+/*
+  Asking the holder of a segment that came up short for the rest.
+ */
+typedef struct tcp_retry_task_t {
+  int peer;
+  int file;
+  int flags;
+  uint32_t id;
+  int64_t offset;
+  int64_t len;
+  char name[TRANSFER_PATH_LEN];
+  char path[TRANSFER_PATH_LEN];
+} tcp_retry_task;
+
+static void tcp_retry_task_run(void *arg) {
+  tcp_retry_task *task = arg;
+  printf("> Requesting %s [%lld, %lld) again from Peer %d\n", task->name,
+         (long long)task->offset, (long long)(task->offset + task->len),
+         task->peer);
+  if (tcp_send_range_req(task->peer, task->file, task->name, task->offset,
+                         task->len, get_peer(), -1, task->id,
+                         task->flags) < 0) {
+    tcp_download_fail(task->path, task->id);
+  }
+  free(task);
+}
+
+/*
+  A segment of a download finished (ok is 0 if it came up short).
+  The bytes it did get are marked so they survive us going down,
+  whatever is missing is asked for again from the holder and once
+  every byte is in the file is moved into place.
+ */
+static void tcp_download_segment(const transfer_recv *rx, int64_t marked,
+                                 uint32_t id, int ok) {
+  tcp_state *tcp = tcp_self();
+  stats_segment_received(rx->received);
+
+  transfer_download done = {.file = -1};
+  char name[TRANSFER_PATH_LEN];
+  int retry = -1, file = -1, flags = 0;
+  SCOPED_MTX_LOCK(&tcp->download_lock) {
+    transfer_download *dl = tcp_download_find(tcp, rx->path);
+    if (dl && dl->id == id) {
+      dl->received += rx->received;
+      tcp_download_mark(dl, rx, marked);
+      if (transfer_download_done(dl)) {
+        done = *dl;
+        dl->file = -1;
+      } else if (!ok && dl->retries++ < TRANSFER_RETRIES) {
+        retry = dl->holder;
+        file = dl->file;
+        flags = dl->flags;
+        strcpy(name, dl->name);
+      } else if (!ok) {
+        transfer_download_suspend(dl);
+        dl->file = -1;
+        fprintf(stderr,
+                "Error: Transfer of %s failed, request it again to resume\n",
+                rx->path);
+      }
+    }
+  }
+
+  if (done.file != -1) {
+    tcp_download_finish(&done);
+  } else if (retry != -1) {
+    tcp_retry_task *task = malloc(sizeof(*task));
+    if (!task) {
+      tcp_download_fail(rx->path, id);
+      return;
+    }
+    *task = (tcp_retry_task){
+      .peer = retry, .file = file, .flags = flags, .id = id,
+      .offset = rx->offset + rx->received, .len = rx->size - rx->received,
+    };
+    strcpy(task->name, name);
+    strcpy(task->path, rx->path);
+    // we are on a reactor thread, asking means connecting to them
+    work_submit(tcp_retry_task_run, task);
   }
 }
 
 int tcp_send_join_req(int known_peer, int self) {
-  char buf[BUF_LEN];
-  snprintf(buf, BUF_LEN, "%s %d", TCP_MSG(TCP_JOIN_REQ), self);
-  return tcp_send_new_socket(known_peer, buf);
+  int64_t fields[] = {self, hash_ring_incarnation(), hash_ring_vnodes()};
+  return tcp_send_type(known_peer, TCP_JOIN_REQ, fields, 3, NULL);
+}
+
+/*
+  Pass a join on for someone else, keeping what they told us about themselves.
+ */
+static int tcp_forward_join_req(int peer, const proto_msg *msg) {
+  return tcp_send_type(peer, TCP_JOIN_REQ, msg->fields, msg->field_count,
+                       NULL);
 }
 
-int tcp_send_abrupt(int known, int left) {
-  char buf[BUF_LEN];
+/*
+  Ask known for its successors on its own connection,
+  left is the peer we lost (-1 if we are just stabilising).
+  Returns how many it sent back or -1.
+ */
+static int tcp_request_succ(int known, int left, int *succs) {
+  char buf[PROTO_MAX_MSG];
   int send_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (send_socket < 0) return -1;
+
+  // we run on the finger / ping tickers, a peer that is hung (or gone
+  // without a RST) mustn't stall them, so give up after a ping interval
+  // (the send timeout also bounds the connect)
+  int interval = get_ping_interval();
+  struct timeval timeout = {.tv_sec = interval > 0 ? interval : 1};
+  setsockopt(send_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(send_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-  snprintf(buf, BUF_LEN, "%s %d", TCP_MSG(TCP_SUCC), left);
-  if (tcp_perform_send(send_socket, known, buf) < 0) {
+  int len = proto_encode(buf, sizeof(buf), TCP_SUCC, 0, proto_next_req_id(),
+                         (int64_t[]){get_peer(), left}, 2, NULL, 0);
+  if (tcp_perform_send(send_socket, known, buf, len) < 0) {
     shutdown(send_socket, SHUT_RD);
     close(send_socket);
     return -1;
   }
 
-  int bytes = recv(send_socket, buf, BUF_LEN, 0);
-  if (bytes == 0) return -1;
-  buf[bytes] = '\0';
-
-  READ_MSG_TYPE(0, buf, " ");
-  int first = READ_MSG_POSINT(0);
+  proto_msg msg;
+  int count = -1;
+  if (proto_recv(send_socket, buf, sizeof(buf), &msg) > 0 &&
+      msg.type == TCP_SUCC && msg.field_count >= 1) {
+    // old peers only send their first successor
+    for (count = 0; count < msg.field_count && count < MAX_SUCCESSORS;
+         count++) {
+      succs[count] = msg.fields[count];
+    }
+  }
 
   shutdown(send_socket, SHUT_RD);
   close(send_socket);
 
-  return first;
+  return count;
+}
+
+int tcp_send_abrupt(int known, int left, int *succs) {
+  return tcp_request_succ(known, left, succs);
+}
+
+int tcp_query_successors(int peer, int *succs) {
+  return tcp_request_succ(peer, -1, succs);
 }
 
 void tcp_send_quit_req(void) {
-  char buf[BUF_LEN];
   int preds[MAX_PING_FDS];
   int count = get_preds(preds);
 
+  // they replace us with our successors
+  int succs[MAX_SUCCESSORS];
+  int succ_count = get_successors(succs);
+  int64_t fields[MAX_SUCCESSORS + 1] = {get_peer()};
+  for (int i = 0; i < succ_count; i++) fields[i + 1] = succs[i];
+
   for (int i = 0; i < count; i++) {
+    if (preds[i] == get_peer()) continue;
     printf("> Sending exit msg to %d\n", preds[i]);
-    snprintf(buf, BUF_LEN, "%s %d %d %d", TCP_MSG(TCP_PEER_DEPART), get_peer(),
-             get_first_successor(0), get_second_successor(0));
-    tcp_send_new_socket(preds[i], buf);
+    tcp_send_type(preds[i], TCP_PEER_DEPART, fields, succ_count + 1, NULL);
   }
 }
 
-int tcp_send_new_socket(int peer, char buf[]) {
+static int tcp_send_now(int peer, const char *buf, size_t len) {
+  int sent = tcp_pool_send(peer, buf, len);
+  // the pool can be full of in flight sends, just go direct
+  return sent >= 0 ? sent : tcp_send_new_socket(peer, buf, len);
+}
+
+/*
+  A msg a reactor thread sent, a worker connects and sends it.
+ */
+typedef struct tcp_msg_send_task_t {
+  int peer;
+  size_t len;
+  char buf[];
+} tcp_msg_send_task;
+
+static void tcp_msg_send_task_run(void *arg) {
+  tcp_msg_send_task *task = arg;
+  if (tcp_send_now(task->peer, task->buf, task->len) < 0) {
+    fprintf(stderr, "Error: Failed to send a msg to %d\n", task->peer);
+  }
+  free(task);
+}
+
+int tcp_send_msg(int peer, const char *buf, size_t len) {
+  if (!tcp_on_reactor) return tcp_send_now(peer, buf, len);
+
+  tcp_msg_send_task *task = malloc(sizeof(*task) + len);
+  if (!task) return -1;
+  task->peer = peer;
+  task->len = len;
+  memcpy(task->buf, buf, len);
+  work_submit(tcp_msg_send_task_run, task);
+  return len;
+}
+
+int tcp_send_new_socket(int peer, const char *buf, size_t len) {
   int send_socket = socket(AF_INET, SOCK_STREAM, 0);
 
-  int sent = tcp_perform_send(send_socket, peer, buf);
+  int sent = tcp_perform_send(send_socket, peer, buf, len);
 
   shutdown(send_socket, SHUT_RD);
   close(send_socket);
@@ -162,7 +1321,35 @@ int tcp_send_new_socket(int peer, char buf[]) {
   return sent;
 }
 
-static int tcp_perform_send(int socket, int peer, char buf[]) {
+int tcp_connect(int peer) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr = {.s_addr = inet_addr(IP_ADDR)},
+      .sin_port = htons(peer + MIN_PEER_PORT),
+  };
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int tcp_send_all(int fd, const char *buf, size_t len, int flags) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t count = send(fd, buf + sent, len - sent, flags | MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) return -1;
+    sent += count;
+  }
+  return sent;
+}
+
+static int tcp_perform_send(int socket, int peer, const char *buf, size_t len) {
   struct sockaddr_in addr = {
       .sin_family = AF_INET,
       .sin_addr = {.s_addr = inet_addr(IP_ADDR)},
@@ -171,184 +1358,755 @@ static int tcp_perform_send(int socket, int peer, char buf[]) {
 
   if (connect(socket, (struct sockaddr *)&addr, sizeof(addr))) return -1;
   ssize_t count = 0;
-  count = send(socket, buf, strlen(buf), 0);
+  count = send(socket, buf, len, MSG_NOSIGNAL);
   return count >= 0 ? count : -1;
 }
 
-void *client_accept(void *arg) {
-  int client_fd = (size_t)arg;
-  char buf[BUF_LEN];
+/*
+  Reply on an already connected socket, in the format the request used.
+ */
+static int tcp_reply(tcp_conn *conn, const proto_msg *req, tcp_type type,
+                     const int64_t *fields, int field_count) {
+  char buf[PROTO_MAX_MSG];
+  int len = proto_encode_fmt(buf, sizeof(buf), req->format, type, 0,
+                             req->req_id, fields, field_count, NULL, 0);
+  // replies are tiny so a full send buffer means something is wrong
+  return len < 0 ? -1 : tcp_send_all(conn->handle.fd, buf, len, 0);
+}
 
-  for (;;) {
-    int bytes = recv(client_fd, buf, BUF_LEN, 0);
-    if (bytes == 0) break;
-    buf[bytes] = '\0';
-
-    READ_MSG_TYPE(0, buf, " ");
-
-    if (get_first_successor(0) == -1 || get_second_successor(0) == -1) {
-      // we haven't loaded our successors yet...
-      if (!strcasecmp(buf, TCP_MSG(TCP_JOIN_RESP))) {
-        int first = READ_MSG_POSINT(0);
-        int second = READ_MSG_POSINT(0);
-        clear_and_set_successors(first, second);
-        break;
-      } else {
-        fprintf(stderr,
-                "Error: Unknown type %s closing connection "
-                "(I'm awaiting initialisation)\n",
-                buf);
-        break;
-      }
-    } else if (!strcasecmp(buf, TCP_MSG(TCP_JOIN_REQ))) {
-      // peer wishing to join
-      int peer = READ_MSG_POSINT(0);
-      int first_succ = get_first_successor(1);
-      int second_succ = get_second_successor(1);
-      int third_succ = -1;
-
-      if (peer > first_succ) {
-        // pass it on...
-        printf("> Peer %d Join request forwarded to successor\n", first_succ);
-        tcp_send_join_req(first_succ, peer);
-
-        if (peer < second_succ) {
-          // they are going to become our new second_succ
-          printf("> My first successor remains unchanged at Peer %d\n",
-                 first_succ);
-          printf("> My new second successor is Peer %d\n", peer);
-          clear_and_set_successors(first_succ, peer);
-        }
-      } else {
-        printf("> Peer %d join request received\n", peer);
-        printf("> My new first successor is %d\n", peer);
-        printf("> My new second successor is %d\n", first_succ);
-        clear_and_set_successors(peer, first_succ);
-        // we are also going to then send a successor update
-        // to the peer informing them of their successors
-        sprintf(buf, "%s %d %d", TCP_MSG(TCP_JOIN_RESP), first_succ,
-                second_succ);
-        tcp_send_new_socket(peer, buf);
-      }
-    } else if (!strcasecmp(buf, TCP_MSG(TCP_PEER_DEPART))) {
-      // peer departing
-      int peer = READ_MSG_POSINT(0);
-      // swap the peer departing with one of these peers
-      int first = READ_MSG_POSINT(0);
-      int second = READ_MSG_POSINT(0);
-      int min, max;
-      if (first > second) max = first, min = second;
-      else                min = second, max = first;
-      printf("> Peer %d will depart from the network\n", peer);
-      first = get_first_successor(1);
-
-      if (peer == first) {
-        clear_and_set_successors(min, max);
-        printf("> My new first successor is %d\n", min);
-        printf("> My new second successor is %d\n", max);
-      } else if (peer == get_second_successor(1)) {
-        clear_and_set_successors(first, min);
-        printf("> My new first successor is %d\n", first);
-        printf("> My new second successor is %d\n", min);
-      } else {
-        printf("> I have no relation to this peer so I'll ignore\n");
-      }
-    } else if (!strcasecmp(buf, TCP_MSG(TCP_SUCC))) {
-      // used for abrupt depart
-      // peer wanting request
-      int peer = READ_MSG_POSINT(0);
-      // peer that was detected to have left
-      int left = READ_MSG_POSINT(0);
-      // wait for our successors to be valid
-      // (we want both successors to be valid... but we only care
-      // about using the first successor)
-      (void)get_second_successor(1);
-      int first = get_first_successor(1);
-      printf("> Peer %d left abruptly sending %d to %d as new peer\n", left,
-             first, peer);
-
-      snprintf(buf, BUF_LEN, "%s %d", TCP_MSG(TCP_SUCC), first);
-      // send back the information
-      tcp_perform_send(client_fd, peer, buf);
-    } else if (!strcasecmp(buf, TCP_MSG(TCP_STORE))) {
-      int file_id = READ_MSG_POSINT(0);
-      int peer = READ_MSG_POSINT(0);
-      int hash = PEER_HASH(file_id);
-      int first_succ = get_first_successor(1);
-      int second_succ = get_second_successor(1);
-
-      // if we are looping we want to store, or if the hash is <
-      // or if the hash is a good match.
-      if (hash == get_peer() || hash < get_peer() ||
-          first_succ < get_peer()) {
-        printf("> Store %d request accepted\n", file_id);
-        SCOPED_MTX_LOCK(&head_lock) {
-          file_node *new_head = malloc(sizeof(*new_head));
-          new_head->next = head;
-          new_head->fileId = file_id;
-          head = new_head;
-        }
-      } else {
-        // pass it on...
-        printf("> Store %d request forwarded to successor\n", file_id);
-        tcp_send_store_req(file_id, peer, first_succ);
-      }
-    } else if (!strcasecmp(buf, TCP_MSG(TCP_RETRIEVE))) {
-      int file_id = READ_MSG_POSINT(0);
-      int peer = READ_MSG_POSINT(0);
-      int hash = PEER_HASH(file_id);
-      int first_succ = get_first_successor(1);
-      int second_succ = get_second_successor(1);
-
-      // check if file is in peer
-      file_node *cur;
-      SCOPED_MTX_LOCK(&head_lock) for (cur = head; cur; cur = cur->next) {
-        if (cur->fileId == file_id) {
-          printf("> Retrieve %d request accepted\n", file_id);
-          tcp_transfer_send(file_id, "txt", peer);
-          tcp_transfer_send(file_id, "pdf", peer);
-          break;
-        }
-      }
+/*
+  Read a non negative int field, -1 if it is missing or invalid.
+ */
+static int tcp_msg_posint(const proto_msg *msg, int i) {
+  if (i >= msg->field_count) return -1;
+  int64_t val = msg->fields[i];
+  return 0 <= val && val <= INT32_MAX ? (int)val : -1;
+}
 
-      if (!cur) {
-        if (peer == get_peer()) {
-          printf("> Couldn't find file! %d\n", file_id);
-        } else {
-          printf("> Retrieve %d request forwarded to successor\n", file_id);
-          tcp_send_retrieve_req(file_id, peer, first_succ);
-        }
+/*
+  Read a non negative size / offset field, -1 if it is missing or invalid.
+ */
+static int64_t tcp_msg_size(const proto_msg *msg, int i) {
+  return i < msg->field_count && msg->fields[i] >= 0 ? msg->fields[i] : -1;
+}
+
+/*
+  Read the flags field, old peers don't send any.
+ */
+static int tcp_msg_flags(const proto_msg *msg, int i) {
+  int flags = tcp_msg_posint(msg, i);
+  return flags < 0 ? 0 : flags;
+}
+
+/*
+  Copy out the name of a file in a msg, it has to be one of the
+  extensions of file (so peers can't ask for anything else we have).
+  Returns -1 if it isn't.
+ */
+static int tcp_msg_file_name(const proto_msg *msg, int file, char *name,
+                             size_t cap) {
+  if (!msg->str || msg->str_len >= cap ||
+      memchr(msg->str, '/', msg->str_len)) {
+    return -1;
+  }
+  memcpy(name, msg->str, msg->str_len);
+  name[msg->str_len] = '\0';
+
+  char prefix[32];
+  int len = snprintf(prefix, sizeof(prefix), "%d.", file);
+  return strncmp(name, prefix, len) ? -1 : 0;
+}
+
+/*
+  Read a list of peers out of a msg starting at field from,
+  returns how many were valid (it stops at the first invalid one).
+ */
+static int tcp_msg_peers(const proto_msg *msg, int from, int *peers,
+                         int max) {
+  int count = 0;
+  for (int i = from; i < msg->field_count && count < max; i++) {
+    int peer = tcp_msg_posint(msg, i);
+    if (peer < 0) break;
+    peers[count++] = peer;
+  }
+  return count;
+}
+
+static int tcp_handle_handoff_req(tcp_conn *conn, const proto_msg *msg) {
+  int peer = tcp_msg_posint(msg, 0);
+  int incarnation = tcp_msg_posint(msg, 1);
+  int vnodes = tcp_msg_posint(msg, 2);
+  if (peer < 0 || incarnation < 0 || vnodes <= 0) return -1;
+  return handoff_start(peer, vnodes);
+}
+
+static int tcp_handle_handoff(tcp_conn *conn, const proto_msg *msg) {
+  return handoff_rx_keys(&conn->handoff, msg, tcp_msg_posint(msg, 0),
+                         tcp_msg_posint(msg, 1));
+}
+
+static int tcp_handle_handoff_done(tcp_conn *conn, const proto_msg *msg) {
+  return handoff_rx_done(&conn->handoff, tcp_msg_posint(msg, 0),
+                         tcp_msg_posint(msg, 1), tcp_msg_posint(msg, 2),
+                         tcp_msg_flags(msg, 3));
+}
+
+static int tcp_handle_handoff_ack(tcp_conn *conn, const proto_msg *msg) {
+  int peer = tcp_msg_posint(msg, 0);
+  int round = tcp_msg_posint(msg, 2);
+  if (peer < 0 || round < 0) return -1;
+  handoff_acked(peer, round);
+  return 0;
+}
+
+static int tcp_handle_join_resp(tcp_conn *conn, const proto_msg *msg) {
+  int succs[MAX_SUCCESSORS];
+  int count = tcp_msg_peers(msg, 0, succs, MAX_SUCCESSORS);
+  if (count < MIN_SUCCESSORS) return -1;
+
+  set_successors(succs, count);
+  print_successors();
+  return 0;
+}
+
+static int tcp_handle_join_req(tcp_conn *conn, const proto_msg *msg) {
+  // peer wishing to join
+  int peer = tcp_msg_posint(msg, 0);
+  if (peer < 0 || peer == get_peer()) return 0;
+
+  // msgs are only handled once we know our successors, never wait on them
+  int succs[MAX_SUCCESSORS + 1];
+  int count = get_successors(succs + 1);
+  int *ours = succs + 1;
+
+  if (ring_in_open(peer, get_peer(), ours[0])) {
+    printf("> Peer %d join request received\n", peer);
+    // they take over our successors, we put them in front of them
+    int64_t fields[MAX_SUCCESSORS];
+    for (int i = 0; i < count; i++) fields[i] = ours[i];
+    tcp_send_type(peer, TCP_JOIN_RESP, fields, count, NULL);
+
+    succs[0] = peer;
+    set_successors(succs, count + 1);
+    print_successors();
+
+    // they start off only knowing themselves, once they have our view
+    // they ask the members for their keys and only then pass themselves
+    // on around the ring (so nobody routes to them before they hold them)
+    tcp_send_members(peer);
+    return 0;
+  }
+
+  for (int i = 1; i < count; i++) {
+    if (!ring_in_open(peer, ours[i - 1], ours[i])) continue;
+
+    // that successor is going to be their predecessor
+    printf("> Peer %d Join request forwarded to Peer %d\n", peer,
+           ours[i - 1]);
+    tcp_forward_join_req(ours[i - 1], msg);
+    stats_forwarded(TCP_JOIN_REQ);
+
+    // and they slot into our list after it
+    int next[MAX_SUCCESSORS + 1];
+    for (int j = 0; j < i; j++) next[j] = ours[j];
+    next[i] = peer;
+    for (int j = i; j < count; j++) next[j + 1] = ours[j];
+    set_successors(next, count + 1);
+    print_successors();
+    return 0;
+  }
+
+  // pass it on to whoever is closest to their predecessor...
+  int next = finger_closest_preceding(peer);
+  if (next == -1 || tcp_forward_join_req(next, msg) < 0) {
+    if (next != -1) finger_drop(next);
+    next = ours[0];
+    tcp_forward_join_req(next, msg);
+  }
+  stats_forwarded(TCP_JOIN_REQ);
+  printf("> Peer %d Join request forwarded to Peer %d\n", peer, next);
+  return 0;
+}
+
+static int tcp_handle_peer_depart(tcp_conn *conn, const proto_msg *msg) {
+  // peer departing
+  int peer = tcp_msg_posint(msg, 0);
+  // and the successors that replace them
+  int theirs[MAX_SUCCESSORS];
+  int their_count = tcp_msg_peers(msg, 1, theirs, MAX_SUCCESSORS);
+  printf("> Peer %d will depart from the network\n", peer);
+  tcp_pool_drop(peer);
+  finger_drop(peer);
+  if (hash_ring_remove(peer)) tcp_send_members(get_first_successor(0));
+
+  int succs[MAX_SUCCESSORS * 2];
+  int count = get_successors(succs);
+  int at = 0;
+  while (at < count && succs[at] != peer) at++;
+
+  if (at == count) {
+    printf("> I have no relation to this peer so I'll ignore\n");
+    return 0;
+  }
+
+  // everyone before them stays, their successors fill in after
+  for (int i = 0; i < their_count; i++) succs[at + i] = theirs[i];
+  set_successors(succs, at + their_count);
+  print_successors();
+  return 0;
+}
+
+static int tcp_handle_succ(tcp_conn *conn, const proto_msg *msg) {
+  // used for abrupt depart
+  // peer wanting request
+  int peer = tcp_msg_posint(msg, 0);
+  // peer that was detected to have left
+  int left = tcp_msg_posint(msg, 1);
+  // we only get here knowing our successors (tcp_dispatch), this is
+  // answered on a reactor thread so it mustn't wait on them
+  int succs[MAX_SUCCESSORS];
+  int count = get_successors(succs);
+  // no one left if they are just stabilising
+  if (left != -1) {
+    printf("> Peer %d left abruptly sending %d to %d as new peer\n", left,
+           succs[0], peer);
+  }
+
+  // send back the information on the same connection
+  int64_t fields[MAX_SUCCESSORS];
+  for (int i = 0; i < count; i++) fields[i] = succs[i];
+  return tcp_reply(conn, msg, TCP_SUCC, fields, count) < 0 ? -1 : 0;
+}
+
+/*
+  Whether a store / retrieve was addressed to us as the owner,
+  old peers don't send an owner so they always get routed.
+ */
+static int tcp_msg_for_us(const proto_msg *msg) {
+  return tcp_msg_posint(msg, 2) == get_peer();
+}
+
+static int tcp_handle_store(tcp_conn *conn, const proto_msg *msg) {
+  int file_id = tcp_msg_posint(msg, 0);
+  int peer = tcp_msg_posint(msg, 1);
+
+  if (tcp_msg_for_us(msg)) {
+    printf("> Store %d request accepted\n", file_id);
+    if (tcp_store_key(file_id) < 0) {
+      fprintf(stderr, "Error: Failed to store %d\n", file_id);
+    }
+    tcp_drop_copies(file_id);
+
+    // so they know how long the store took end to end
+    if (peer == get_peer()) {
+      stats_end(STATS_STORE, file_id);
+    } else if (peer >= 0) {
+      tcp_send_store_ack(file_id, peer);
+    }
+
+    // the rest of the replicas get a copy straight from us
+    int replicas[HASH_RING_MAX_REPLICAS];
+    int count = hash_ring_replicas(file_id, replicas,
+                                   hash_ring_replica_count());
+    for (int i = 0; i < count; i++) {
+      if (replicas[i] == get_peer()) continue;
+      printf("> Store %d replicated to Peer %d\n", file_id, replicas[i]);
+      if (tcp_send_replicate(file_id, replicas[i]) < 0) {
+        fprintf(stderr, "Error: Failed to replicate %d to %d\n", file_id,
+                replicas[i]);
       }
-    } else if (!strcasecmp(buf, TCP_MSG(TCP_TRANSFER))) {
-      int file = READ_MSG_POSINT(0);
-      // they sending file to us
-      // read filename
-      char *filename = READ_MSG_STR(0);
-      char *cur = filename + strlen(filename) + 1;
-      // bit of weird shit here so we can finish off our buffer
-      // before we try another read.
-      size_t bytes_left = cur - buf;
-      char filebuf[BUF_LEN];
-      snprintf(filebuf, BUF_LEN, "received_%s", filename);
-      SCOPED_FILE(f, filebuf, "w") for (;;) {
-        while (bytes_left < bytes) {
-          bytes_left += fwrite(cur, 1, bytes - bytes_left, f);
-        }
+    }
+  } else {
+    // pass it on...
+    int next = tcp_send_store_req(file_id, peer, tcp_msg_posint(msg, 3));
+    stats_forwarded(TCP_STORE);
+    printf("> Store %d request forwarded to Peer %d\n", file_id, next);
+  }
+  return 0;
+}
+
+static int tcp_handle_retrieve(tcp_conn *conn, const proto_msg *msg) {
+  int file_id = tcp_msg_posint(msg, 0);
+  int peer = tcp_msg_posint(msg, 1);
 
-        bytes = recv(client_fd, buf, BUF_LEN, 0);
-        if (bytes == 0) break;
-        buf[bytes] = '\0';
-        cur = buf;
-        bytes_left = 0;
+  // check if file is in peer, the transfer happens outside of the
+  // store so retrieves of other keys never wait on it.
+  // any replica on the way can serve it.
+  int flags = tcp_msg_flags(msg, 4);
+  if (key_store_lookup(&tcp_self()->store, file_id, NULL)) {
+    printf("> Retrieve %d request accepted\n", file_id);
+    tcp_send_files(file_id, peer, flags, 0);
+  } else if (tcp_send_cached(file_id, peer, flags)) {
+    // a hot key we kept a copy of, the owner never hears of it
+    printf("> Retrieve %d request served from our copy\n", file_id);
+    stats_cache_hit();
+  } else if (tcp_msg_for_us(msg) && hash_ring_owner(file_id) != get_peer() &&
+             tcp_msg_posint(msg, 3) != hash_ring_owner(file_id) &&
+             !(flags & TCP_RETRIEVE_HOLDER)) {
+    // we are a replica that missed it, the owner is the last resort
+    int next = tcp_send_retrieve_req(file_id, peer, hash_ring_owner(file_id),
+                                     flags);
+    stats_forwarded(TCP_RETRIEVE);
+    printf("> Retrieve %d request forwarded to Peer %d\n", file_id, next);
+  } else if (tcp_msg_for_us(msg) || peer == get_peer()) {
+    if (!handoff_forward(file_id, peer, flags)) {
+      printf("> Couldn't find file! %d\n", file_id);
+    }
+  } else {
+    int next = tcp_send_retrieve_req(file_id, peer, tcp_msg_posint(msg, 3),
+                                     flags);
+    stats_forwarded(TCP_RETRIEVE);
+    printf("> Retrieve %d request forwarded to Peer %d\n", file_id, next);
+    if (!(flags & TCP_RETRIEVE_FILL) && obj_cache_forwarded(file_id)) {
+      tcp_cache_fill(file_id);
+    }
+  }
+  return 0;
+}
+
+/*
+  A batch we were sent, worked through on a worker since storing
+  (or sending) a few hundred keys takes a while.
+ */
+typedef struct tcp_batch_task_t {
+  int peer;
+  int owner;
+  int flags;
+  int count;
+  int files[];
+} tcp_batch_task;
+
+static void tcp_store_batch_task(void *arg) {
+  tcp_batch_task *task = arg;
+  if (task->flags & TCP_STORE_BATCH_REPLICA) {
+    for (int i = 0; i < task->count; i++) {
+      if (tcp_store_key(task->files[i]) < 0) {
+        fprintf(stderr, "Error: Failed to store %d\n", task->files[i]);
       }
-      printf("> Receieved %s\n", filebuf);
-    } else {
-      fprintf(stderr, "Error: Unknown type %s closing connection\n", buf);
-      break;
+      tcp_drop_copies(task->files[i]);
     }
+    printf("> Replicas of %d keys from Peer %d stored\n", task->count,
+           task->peer);
+    free(task);
+    return;
   }
 
-  shutdown(client_fd, SHUT_RD);
-  close(client_fd);
-  return NULL;
+  int accepted;
+  int sent = tcp_store_batch(task->files, task->count, task->peer,
+                             task->owner, &accepted);
+  if (sent > 0) stats_forwarded(TCP_STORE_BATCH);
+  printf("> Store batch of %d keys: %d accepted, %d forwarded\n",
+         task->count, accepted, task->count - accepted);
+  free(task);
+}
+
+static void tcp_retrieve_batch_task(void *arg) {
+  tcp_batch_task *task = arg;
+  int served;
+  int sent = tcp_retrieve_batch(task->files, task->count, task->peer,
+                                task->owner, task->flags, &served);
+  if (sent > 0) stats_forwarded(TCP_RETRIEVE_BATCH);
+  printf("> Retrieve batch of %d keys: %d sent, %d forwarded\n",
+         task->count, served, sent < 0 ? 0 : sent);
+  free(task);
+}
+
+/*
+  Read a batch msg into a task for the workers.
+  Returns NULL if it is invalid.
+ */
+static tcp_batch_task *tcp_batch_task_new(const proto_msg *msg) {
+  int max = TCP_BATCH_MAX_KEYS;
+  tcp_batch_task *task = malloc(sizeof(*task) + max * sizeof(int));
+  if (!task) return NULL;
+
+  task->peer = tcp_msg_posint(msg, 0);
+  task->owner = tcp_msg_posint(msg, 1);
+  task->flags = tcp_msg_flags(msg, 2);
+  task->count = proto_get_keys(msg, task->files, max);
+  if (task->count < 0) {
+    free(task);
+    return NULL;
+  }
+  return task;
+}
+
+static int tcp_handle_store_batch(tcp_conn *conn, const proto_msg *msg) {
+  tcp_batch_task *task = tcp_batch_task_new(msg);
+  if (!task) return -1;
+  work_submit(tcp_store_batch_task, task);
+  return 0;
+}
+
+static int tcp_handle_retrieve_batch(tcp_conn *conn, const proto_msg *msg) {
+  tcp_batch_task *task = tcp_batch_task_new(msg);
+  if (!task) return -1;
+  if (task->peer < 0) {
+    free(task);
+    return -1;
+  }
+  work_submit(tcp_retrieve_batch_task, task);
+  return 0;
+}
+
+static int tcp_handle_replicate(tcp_conn *conn, const proto_msg *msg) {
+  int file_id = tcp_msg_posint(msg, 0);
+  int owner = tcp_msg_posint(msg, 1);
+  if (file_id < 0) return -1;
+
+  printf("> Replica of %d from Peer %d stored\n", file_id, owner);
+  if (tcp_store_key(file_id) < 0) {
+    fprintf(stderr, "Error: Failed to store %d\n", file_id);
+  }
+  tcp_drop_copies(file_id);
+  return 0;
+}
+
+static int tcp_handle_store_ack(tcp_conn *conn, const proto_msg *msg) {
+  int file_id = tcp_msg_posint(msg, 0);
+  int owner = tcp_msg_posint(msg, 1);
+  if (file_id < 0) return -1;
+
+  printf("> Store %d acknowledged by Peer %d\n", file_id, owner);
+  stats_end(STATS_STORE, file_id);
+  return 0;
+}
+
+static int tcp_handle_find_succ(tcp_conn *conn, const proto_msg *msg) {
+  int pos = tcp_msg_posint(msg, 0);
+  int peer = tcp_msg_posint(msg, 1);
+  int finger = tcp_msg_posint(msg, 2);
+  if (pos < 0 || peer < 0 || finger < 0) return -1;
+
+  int owner;
+  int next = tcp_next_hop(pos, &owner);
+  if (owner != -1) {
+    tcp_send_type(peer, TCP_FIND_SUCC_RESP, (int64_t[]){finger, owner}, 2,
+                  NULL);
+  } else {
+    tcp_send_routed(next, TCP_FIND_SUCC, (int64_t[]){pos, peer, finger}, 3,
+                    NULL, 0);
+    stats_forwarded(TCP_FIND_SUCC);
+  }
+  return 0;
+}
+
+static int tcp_handle_find_succ_resp(tcp_conn *conn, const proto_msg *msg) {
+  int finger = tcp_msg_posint(msg, 0);
+  int succ = tcp_msg_posint(msg, 1);
+  if (succ >= 0) finger_set(finger, succ);
+  return 0;
+}
+
+static int tcp_handle_transfer(tcp_conn *conn, const proto_msg *msg) {
+  // they sending file to us
+  int file = tcp_msg_posint(msg, 0);
+  // old peers don't send a size
+  int64_t size = msg->field_count >= 2 ? msg->fields[1] : -1;
+  if (file < 0 || !msg->str || memchr(msg->str, '/', msg->str_len)) {
+    fprintf(stderr, "Error: Invalid transfer header\n");
+    return -1;
+  }
+
+  char path[BUF_LEN];
+  int flags = tcp_msg_flags(msg, 2);
+  if (flags & TRANSFER_HANDOFF) {
+    // a key we now hold, kept where we serve it from
+    if (!conn->handoff ||
+        tcp_msg_file_name(msg, file, path, TRANSFER_PATH_LEN)) {
+      fprintf(stderr, "Error: Unexpected handoff of %d\n", file);
+      return -1;
+    }
+  } else if (flags & TRANSFER_FILL) {
+    // a copy for our object cache rather than for us
+    char name[TRANSFER_PATH_LEN];
+    if (tcp_msg_file_name(msg, file, name, sizeof(name)) ||
+        obj_cache_path(name, path, sizeof(path))) {
+      fprintf(stderr, "Error: Unexpected copy of %d\n", file);
+      return -1;
+    }
+  } else {
+    snprintf(path, BUF_LEN, "received_%.*s", (int)msg->str_len, msg->str);
+  }
+  if (transfer_recv_begin(&conn->rx, path, size, flags)) {
+    perror("open");
+    return -1;
+  }
+  conn->file = file;
+  conn->fill = !!(flags & TRANSFER_FILL);
+  conn->handed = !!(flags & TRANSFER_HANDOFF);
+
+  // old peers don't say who they are
+  int holder = tcp_msg_posint(msg, 3);
+  if (holder >= 0) locate_cache_put(file, holder);
+
+  // the next size bytes (or the rest of the connection) is the file
+  conn->state = CONN_RECV_FILE;
+  if (transfer_recv_done(&conn->rx)) tcp_conn_file_done(conn, 1);
+  return 0;
+}
+
+static int tcp_handle_transfer_offer(tcp_conn *conn, const proto_msg *msg) {
+  int file = tcp_msg_posint(msg, 0);
+  int64_t size = tcp_msg_size(msg, 1);
+  int holder = tcp_msg_posint(msg, 2);
+  char name[TRANSFER_PATH_LEN];
+  if (file < 0 || size < 0 || holder < 0 ||
+      tcp_msg_file_name(msg, file, name, sizeof(name))) {
+    fprintf(stderr, "Error: Invalid transfer offer\n");
+    return -1;
+  }
+
+  printf("> Peer %d offered %s (%lld bytes)\n", holder, name,
+         (long long)size);
+  locate_cache_put(file, holder);
+  tcp_download_start(file, name, size, holder, tcp_msg_flags(msg, 3));
+  return 0;
+}
+
+typedef struct tcp_range_task_t {
+  int file;
+  int64_t offset;
+  int64_t len;
+  int peer;
+  int fallback;
+  uint32_t id;
+  int flags;
+  // send it ourselves, otherwise just pass it to the fallback
+  int ours;
+  char name[TRANSFER_PATH_LEN];
+} tcp_range_task;
+
+static void tcp_range_task_run(void *arg) {
+  tcp_range_task *task = arg;
+  if (task->ours) {
+    printf("> Sending %s [%lld, %lld) to Peer %d\n", task->name,
+           (long long)task->offset, (long long)(task->offset + task->len),
+           task->peer);
+    ssize_t sent = transfer_send_range(task->peer, task->file, task->name,
+                                       task->offset, task->len, task->id,
+                                       tcp_transfer_flags(task->flags));
+    if (sent >= 0) {
+      stats_segment_sent(sent);
+      free(task);
+      return;
+    }
+    fprintf(stderr, "Error: Failed to send %s to %d\n", task->name,
+            task->peer);
+  }
+
+  // we don't have it (or have a different copy), the holder does
+  if (task->fallback >= 0 && task->fallback != get_peer()) {
+    printf("> Range of %s forwarded to Peer %d\n", task->name,
+           task->fallback);
+    tcp_send_range_req(task->fallback, task->file, task->name, task->offset,
+                       task->len, task->peer, -1, task->id, task->flags);
+    stats_forwarded(TCP_RANGE_REQ);
+  }
+  free(task);
+}
+
+static int tcp_handle_range_req(tcp_conn *conn, const proto_msg *msg) {
+  int file = tcp_msg_posint(msg, 0);
+  int64_t offset = tcp_msg_size(msg, 1);
+  int64_t len = tcp_msg_size(msg, 2);
+  int peer = tcp_msg_posint(msg, 3);
+  int fallback = tcp_msg_posint(msg, 4);
+  int64_t id = tcp_msg_size(msg, 5);
+  int flags = tcp_msg_flags(msg, 6);
+  tcp_range_task *task = malloc(sizeof(*task));
+  if (!task) return -1;
+  *task = (tcp_range_task){
+    .file = file, .offset = offset, .len = len, .peer = peer,
+    .fallback = fallback, .id = id, .flags = flags,
+  };
+  if (file < 0 || offset < 0 || len < 0 || peer < 0 || id < 0 ||
+      tcp_msg_file_name(msg, file, task->name, sizeof(task->name))) {
+    fprintf(stderr, "Error: Invalid range request\n");
+    free(task);
+    return -1;
+  }
+
+  // every range of a download is asked for at once, the workers
+  // send them side by side
+  task->ours = key_store_lookup(&tcp_self()->store, file, NULL);
+  if (!task->ours && (fallback < 0 || fallback == get_peer())) {
+    free(task);
+    return 0;
+  }
+  work_submit(tcp_range_task_run, task);
+  return 0;
+}
+
+static int tcp_handle_transfer_range(tcp_conn *conn, const proto_msg *msg) {
+  int file = tcp_msg_posint(msg, 0);
+  int64_t size = tcp_msg_size(msg, 1);
+  int64_t offset = tcp_msg_size(msg, 2);
+  int64_t len = tcp_msg_size(msg, 3);
+  int64_t id = tcp_msg_size(msg, 4);
+  char name[TRANSFER_PATH_LEN];
+  if (file < 0 || size < 0 || offset < 0 || len < 0 || id < 0 ||
+      tcp_msg_file_name(msg, file, name, sizeof(name))) {
+    fprintf(stderr, "Error: Invalid transfer header\n");
+    return -1;
+  }
+
+  char path[BUF_LEN];
+  snprintf(path, BUF_LEN, "received_%s", name);
+
+  tcp_state *tcp = tcp_self();
+  int err = -1;
+  SCOPED_MTX_LOCK(&tcp->download_lock) {
+    transfer_download *dl = tcp_download_find(tcp, path);
+    if (dl && dl->id == id && dl->size == size) {
+      err = transfer_recv_begin_range(&conn->rx, dl, offset, len,
+                                      tcp_msg_flags(msg, 5));
+    }
+  }
+  if (err) {
+    // one we gave up on (or asked for again)
+    fprintf(stderr, "Error: Unexpected range of %s\n", name);
+    return -1;
+  }
+
+  // the next len bytes are our part of the file
+  conn->state = CONN_RECV_FILE;
+  conn->file = file;
+  conn->range = 1;
+  conn->download = id;
+  conn->marked = 0;
+  if (transfer_recv_done(&conn->rx)) tcp_conn_file_done(conn, 1);
+  return 0;
+}
+
+static int tcp_handle_members(tcp_conn *conn, const proto_msg *msg) {
+  if (!msg->str) return -1;
+
+  // pass changes on straight away, once everyone has them it stops
+  if (hash_ring_merge(msg->str, msg->str_len)) {
+    printf("> Hash ring now has %d live peers\n", hash_ring_live_count());
+    tcp_send_members(get_first_successor(0));
+    // peers we handed keys to may have just taken them over
+    handoff_release();
+  }
+  if (hash_ring_joining()) handoff_ask();
+  return 0;
+}
+
+static int tcp_handle_cache_drop(tcp_conn *conn, const proto_msg *msg) {
+  int file_id = tcp_msg_posint(msg, 0);
+  if (file_id < 0) return -1;
+
+  printf("> Dropping our copy of %d, it was stored again\n", file_id);
+  obj_cache_drop(file_id);
+  return 0;
+}
+
+static const tcp_handler_fn tcp_handlers[] = {
+  [TCP_JOIN_REQ] = tcp_handle_join_req,
+  [TCP_PEER_DEPART] = tcp_handle_peer_depart,
+  [TCP_SUCC] = tcp_handle_succ,
+  [TCP_RETRIEVE] = tcp_handle_retrieve,
+  [TCP_STORE] = tcp_handle_store,
+  [TCP_TRANSFER] = tcp_handle_transfer,
+  [TCP_FIND_SUCC] = tcp_handle_find_succ,
+  [TCP_FIND_SUCC_RESP] = tcp_handle_find_succ_resp,
+  [TCP_MEMBERS] = tcp_handle_members,
+  [TCP_REPLICATE] = tcp_handle_replicate,
+  [TCP_STORE_ACK] = tcp_handle_store_ack,
+  [TCP_TRANSFER_OFFER] = tcp_handle_transfer_offer,
+  [TCP_RANGE_REQ] = tcp_handle_range_req,
+  [TCP_TRANSFER_RANGE] = tcp_handle_transfer_range,
+  [TCP_CACHE_DROP] = tcp_handle_cache_drop,
+  [TCP_STORE_BATCH] = tcp_handle_store_batch,
+  [TCP_RETRIEVE_BATCH] = tcp_handle_retrieve_batch,
+  [TCP_HANDOFF_REQ] = tcp_handle_handoff_req,
+  [TCP_HANDOFF] = tcp_handle_handoff,
+  [TCP_HANDOFF_DONE] = tcp_handle_handoff_done,
+  [TCP_HANDOFF_ACK] = tcp_handle_handoff_ack,
+};
+
+/*
+  Msgs whose handlers route or send on (so connect to peers, and may
+  wait on a slow one), a worker handles them rather than the reactor
+  thread.  The rest only touch our own state or the connection they
+  came in on, or already hand the slow part to a worker.
+ */
+static const uint8_t tcp_on_worker[] = {
+  [TCP_JOIN_REQ] = 1,
+  [TCP_PEER_DEPART] = 1,
+  [TCP_RETRIEVE] = 1,
+  [TCP_STORE] = 1,
+  [TCP_FIND_SUCC] = 1,
+  [TCP_MEMBERS] = 1,
+  [TCP_REPLICATE] = 1,
+  [TCP_TRANSFER_OFFER] = 1,
+  [TCP_HANDOFF_ACK] = 1,
+};
+
+static int tcp_run_handler(tcp_handler_fn handler, tcp_conn *conn,
+                           const proto_msg *msg) {
+  int64_t start = stats_now_ns();
+  int ret = handler(conn, msg);
+  stats_handled(msg->type, stats_now_ns() - start);
+  return ret;
+}
+
+/*
+  A msg handled on a worker, with its own copy of the string.
+ */
+typedef struct tcp_msg_task_t {
+  tcp_handler_fn handler;
+  proto_msg msg;
+  char str[];
+} tcp_msg_task;
+
+static void tcp_msg_task_run(void *arg) {
+  tcp_msg_task *task = arg;
+  // there is no connection left to close, so all we can do is say
+  if (tcp_run_handler(task->handler, NULL, &task->msg) < 0) {
+    fprintf(stderr, "Error: Invalid %s\n",
+            proto_type_name(task->msg.type));
+  }
+  free(task);
+}
+
+static int tcp_dispatch(tcp_conn *conn, char *buf, size_t len) {
+  proto_msg msg;
+  if (proto_decode(buf, len, &msg)) return -1;
+
+  const char *name = proto_type_name(msg.type);
+  tcp_handler_fn handler = NULL;
+  if (get_first_successor(0) == -1 || get_second_successor(0) == -1) {
+    // we haven't loaded our successors yet...
+    if (msg.type != TCP_JOIN_RESP) {
+      fprintf(stderr,
+              "Error: Unknown type %s closing connection "
+              "(I'm awaiting initialisation)\n",
+              name);
+      return -1;
+    }
+    handler = tcp_handle_join_resp;
+  } else if (msg.type < sizeof(tcp_handlers) / sizeof(*tcp_handlers)) {
+    handler = tcp_handlers[msg.type];
+  }
+
+  if (!handler) {
+    fprintf(stderr, "Error: Unknown type %s closing connection\n", name);
+    return -1;
+  }
+
+  if (msg.type < sizeof(tcp_on_worker) && tcp_on_worker[msg.type]) {
+    tcp_msg_task *task = malloc(sizeof(*task) + msg.str_len);
+    if (!task) return -1;
+    task->handler = handler;
+    task->msg = msg;
+    if (msg.str) {
+      memcpy(task->str, msg.str, msg.str_len);
+      task->msg.str = task->str;
+    }
+    work_submit(tcp_msg_task_run, task);
+    return 0;
+  }
+  return tcp_run_handler(handler, conn, &msg);
 }
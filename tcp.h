@@ -5,6 +5,12 @@
 #ifndef __P2P_TCP_H__
 #define __P2P_TCP_H__
 
+#include <pthread.h>
+#include <time.h>
+
+#include "key_store.h"
+#include "reactor.h"
+#include "transfer.h"
 #include "utils.h"
 
 /**              **
@@ -13,47 +19,221 @@
 
 #define IP_ADDR ("127.0.0.1")
 
-#define MAX_PENDING (3)
+// The accept backlog, the kernel will clamp this to somaxconn
+#define MAX_PENDING (4096)
+
+// The number of threads that drive every tcp connection
+#define TCP_REACTOR_THREADS (4)
+
+// Segmented downloads we can have going at once
+#define TCP_MAX_DOWNLOADS (16)
+
+// The flags of a TCP_RETRIEVE
+// the requester can pull large files in segments
+#define TCP_RETRIEVE_SEGMENTED (1 << 0)
+// the requester wants the files compressed on the wire
+#define TCP_RETRIEVE_COMPRESSED (1 << 1)
+// the requester wants every block of the files checksummed
+#define TCP_RETRIEVE_CHECKSUM (1 << 2)
+// the requester is a peer along the way filling its object cache,
+// only the peers holding the key answer it
+#define TCP_RETRIEVE_FILL (1 << 3)
+// the new owner of the key asking the peer that held it before it
+// joined, a miss there is final
+#define TCP_RETRIEVE_HOLDER (1 << 4)
+
+// The most keys a batched store / retrieve (or a TCP_HANDOFF) carries,
+// its key list is 4 bytes a key so always goes as a binary msg
+#define TCP_BATCH_MAX_KEYS (768)
+// Next hops a batch is split over at once, past that they go out early
+#define TCP_BATCH_HOPS (16)
+
+// The flags of a TCP_STORE_BATCH
+// the keys are copies from their owner, every one is just stored
+#define TCP_STORE_BATCH_REPLICA (1 << 0)
 
 // The type of a tcp connection
 typedef enum tcp_type_t {
   // Client attemping to join network
-  // data: int peer
+  // data: int peer, int incarnation, int vnodes
   TCP_JOIN_REQ,
 
   // Response to client attempting to join
   // contains their successors
-  // data: int first, second
+  // data: int first, second, ...
   TCP_JOIN_RESP,
 
   // Peer departing network
-  // data: int peer, first, second
+  // data: int peer, first, second, ...
   TCP_PEER_DEPART,
 
   // Abrupt departure peer wants list of successors
+  // (peer_left is -1 when we are just stabilising)
   // data: int peer, peer_left;
+  // reply: int first, second, ...
   TCP_SUCC,
 
   // Attempt to retrieve a file upon finding peer it'll initialise
   // a TCP_TRANSFER (of type SEND) and send the file across.
-  // data: int file, int peer_requesting
+  // target is the peer the hash ring says owns the file, owner is
+  // set by the hop before it (-1 if it hasn't been reached yet).
+  // Large files are offered (TCP_TRANSFER_OFFER) instead if the
+  // requester set TCP_RETRIEVE_SEGMENTED (old peers send no flags).
+  // data: int file, int peer_requesting, int owner, int target, int flags
   TCP_RETRIEVE,
 
   // Attempt to store a file upon finding peer it'll initialise
   // a TCP_TRANSFER (of type REQUEST) and read the file in.
-  // data: int file, int peer_requesting
+  // target is the peer the hash ring says owns the file, owner is
+  // set by the hop before it (-1 if it hasn't been reached yet).
+  // data: int file, int peer_requesting, int owner, int target,
+  //       int flags (there are none yet)
   TCP_STORE,
 
   // Perform a transfer given the correct type will send
-  // data: int file_id
-  // Will prefix the file with a NULL terminated file name.
+  // (holder is who sent it, so the requester can ask them next time)
+  // data: int file_id, int size, int flags, int holder, str file_name
+  // The size bytes of the file itself follow the msg (as blocks
+  // if flags has either of TRANSFER_BLOCKS, i.e. TRANSFER_COMPRESSED
+  // or TRANSFER_CHECKSUM).
   TCP_TRANSFER,
+
+  // Find the peer responsible for a ring position (for finger i),
+  // routed through fingers till it reaches the position's predecessor.
+  // data: int pos, int peer_requesting, int finger
+  TCP_FIND_SUCC,
+
+  // Answer to a TCP_FIND_SUCC sent straight back to the requester.
+  // data: int finger, int succ
+  TCP_FIND_SUCC_RESP,
+
+  // Gossip of the hash ring members
+  // data: str members ("[+-]peer:incarnation:vnodes,...")
+  TCP_MEMBERS,
+
+  // The owner handing an accepted store to the other replicas
+  // data: int file, int owner
+  TCP_REPLICATE,
+
+  // The owner telling the requester their store has been accepted
+  // data: int file, int owner
+  TCP_STORE_ACK,
+
+  // A holder telling the requester how big a file is so it can
+  // pull it in segments from every replica, flags are the retrieve's.
+  // data: int file, int size, int holder, int flags, str file_name
+  TCP_TRANSFER_OFFER,
+
+  // Ask for a range of a file, sent on a connection of its own so
+  // the ranges are sent in parallel.  A replica without the file
+  // passes it on to fallback (the holder that offered it).
+  // data: int file, int offset, int len, int peer_requesting,
+  //       int fallback, int download, int flags, str file_name
+  TCP_RANGE_REQ,
+
+  // A range of a file for one of the requester's downloads,
+  // the len bytes follow the msg.
+  // data: int file, int size, int offset, int len, int download,
+  //       int flags, str file_name
+  TCP_TRANSFER_RANGE,
+
+  // A holder telling a peer that filled a copy of a file from it
+  // that the file has been stored again (so the copy is stale).
+  // data: int file
+  TCP_CACHE_DROP,
+
+  // Many stores at once, each peer accepts the keys it owns and passes
+  // the rest on as one batch per next hop.  owner is the peer that
+  // accepts every key in it (-1 if each is checked against the ring).
+  // The owners don't ack batched keys, only the replicas hear of them.
+  // data: int peer_requesting, int owner, int flags, key list
+  TCP_STORE_BATCH,
+
+  // Many retrieves at once, each peer sends the files it holds (as
+  // their own TCP_TRANSFER / TCP_TRANSFER_OFFER) and passes the rest
+  // on like a TCP_STORE_BATCH, flags are TCP_RETRIEVE flags.
+  // data: int peer_requesting, int owner, int flags, key list
+  TCP_RETRIEVE_BATCH,
+
+  // A joining peer asking a member to hand it the keys it will hold
+  // once it is in the ring (it isn't in anyone's view yet).  handoff.h
+  // has how the handoff msgs fit together.
+  // data: int peer, int incarnation, int vnodes
+  TCP_HANDOFF_REQ,
+
+  // The keys of a round of a handoff, on a connection of its own that
+  // then carries every file of them (TCP_TRANSFER with TRANSFER_HANDOFF)
+  // and ends in a TCP_HANDOFF_DONE.  total is every key of the round,
+  // a msg only carries as many as fit.
+  // data: int holder, int total, key list
+  TCP_HANDOFF,
+
+  // Every key and file of a round of a handoff has been sent, count is
+  // how many keys.  flags are HANDOFF_* flags.
+  // data: int holder, int count, int round, int flags
+  TCP_HANDOFF_DONE,
+
+  // The joining peer has stored a round of a handoff, the holder drops
+  // the keys it no longer holds once every round has landed and the
+  // peer is in its view.
+  // data: int peer, int count, int round
+  TCP_HANDOFF_ACK,
+
+  // not a msg, just how many types there are
+  TCP_TYPE_COUNT,
 } tcp_type;
 
+typedef struct tcp_state_t {
+  // the keys this peer holds
+  key_store store;
+
+  reactor reactor;
+  int reactor_threads;
+  reactor_handle listener;
+
+  // segmented downloads in progress (file is -1 for a free slot)
+  transfer_download downloads[TCP_MAX_DOWNLOADS];
+  uint32_t download_ids;
+  pthread_mutex_t download_lock;
+
+} tcp_state;
+
+/*
+  Set up the tcp state of a peer, its reactor runs on reactor_threads.
+*/
+void tcp_state_init(tcp_state *tcp, int reactor_threads);
+
+/*
+  Free the tcp state (the key store and any unfinished downloads).
+*/
+void tcp_state_free(tcp_state *tcp);
+
+/*
+  Set up the key store, restoring any keys from the peer's index.
+  Returns the number of keys restored or -1 if there is no index.
+*/
+int tcp_open_store(int peer);
+
 /*
-  Watch for new connections
+  Bind and listen on the node's port, before anyone is told of us (a
+  reply to our join can beat the watcher thread up).  Returns -1 if we
+  couldn't.
 */
-void *tcp_watcher(void *_ UNUSED_ATTR);
+int tcp_listen(void);
+
+/*
+  Watch for new connections to a node, runs the tcp reactor (on the
+  socket tcp_listen set up).
+  Every connection is non blocking and driven by a small
+  state machine rather than getting its own thread.
+*/
+void *tcp_watcher(void *node);
+
+/*
+  Store a key we now hold (and its record in the index).
+  Returns what key_store_insert does.
+*/
+int tcp_store_key(int64_t key);
 
 /*
   Send a join request using a known peer.
@@ -61,9 +241,26 @@ void *tcp_watcher(void *_ UNUSED_ATTR);
 int tcp_send_join_req(int known_peer, int self);
 
 /*
-  Send a join request using a known peer.
+  Open a new connection to a peer, returns the fd or -1.
 */
-int tcp_send_new_socket(int peer, char buf[]);
+int tcp_connect(int peer);
+
+/*
+  Send all of buf on a connected socket, returns bytes sent or -1.
+*/
+int tcp_send_all(int fd, const char *buf, size_t len, int flags);
+
+/*
+  Send a msg to a peer, reusing a pooled connection if we have one.
+  On a reactor thread a worker sends it, so it only fails if we can't
+  hand it over.
+*/
+int tcp_send_msg(int peer, const char *buf, size_t len);
+
+/*
+  Send a msg to a peer on a brand new connection.
+*/
+int tcp_send_new_socket(int peer, const char *buf, size_t len);
 
 /*
   Send a quit request.
@@ -72,22 +269,68 @@ void tcp_send_quit_req(void);
 
 /*
   Send detected abrupt request asking for new successors.
+  Returns how many successors it sent back or -1.
+*/
+int tcp_send_abrupt(int known, int left, int *succs);
+
+/*
+  Ask a peer for its successors.
+  Returns how many it sent back or -1 if it didn't answer.
+*/
+int tcp_query_successors(int peer, int *succs);
+
+/*
+  Look up the peer responsible for a ring position to fill in a finger.
 */
-int tcp_send_abrupt(int known, int left);
+int tcp_send_find_succ(int pos, int finger);
+
+/*
+  Gossip our view of the hash ring to a peer.
+*/
+int tcp_send_members(int peer);
 
 /*
   Send a retrieve / request 'request' asking for all files with id given.
+  target is the replica to read from (-1 for the nearest one, or if we
+  are the one asking whoever last served it to us),
+  flags are TCP_RETRIEVE_* flags.
+  Returns the peer it was routed to or -1.
 */
-int tcp_send_retrieve_req(int file, int peer_requesting, int peer);
+int tcp_send_retrieve_req(int file, int peer_requesting, int target,
+                          int flags);
+
+/*
+  Tell the peer that asked for a store that we (the owner) accepted it.
+*/
+int tcp_send_store_ack(int file, int peer);
+
+/*
+  Hand a stored file to one of its other replicas.
+*/
+int tcp_send_replicate(int file, int peer);
 
 /*
   Send a store 'request' asking to store a given file.
+  target is the owner on the hash ring (-1 to look it up).
+  Returns the peer it was routed to or -1.
+*/
+int tcp_send_store_req(int file, int peer_requesting, int target);
+
+/*
+  Store / retrieve many files at once, the keys we own are handled
+  here and the rest are sent on in batches (one per next hop).
+  flags are TCP_RETRIEVE flags.
+  Returns how many keys were sent on or -1 if any batch couldn't be.
 */
-int tcp_send_store_req(int file, int peer_requesting, int peer);
+int tcp_send_store_batch(const int *files, int count, int peer_requesting);
+int tcp_send_retrieve_batch(const int *files, int count, int peer_requesting,
+                            int flags);
 
 /*
-  Send a file with a specific extension to a peer.
+  Send a file with a specific extension to a peer,
+  or offer it to them if it is large and they can pull segments.
+  flags are the TCP_RETRIEVE flags they asked with.
 */
-void tcp_transfer_send(int file, char *ext, int peer);
+void tcp_transfer_send(int file, char *ext, int peer, int flags);
 
 #endif
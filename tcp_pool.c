@@ -0,0 +1,173 @@
+#include "tcp_pool.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "p2p_node.h"
+#include "p2p_peer.h"
+#include "ping.h"
+#include "tcp.h"
+
+/*
+  The pool of the node this thread works for.
+ */
+static inline tcp_pool_state *tcp_pool_self(void) {
+  return &p2p_node_current()->pool;
+}
+
+void tcp_pool_state_init(tcp_pool_state *pool) {
+  pthread_mutex_init(&pool->lock, NULL);
+  for (int i = 0; i < TCP_POOL_SIZE; i++) {
+    pool->conns[i] = (tcp_pool_conn){.peer = -1, .fd = -1};
+    pthread_mutex_init(&pool->conns[i].lock, NULL);
+  }
+}
+
+void tcp_pool_state_free(tcp_pool_state *pool) {
+  for (int i = 0; i < TCP_POOL_SIZE; i++) {
+    pthread_mutex_destroy(&pool->conns[i].lock);
+  }
+  pthread_mutex_destroy(&pool->lock);
+}
+
+static void tcp_pool_close(tcp_pool_conn *conn) {
+  if (conn->fd != -1) {
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+  }
+  conn->fd = -1;
+}
+
+/*
+  Find (or claim) the slot for a peer, returns it with its lock held.
+  Returns NULL if every slot is currently busy sending.
+ */
+static tcp_pool_conn *tcp_pool_acquire(tcp_pool_state *pool, int peer) {
+  tcp_pool_conn *conns = pool->conns;
+
+  for (;;) {
+    tcp_pool_conn *found = NULL;
+    int owned = 0;
+
+    SCOPED_MTX_LOCK(&pool->lock) {
+      tcp_pool_conn *lru = NULL;
+      for (int i = 0; i < TCP_POOL_SIZE && !found; i++) {
+        if (conns[i].peer == peer) found = &conns[i];
+      }
+
+      if (!found) {
+        // claim a free slot or evict the least recently used one
+        // that isn't in the middle of a send.
+        for (int i = 0; i < TCP_POOL_SIZE; i++) {
+          if (pthread_mutex_trylock(&conns[i].lock)) continue;
+          if (conns[i].peer == -1) {
+            if (lru) pthread_mutex_unlock(&lru->lock);
+            lru = &conns[i];
+            break;
+          } else if (!lru || conns[i].last_used < lru->last_used) {
+            if (lru) pthread_mutex_unlock(&lru->lock);
+            lru = &conns[i];
+          } else {
+            pthread_mutex_unlock(&conns[i].lock);
+          }
+        }
+
+        if (lru) {
+          tcp_pool_close(lru);
+          lru->peer = peer;
+          found = lru;
+          owned = 1;
+        }
+      }
+    }
+
+    if (!found) return NULL;
+    if (owned) return found;
+
+    pthread_mutex_lock(&found->lock);
+    // it could have been evicted whilst we waited
+    if (found->peer == peer) return found;
+    pthread_mutex_unlock(&found->lock);
+  }
+}
+
+/*
+  A pooled connection is only ever written to, so if it is readable
+  the other side has closed it (or is talking nonsense).
+ */
+static int tcp_pool_healthy(tcp_pool_conn *conn) {
+  if (conn->fd == -1) return 0;
+  if (time(NULL) - conn->last_used > TCP_POOL_IDLE_SECS) return 0;
+
+  char c;
+  ssize_t bytes = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int tcp_pool_connect(int peer) {
+  int fd = tcp_connect(peer);
+  if (fd < 0) return -1;
+
+  // control msgs are tiny, we don't want them held back by nagle
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  return fd;
+}
+
+int tcp_pool_send(int peer, const char *buf, size_t len) {
+  tcp_pool_state *pool = tcp_pool_self();
+  tcp_pool_conn *conn = tcp_pool_acquire(pool, peer);
+  if (!conn) return -1;
+
+  int sent = -1;
+  // a node stopping mid send mustn't leave the slot locked
+  pthread_cleanup_push((cleanup_handle_fn)pthread_mutex_unlock, &conn->lock);
+
+  // at most one reconnect, a dead peer should fail fast
+  for (int attempt = 0; attempt < 2 && sent < 0; attempt++) {
+    if (!tcp_pool_healthy(conn)) {
+      tcp_pool_close(conn);
+      conn->fd = tcp_pool_connect(peer);
+      if (conn->fd == -1) break;
+    }
+
+    sent = tcp_send_all(conn->fd, buf, len, 0);
+    if (sent < 0) tcp_pool_close(conn);
+  }
+
+  conn->last_used = time(NULL);
+  if (conn->fd == -1) {
+    // give the slot back rather than caching a dead peer
+    SCOPED_MTX_LOCK(&pool->lock) conn->peer = -1;
+  }
+  pthread_cleanup_pop(1);
+  return sent;
+}
+
+void tcp_pool_drop(int peer) {
+  tcp_pool_state *pool = tcp_pool_self();
+
+  for (int i = 0; i < TCP_POOL_SIZE; i++) {
+    tcp_pool_conn *conn = &pool->conns[i];
+    SCOPED_MTX_LOCK(&conn->lock) if (conn->peer == peer) {
+      tcp_pool_close(conn);
+      SCOPED_MTX_LOCK(&pool->lock) conn->peer = -1;
+    }
+  }
+}
+
+void tcp_pool_destroy(void) {
+  tcp_pool_state *pool = tcp_pool_self();
+
+  for (int i = 0; i < TCP_POOL_SIZE; i++) {
+    tcp_pool_conn *conn = &pool->conns[i];
+    SCOPED_MTX_LOCK(&conn->lock) {
+      tcp_pool_close(conn);
+      SCOPED_MTX_LOCK(&pool->lock) conn->peer = -1;
+    }
+  }
+}
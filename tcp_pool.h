@@ -0,0 +1,75 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_TCP_POOL_H__
+#define __P2P_TCP_POOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "utils.h"
+
+/**                                                **
+ * A pool of long lived connections to other peers  *
+ * so control msgs don't pay for a handshake each.  *
+ **                                                **/
+
+// The maximum number of peers we keep a connection open to
+#define TCP_POOL_SIZE (32)
+
+// Connections idle for longer than this are reopened before use
+// since the other side may have quietly dropped them.
+#define TCP_POOL_IDLE_SECS (60)
+
+typedef struct tcp_pool_conn_t {
+  // -1 if the slot is free
+  int peer;
+
+  // -1 if we need to (re)connect
+  int fd;
+
+  // used for lru eviction and idle checks
+  time_t last_used;
+
+  // held for the whole duration of a send
+  pthread_mutex_t lock;
+} tcp_pool_conn;
+
+typedef struct tcp_pool_state_t {
+  tcp_pool_conn conns[TCP_POOL_SIZE];
+
+  // guards which peer every slot belongs to
+  pthread_mutex_t lock;
+} tcp_pool_state;
+
+/*
+  Set up an empty pool.
+ */
+void tcp_pool_state_init(tcp_pool_state *pool);
+
+/*
+  Free the pool's locks, close the connections first (tcp_pool_destroy).
+ */
+void tcp_pool_state_free(tcp_pool_state *pool);
+
+/*
+  Send a msg to a peer over a pooled connection.
+  Reconnects once if the pooled connection turns out to be dead.
+
+  Returns bytes sent or -1.
+ */
+int tcp_pool_send(int peer, const char *buf, size_t len);
+
+/*
+  Drop any pooled connection to the peer (i.e. it left the network).
+ */
+void tcp_pool_drop(int peer);
+
+/*
+  Close every pooled connection.
+ */
+void tcp_pool_destroy(void);
+
+#endif
@@ -0,0 +1,984 @@
+#include "transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "lz.h"
+#include "p2p_peer.h"
+#include "proto.h"
+#include "tcp.h"
+#include "uring.h"
+
+/*
+  The slow path, only if sendfile refuses the file.
+ */
+static int transfer_send_copy(int sock, int fd, off_t offset, off_t end) {
+  char *buf = malloc(TRANSFER_COPY_BUF);
+  if (!buf) return -1;
+
+  int err = 0;
+  while (offset < end && !err) {
+    size_t want = end - offset < TRANSFER_COPY_BUF ?
+                  (size_t)(end - offset) : TRANSFER_COPY_BUF;
+    ssize_t bytes = pread(fd, buf, want, offset);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0 || tcp_send_all(sock, buf, bytes, 0) < 0) err = -1;
+    else offset += bytes;
+  }
+
+  free(buf);
+  return err;
+}
+
+/*
+  Push bytes offset up to end of fd down the socket.
+ */
+static int transfer_send_body(int sock, int fd, off_t offset, off_t end) {
+  while (offset < end) {
+    size_t want = end - offset < TRANSFER_CHUNK ?
+                  (size_t)(end - offset) : TRANSFER_CHUNK;
+    ssize_t sent = sendfile(sock, fd, &offset, want);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      return transfer_send_copy(sock, fd, offset, end);
+    }
+    // 0 means the file shrank underneath us
+    if (sent <= 0) return -1;
+  }
+  return 0;
+}
+
+static void transfer_put32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+static uint32_t transfer_get32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void transfer_block_hdr(unsigned char *hdr, uint32_t raw,
+                               uint32_t enc, uint32_t crc) {
+  transfer_put32(hdr, raw);
+  transfer_put32(hdr + 4, enc);
+  transfer_put32(hdr + 8, crc);
+}
+
+/*
+  Read len bytes of fd from offset into buf, -1 if we can't.
+ */
+static int transfer_pread(int fd, char *buf, size_t len, off_t offset) {
+  while (len) {
+    ssize_t bytes = pread(fd, buf, len, offset);
+    if (bytes < 0 && errno == EINTR) continue;
+    // 0 means the file shrank underneath us
+    if (bytes <= 0) return -1;
+    buf += bytes;
+    len -= bytes;
+    offset += bytes;
+  }
+  return 0;
+}
+
+/*
+  Carry crc on over len bytes of fd from offset.  They are mapped
+  (already in the page cache) rather than copied out, buf is only
+  for when the file can't be mapped.
+ */
+static int transfer_crc_file(int fd, char *buf, size_t cap, off_t offset,
+                             size_t len, uint32_t *crc) {
+  off_t start = offset & ~(off_t)(TRANSFER_ALIGN - 1);
+  size_t map_len = len + (offset - start);
+  char *map = len ? mmap(NULL, map_len, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                         fd, start) : MAP_FAILED;
+  if (map != MAP_FAILED) {
+    *crc = crc32c(*crc, map + (offset - start), len);
+    munmap(map, map_len);
+    return 0;
+  }
+
+  for (size_t at = 0; at < len;) {
+    size_t want = len - at < cap ? len - at : cap;
+    if (transfer_pread(fd, buf, want, offset + at)) return -1;
+    *crc = crc32c(*crc, buf, want);
+    at += want;
+  }
+  return 0;
+}
+
+/*
+  Send len bytes of fd from offset as a block as it is, the bytes
+  are only looked at for the crc, sendfile still moves them.
+ */
+static int transfer_send_stored(int sock, int fd, char *buf, off_t offset,
+                                size_t len) {
+  uint32_t crc = 0;
+  if (transfer_crc_file(fd, buf, TRANSFER_LZ_BLOCK, offset, len, &crc)) {
+    return -1;
+  }
+
+  unsigned char hdr[TRANSFER_BLOCK_HDR];
+  transfer_block_hdr(hdr, len, len, crc);
+  if (tcp_send_all(sock, (char *)hdr, sizeof(hdr), MSG_MORE) < 0) return -1;
+  return transfer_send_body(sock, fd, offset, offset + len);
+}
+
+/*
+  Send the rest of the file as blocks as it is, straight
+  from the page cache.
+ */
+static int transfer_send_as_is(int sock, int fd, char *buf, off_t offset,
+                               off_t end) {
+  while (offset < end) {
+    size_t want = end - offset < TRANSFER_CRC_CHUNK ?
+                  (size_t)(end - offset) : TRANSFER_CRC_CHUNK;
+    if (transfer_send_stored(sock, fd, buf, offset, want)) return -1;
+    offset += want;
+  }
+  return 0;
+}
+
+/*
+  Fill in the header of a block of len raw bytes at out (the block
+  follows it), compressed if that shrinks it.
+  Returns the compressed len or 0 if it is sent as is.
+ */
+static size_t transfer_encode_block(const char *raw, size_t len, char *out) {
+  uint32_t crc = crc32c(0, raw, len);
+  size_t enc = lz_compress(raw, len, out + TRANSFER_BLOCK_HDR, len - 1);
+  transfer_block_hdr((unsigned char *)out, len, enc ? enc : len, crc);
+  return enc;
+}
+
+/*
+  Push bytes offset up to end of fd down the socket as blocks,
+  compressing the ones that shrink if flags has TRANSFER_COMPRESSED.
+ */
+static int transfer_send_blocks(int sock, int fd, off_t offset, off_t end,
+                                int flags) {
+  char *raw = malloc(TRANSFER_LZ_BLOCK);
+  char *out = malloc(TRANSFER_BLOCK_HDR + TRANSFER_LZ_BLOCK);
+  int err = !raw || !out;
+
+  int misses = flags & TRANSFER_COMPRESSED ? 0 : TRANSFER_LZ_GIVE_UP;
+  while (offset < end && !err) {
+    if (misses >= TRANSFER_LZ_GIVE_UP) {
+      // it doesn't compress, sendfile the rest as it is
+      err = transfer_send_as_is(sock, fd, raw, offset, end);
+      break;
+    }
+
+    size_t want = end - offset < TRANSFER_LZ_BLOCK ?
+                  (size_t)(end - offset) : TRANSFER_LZ_BLOCK;
+    if (transfer_pread(fd, raw, want, offset)) {
+      err = -1;
+      continue;
+    }
+
+    // only worth it if it actually shrinks
+    size_t enc = transfer_encode_block(raw, want, out);
+    if (enc) {
+      misses = 0;
+      err = tcp_send_all(sock, out, TRANSFER_BLOCK_HDR + enc, MSG_MORE) < 0;
+    } else {
+      misses++;
+      err = tcp_send_all(sock, out, TRANSFER_BLOCK_HDR, MSG_MORE) < 0 ||
+            tcp_send_all(sock, raw, want, MSG_MORE) < 0;
+    }
+    offset += want;
+  }
+
+  free(raw);
+  free(out);
+  return err ? -1 : 0;
+}
+
+_Static_assert(TRANSFER_BLOCK_HDR + TRANSFER_LZ_BLOCK <= URING_BUF_LEN,
+               "a block has to fit in a registered buffer");
+
+// what a ring op of a block slot was (user_data is op | slot)
+#define TRANSFER_URING_READ (1 << 8)
+#define TRANSFER_URING_SEND (2 << 8)
+
+/*
+  One of the two blocks in flight through the ring, raw is read
+  into while the other slot's block is encoded and sent from out.
+ */
+typedef struct transfer_uring_slot_t {
+  char *raw;
+  char *out;
+
+  off_t read_at;
+  size_t read_len;
+  size_t read_got;
+  int reading;
+
+  size_t send_len;
+  size_t sent;
+  int sending;
+} transfer_uring_slot;
+
+/*
+  Queue (the rest of) a slot's read / send, the fds are the ring's
+  fixed files, 0 the socket and 1 the file.
+ */
+static int transfer_uring_queue(uring *ring, transfer_uring_slot *slots,
+                                int s, int op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe) return -1;
+
+  transfer_uring_slot *slot = &slots[s];
+  if (op == TRANSFER_URING_READ) {
+    uring_prep_read_fixed(sqe, 1, slot->raw + slot->read_got,
+                          slot->read_len - slot->read_got,
+                          slot->read_at + slot->read_got, s, op | s);
+    slot->reading = 1;
+  } else {
+    uring_prep_send(sqe, 0, slot->out + slot->sent,
+                    slot->send_len - slot->sent, MSG_MORE | MSG_NOSIGNAL,
+                    op | s);
+    slot->sending = 1;
+  }
+  return 0;
+}
+
+/*
+  uring_submit, but a full completion queue isn't a failure, what is
+  queued goes with the next submit once the completions are taken.
+ */
+static int transfer_uring_submit(uring *ring, unsigned wait) {
+  if (!uring_submit(ring, wait)) return 0;
+  return errno == EAGAIN || errno == EBUSY ? 0 : -1;
+}
+
+/*
+  Submit what is queued, wait for something to complete and take
+  every completion, short reads / sends are queued again.
+ */
+static int transfer_uring_reap(uring *ring, transfer_uring_slot *slots) {
+  if (transfer_uring_submit(ring, 1)) return -1;
+
+  int err = 0;
+  struct io_uring_cqe cqe;
+  while (uring_peek(ring, &cqe)) {
+    int s = cqe.user_data & 1;
+    transfer_uring_slot *slot = &slots[s];
+    int op = cqe.user_data & ~(uint64_t)0xff;
+    if (op == TRANSFER_URING_READ) {
+      slot->reading = 0;
+      // 0 means the file shrank underneath us
+      if (cqe.res <= 0) {
+        err = -1;
+        continue;
+      }
+      slot->read_got += cqe.res;
+      if (slot->read_got < slot->read_len) {
+        err |= transfer_uring_queue(ring, slots, s, op);
+      }
+    } else {
+      slot->sending = 0;
+      if (cqe.res <= 0) {
+        err = -1;
+        continue;
+      }
+      slot->sent += cqe.res;
+      if (slot->sent < slot->send_len) {
+        err |= transfer_uring_queue(ring, slots, s, op);
+      }
+    }
+  }
+  return err;
+}
+
+/*
+  transfer_send_blocks through io_uring, the next block is read into
+  a registered buffer while this one is encoded and the last one is
+  still going out, so each block costs a single io_uring_enter
+  (its send and the read after it) rather than a pread and a send or two.
+ */
+static int transfer_send_blocks_uring(uring *ring, int sock, int fd,
+                                      off_t offset, off_t end) {
+  if (uring_set_files(ring, (int[]){sock, fd}, URING_FILES)) {
+    return transfer_send_blocks(sock, fd, offset, end, TRANSFER_COMPRESSED);
+  }
+
+  transfer_uring_slot slots[2];
+  for (int s = 0; s < 2; s++) {
+    slots[s] = (transfer_uring_slot){
+      .raw = uring_buf(ring, s), .out = uring_buf(ring, 2 + s),
+    };
+  }
+
+  int err = 0;
+  off_t next_read = offset;
+  for (int s = 0; s < 2 && next_read < end && !err; s++) {
+    slots[s].read_at = next_read;
+    slots[s].read_len = end - next_read < TRANSFER_LZ_BLOCK ?
+                        (size_t)(end - next_read) : TRANSFER_LZ_BLOCK;
+    next_read += slots[s].read_len;
+    err = transfer_uring_queue(ring, slots, s, TRANSFER_URING_READ);
+  }
+
+  int misses = 0;
+  for (int block = 0; offset < end && !err; block++) {
+    transfer_uring_slot *slot = &slots[block & 1];
+    transfer_uring_slot *other = &slots[~block & 1];
+    while (!err && (slot->reading || slot->sending)) {
+      err = transfer_uring_reap(ring, slots);
+    }
+    // it doesn't compress, the rest goes as is below
+    if (err || misses >= TRANSFER_LZ_GIVE_UP) break;
+
+    size_t want = slot->read_len;
+    size_t enc = transfer_encode_block(slot->raw, want, slot->out);
+    if (enc) {
+      misses = 0;
+    } else {
+      misses++;
+      memcpy(slot->out + TRANSFER_BLOCK_HDR, slot->raw, want);
+    }
+
+    // sends on the same socket could go out of order, one at a time
+    while (!err && other->sending) err = transfer_uring_reap(ring, slots);
+    if (err) break;
+
+    slot->send_len = TRANSFER_BLOCK_HDR + (enc ? enc : want);
+    slot->sent = 0;
+    err = transfer_uring_queue(ring, slots, block & 1, TRANSFER_URING_SEND);
+    offset += want;
+
+    if (!err && next_read < end) {
+      slot->read_at = next_read;
+      slot->read_len = end - next_read < TRANSFER_LZ_BLOCK ?
+                       (size_t)(end - next_read) : TRANSFER_LZ_BLOCK;
+      slot->read_got = 0;
+      next_read += slot->read_len;
+      err = transfer_uring_queue(ring, slots, block & 1, TRANSFER_URING_READ);
+    }
+    if (!err) err = transfer_uring_submit(ring, 0);
+  }
+
+  // every send has to land before the rest goes out, and nothing
+  // can still be using the buffers / files once we return
+  while (!err && (slots[0].reading || slots[0].sending ||
+                  slots[1].reading || slots[1].sending)) {
+    err = transfer_uring_reap(ring, slots);
+  }
+  // after an error what is still queued / in flight is only waited out
+  struct io_uring_cqe cqe;
+  while (slots[0].reading || slots[0].sending || slots[1].reading ||
+         slots[1].sending) {
+    if (transfer_uring_submit(ring, 1)) {
+      // we can't tell when they land, so the ring goes (cancelling
+      // them) rather than the files / buffers being handed out again
+      uring_thread_drop();
+      return -1;
+    }
+    while (uring_peek(ring, &cqe)) {
+      transfer_uring_slot *done = &slots[cqe.user_data & 1];
+      if (cqe.user_data & TRANSFER_URING_READ) done->reading = 0;
+      else done->sending = 0;
+    }
+  }
+  uring_set_files(ring, (int[]){-1, -1}, URING_FILES);
+
+  if (!err && offset < end) {
+    err = transfer_send_as_is(sock, fd, slots[0].raw, offset, end);
+  }
+  return err ? -1 : 0;
+}
+
+/*
+  Open a regular file to send, returns the fd or -1.
+ */
+static int transfer_open(const char *path, off_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  *size = st.st_size;
+  return fd;
+}
+
+/*
+  Send a transfer header and then len bytes of fd from offset on sock.
+ */
+static int transfer_push_on(int sock, int fd, const char *hdr, int hdr_len,
+                            off_t offset, off_t len, int flags) {
+  if (hdr_len < 0) return -1;
+  posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+
+  // MSG_MORE lets the header go out in the same segment as the file
+  int err = tcp_send_all(sock, hdr, hdr_len, MSG_MORE) < 0;
+  uring *ring = flags & TRANSFER_COMPRESSED ? uring_thread() : NULL;
+  if (!err && ring) {
+    err = transfer_send_blocks_uring(ring, sock, fd, offset, offset + len);
+  } else if (!err && flags & TRANSFER_BLOCKS) {
+    err = transfer_send_blocks(sock, fd, offset, offset + len, flags);
+  } else if (!err) {
+    err = transfer_send_body(sock, fd, offset, offset + len);
+  }
+  return err ? -1 : 0;
+}
+
+/*
+  Send a transfer header and then len bytes of fd from offset
+  on a connection of its own.
+ */
+static int transfer_push(int peer, int fd, const char *hdr, int hdr_len,
+                         off_t offset, off_t len, int flags) {
+  if (hdr_len < 0) return -1;
+
+  int sock = tcp_connect(peer);
+  if (sock < 0) return -1;
+
+  int err = transfer_push_on(sock, fd, hdr, hdr_len, offset, len, flags);
+
+  shutdown(sock, SHUT_WR);
+  close(sock);
+  return err;
+}
+
+/*
+  The TCP_TRANSFER header of a whole file.
+ */
+static int transfer_header(char *buf, size_t cap, int file, off_t size,
+                           const char *name, int flags) {
+  return proto_encode(buf, cap, TCP_TRANSFER, 0, proto_next_req_id(),
+                      (int64_t[]){file, size, flags, get_peer()}, 4, name,
+                      strlen(name));
+}
+
+ssize_t transfer_send(int peer, int file, const char *path, const char *name,
+                      int flags) {
+  off_t size;
+  int fd = transfer_open(path, &size);
+  if (fd < 0) return -1;
+
+  char buf[PROTO_MAX_MSG];
+  int len = transfer_header(buf, sizeof(buf), file, size, name, flags);
+  int err = transfer_push(peer, fd, buf, len, 0, size, flags);
+
+  close(fd);
+  return err ? -1 : size;
+}
+
+ssize_t transfer_send_on(int sock, int file, const char *path,
+                         const char *name, int flags) {
+  off_t size;
+  int fd = transfer_open(path, &size);
+  if (fd < 0) return -1;
+
+  char buf[PROTO_MAX_MSG];
+  int len = transfer_header(buf, sizeof(buf), file, size, name, flags);
+  int err = transfer_push_on(sock, fd, buf, len, 0, size, flags);
+
+  close(fd);
+  return err ? -1 : size;
+}
+
+ssize_t transfer_send_range(int peer, int file, const char *path,
+                            int64_t offset, int64_t len, uint32_t id,
+                            int flags) {
+  off_t size;
+  int fd = transfer_open(path, &size);
+  if (fd < 0) return -1;
+
+  // they have a different copy of the file to us
+  if (offset < 0 || len < 0 || offset + len > size) {
+    close(fd);
+    errno = ERANGE;
+    return -1;
+  }
+
+  char buf[PROTO_MAX_MSG];
+  int hdr_len = proto_encode(buf, sizeof(buf), TCP_TRANSFER_RANGE, 0,
+                             proto_next_req_id(),
+                             (int64_t[]){file, size, offset, len, id, flags},
+                             6, path, strlen(path));
+  int err = transfer_push(peer, fd, buf, hdr_len, offset, len, flags);
+
+  close(fd);
+  return err ? -1 : len;
+}
+
+static void transfer_recv_release(transfer_recv *rx) {
+  if (rx->pipe[0] != -1) close(rx->pipe[0]);
+  if (rx->pipe[1] != -1) close(rx->pipe[1]);
+  rx->pipe[0] = rx->pipe[1] = -1;
+  free(rx->buf);
+  rx->buf = NULL;
+  free(rx->zbuf);
+  rx->zbuf = NULL;
+  if (rx->fd != -1) close(rx->fd);
+  rx->fd = -1;
+}
+
+/*
+  Open the temporary file for path, preallocated to size.
+ */
+static int transfer_open_tmp(const char *path, char *tmp_path, size_t cap,
+                             int64_t size) {
+  snprintf(tmp_path, cap, "%s%s", path, TRANSFER_TMP_SUFFIX);
+
+  // read too, spliced blocks are read back for their crc
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+
+  // reserve the whole file up front so it is laid out contiguously,
+  // filesystems that can't do this just get the normal behaviour.
+  if (size > 0) fallocate(fd, 0, 0, size);
+  return fd;
+}
+
+/*
+  Set up how the file comes off the socket, files in blocks read
+  their headers (and compressed blocks) a block at a time and only
+  splice the blocks sent as is.
+ */
+static int transfer_recv_mode(transfer_recv *rx, int flags) {
+  if (flags & TRANSFER_BLOCKS) {
+    rx->blocks = 1;
+    rx->zbuf = malloc(2 * TRANSFER_LZ_BLOCK);
+    if (rx->size < 0 || !rx->zbuf ||
+        posix_memalign((void **)&rx->buf, TRANSFER_ALIGN, TRANSFER_RECV_BUF)) {
+      transfer_recv_abort(rx);
+      return -1;
+    }
+  }
+
+  if (!pipe2(rx->pipe, O_CLOEXEC | O_NONBLOCK)) {
+    fcntl(rx->pipe[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+  } else {
+    rx->pipe[0] = rx->pipe[1] = -1;
+  }
+  return 0;
+}
+
+int transfer_recv_begin(transfer_recv *rx, const char *path, int64_t size,
+                        int flags) {
+  *rx = (transfer_recv){.fd = -1, .size = size, .pipe = {-1, -1}};
+  if (strlen(path) >= TRANSFER_PATH_LEN) return -1;
+
+  strcpy(rx->path, path);
+  rx->fd = transfer_open_tmp(path, rx->tmp_path, sizeof(rx->tmp_path), size);
+  if (rx->fd < 0) return -1;
+
+  return transfer_recv_mode(rx, flags);
+}
+
+int transfer_recv_begin_range(transfer_recv *rx, const transfer_download *dl,
+                              int64_t offset, int64_t len, int flags) {
+  *rx = (transfer_recv){
+    .fd = -1, .offset = offset, .size = len, .pipe = {-1, -1}
+  };
+  if (offset < 0 || len < 0 || offset + len > dl->size) return -1;
+
+  // the download owns the temporary file, we just write into our part
+  strcpy(rx->path, dl->path);
+  rx->fd = fcntl(dl->fd, F_DUPFD_CLOEXEC, 0);
+  if (rx->fd < 0) return -1;
+
+  return transfer_recv_mode(rx, flags);
+}
+
+size_t transfer_recv_want(const transfer_recv *rx, size_t cap) {
+  if (rx->size < 0) return cap;
+
+  uint64_t left = rx->size - rx->received;
+  if (rx->blocks && left) {
+    // the rest of the block's header or the block itself
+    left = rx->block_have < TRANSFER_BLOCK_HDR ?
+           TRANSFER_BLOCK_HDR - rx->block_have :
+           TRANSFER_BLOCK_HDR + rx->block_enc - rx->block_have;
+  }
+  return left < cap ? (size_t)left : cap;
+}
+
+int transfer_recv_done(const transfer_recv *rx) {
+  return rx->size >= 0 && rx->received == rx->size;
+}
+
+/*
+  Write len bytes at (the receive's) offset at, received is left alone.
+ */
+static int transfer_recv_pwrite(transfer_recv *rx, const char *buf,
+                                size_t len, int64_t at) {
+  while (len) {
+    ssize_t bytes = pwrite(rx->fd, buf, len, rx->offset + at);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    buf += bytes;
+    len -= bytes;
+    at += bytes;
+  }
+  return 0;
+}
+
+/*
+  Decompress a whole block and write it out.
+ */
+static int transfer_recv_inflate(transfer_recv *rx, const char *block) {
+  char *out = rx->zbuf + TRANSFER_LZ_BLOCK;
+  long raw = lz_decompress(block, rx->block_enc, out, rx->block_raw);
+  if (raw != rx->block_raw) return -1;
+
+  rx->block_sum = crc32c(0, out, raw);
+  return transfer_recv_pwrite(rx, out, raw, rx->received);
+}
+
+/*
+  We have len more bytes of the current block, once it is all here
+  it only counts if it is what they sent.
+ */
+static int transfer_recv_block_advance(transfer_recv *rx, size_t len) {
+  rx->block_have += len;
+  if (rx->block_have < TRANSFER_BLOCK_HDR + rx->block_enc) return 0;
+
+  // blocks sent as is are mostly spliced so we never saw them,
+  // check the whole block in the page cache in one go (zbuf is free,
+  // buf may still hold the bytes after this block)
+  if (rx->block_raw == rx->block_enc &&
+      transfer_crc_file(rx->fd, rx->zbuf, 2 * TRANSFER_LZ_BLOCK,
+                        rx->offset + rx->received, rx->block_raw,
+                        &rx->block_sum)) {
+    return -1;
+  }
+  if (rx->block_sum != rx->block_crc) {
+    rx->corrupt = 1;
+    return -1;
+  }
+  rx->received += rx->block_raw;
+  rx->block_have = 0;
+  return 0;
+}
+
+/*
+  Check if we are part way through a block sent as is, its bytes can
+  be spliced (the rest of a file in blocks has to be read).
+ */
+static int transfer_recv_stored(const transfer_recv *rx) {
+  return rx->block_have >= TRANSFER_BLOCK_HDR &&
+         rx->block_raw == rx->block_enc;
+}
+
+/*
+  Take the next bytes of a file in blocks, they never go past the
+  end of the current block (see transfer_recv_want).
+ */
+static int transfer_recv_block(transfer_recv *rx, const char *buf,
+                               size_t len) {
+  while (len) {
+    if (rx->block_have < TRANSFER_BLOCK_HDR) {
+      size_t want = TRANSFER_BLOCK_HDR - rx->block_have;
+      if (want > len) want = len;
+      memcpy(rx->block_hdr + rx->block_have, buf, want);
+      rx->block_have += want;
+      buf += want;
+      len -= want;
+      if (rx->block_have < TRANSFER_BLOCK_HDR) return 0;
+
+      rx->block_raw = transfer_get32(rx->block_hdr);
+      rx->block_enc = transfer_get32(rx->block_hdr + 4);
+      rx->block_crc = transfer_get32(rx->block_hdr + 8);
+      rx->block_sum = 0;
+      int stored = rx->block_raw == rx->block_enc;
+      if (!rx->block_raw || rx->block_raw > rx->size - rx->received ||
+          (!stored && (rx->block_raw > TRANSFER_LZ_BLOCK ||
+                       rx->block_enc > rx->block_raw))) {
+        return -1;
+      }
+      continue;
+    }
+
+    size_t got = rx->block_have - TRANSFER_BLOCK_HDR;
+    size_t want = rx->block_enc - got;
+    if (want > len) want = len;
+
+    if (rx->block_raw == rx->block_enc) {
+      // stored as is, it can go straight into the file
+      if (transfer_recv_pwrite(rx, buf, want, rx->received + got)) return -1;
+    } else if (!got && want == rx->block_enc) {
+      // the whole block is here, no need to copy it out first
+      if (transfer_recv_inflate(rx, buf)) return -1;
+    } else {
+      memcpy(rx->zbuf + got, buf, want);
+      if (got + want == rx->block_enc &&
+          transfer_recv_inflate(rx, rx->zbuf)) {
+        return -1;
+      }
+    }
+
+    if (transfer_recv_block_advance(rx, want)) return -1;
+    buf += want;
+    len -= want;
+  }
+  return 0;
+}
+
+int transfer_recv_write(transfer_recv *rx, const char *buf, size_t len) {
+  if (rx->blocks) return transfer_recv_block(rx, buf, len);
+  if (transfer_recv_pwrite(rx, buf, len, rx->received)) return -1;
+  rx->received += len;
+  return 0;
+}
+
+/*
+  Move everything sitting in the pipe into the file.
+ */
+static int transfer_recv_drain(transfer_recv *rx, size_t len) {
+  int64_t start = rx->received;
+  if (rx->blocks) start += rx->block_have - TRANSFER_BLOCK_HDR;
+
+  for (size_t done = 0; done < len;) {
+    loff_t offset = rx->offset + start + done;
+    ssize_t bytes = splice(rx->pipe[0], NULL, rx->fd, &offset, len - done,
+                           SPLICE_F_MOVE);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    done += bytes;
+  }
+
+  if (!rx->blocks) {
+    rx->received += len;
+    return 0;
+  }
+
+  return transfer_recv_block_advance(rx, len);
+}
+
+/*
+  The fallback when splicing isn't possible (or the file is in blocks),
+  read into a large page aligned buffer and write it out in one go.
+ */
+static int transfer_recv_buffered(transfer_recv *rx, int sock) {
+  if (!rx->buf && posix_memalign((void **)&rx->buf, TRANSFER_ALIGN,
+                                 TRANSFER_RECV_BUF)) {
+    rx->buf = NULL;
+    return -1;
+  }
+
+  int64_t until = rx->received + TRANSFER_RECV_BURST;
+  while (!transfer_recv_done(rx)) {
+    if (rx->received >= until) return 0;
+    ssize_t bytes = recv(sock, rx->buf,
+                         transfer_recv_want(rx, TRANSFER_RECV_BUF), 0);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (bytes == 0) return rx->size < 0 ? 1 : -1;
+    if (bytes < 0 || transfer_recv_write(rx, rx->buf, bytes)) return -1;
+  }
+  return 1;
+}
+
+int transfer_recv_socket(transfer_recv *rx, int sock) {
+  if (rx->pipe[0] == -1) return transfer_recv_buffered(rx, sock);
+
+  int64_t until = rx->received + TRANSFER_RECV_BURST;
+  while (!transfer_recv_done(rx)) {
+    // let the other connections (and the caller) have a turn
+    if (rx->received >= until) return 0;
+
+    // block headers and compressed blocks have to come through us
+    if (rx->blocks && !transfer_recv_stored(rx)) {
+      ssize_t bytes = recv(sock, rx->buf,
+                           transfer_recv_want(rx, TRANSFER_RECV_BUF), 0);
+      if (bytes < 0 && errno == EINTR) continue;
+      if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+      if (bytes <= 0 || transfer_recv_block(rx, rx->buf, bytes)) return -1;
+      continue;
+    }
+
+    ssize_t bytes = splice(sock, NULL, rx->pipe[1], NULL,
+                           transfer_recv_want(rx, TRANSFER_PIPE_SIZE),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (bytes < 0 && errno == EINVAL) {
+      // this socket / file can't be spliced
+      close(rx->pipe[0]);
+      close(rx->pipe[1]);
+      rx->pipe[0] = rx->pipe[1] = -1;
+      return transfer_recv_buffered(rx, sock);
+    }
+    if (bytes == 0) return rx->size < 0 ? 1 : -1;
+    if (bytes < 0 || transfer_recv_drain(rx, bytes)) return -1;
+  }
+  return 1;
+}
+
+int transfer_recv_finish(transfer_recv *rx) {
+  int err = 0;
+  if (rx->size >= 0 && rx->received != rx->size) err = -1;
+  // the data has to be on disk before the rename makes it visible
+  if (!err) err = fdatasync(rx->fd);
+
+  transfer_recv_release(rx);
+  if (!err) err = rename(rx->tmp_path, rx->path);
+  if (err) unlink(rx->tmp_path);
+  return err ? -1 : 0;
+}
+
+int transfer_recv_finish_range(transfer_recv *rx) {
+  int err = rx->received != rx->size;
+  transfer_recv_release(rx);
+  return err ? -1 : 0;
+}
+
+void transfer_recv_abort(transfer_recv *rx) {
+  transfer_recv_release(rx);
+  // a range leaves what it got for the download
+  if (rx->tmp_path[0]) unlink(rx->tmp_path);
+}
+
+static int transfer_range_cmp(const void *a, const void *b) {
+  const transfer_range *x = a, *y = b;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+  Work out what is still missing from a partial download using the
+  ranges it has marked as on disk.
+  Returns how many missing ranges there are or -1 if there is no
+  (usable) partial download.
+ */
+static int transfer_download_load(transfer_download *dl,
+                                  transfer_range *missing, int max) {
+  FILE *ranges = fopen(dl->ranges_path, "r");
+  if (!ranges) return -1;
+
+  transfer_range *done = malloc(TRANSFER_MAX_MARKS * sizeof(*done));
+  long long size = -1, offset, len;
+  int count = 0;
+  if (done && fscanf(ranges, "%lld", &size) == 1) {
+    while (count < TRANSFER_MAX_MARKS &&
+           fscanf(ranges, "%lld %lld", &offset, &len) == 2) {
+      done[count++] = (transfer_range){offset, len};
+    }
+  }
+  fclose(ranges);
+
+  // a different version of the file (or one that was never marked)
+  struct stat st;
+  if (!done || size != dl->size || stat(dl->tmp_path, &st)) {
+    free(done);
+    return -1;
+  }
+
+  // whatever the marks don't cover is what we still need
+  qsort(done, count, sizeof(*done), transfer_range_cmp);
+  int missing_count = 0;
+  int64_t at = 0;
+  for (int i = 0; i <= count && missing_count <= max; i++) {
+    int64_t next = i < count ? done[i].offset : dl->size;
+    if (next > dl->size) next = dl->size;
+    if (next > at) {
+      if (missing_count < max) {
+        missing[missing_count] = (transfer_range){at, next - at};
+      }
+      missing_count++;
+    }
+    if (i < count && done[i].offset + done[i].len > at) {
+      at = done[i].offset + done[i].len;
+    }
+  }
+  free(done);
+
+  // too broken up to be worth it
+  return missing_count > max ? -1 : missing_count;
+}
+
+int transfer_download_begin(transfer_download *dl, int file, const char *name,
+                            const char *path, int64_t size,
+                            transfer_range *missing, int max) {
+  *dl = (transfer_download){.file = file, .fd = -1, .size = size};
+  if (strlen(name) >= TRANSFER_PATH_LEN || strlen(path) >= TRANSFER_PATH_LEN ||
+      size < 0 || max < 1) {
+    return -1;
+  }
+
+  strcpy(dl->name, name);
+  strcpy(dl->path, path);
+  snprintf(dl->tmp_path, sizeof(dl->tmp_path), "%s%s", path,
+           TRANSFER_TMP_SUFFIX);
+  snprintf(dl->ranges_path, sizeof(dl->ranges_path), "%s%s", dl->tmp_path,
+           TRANSFER_RANGES_SUFFIX);
+
+  int count = transfer_download_load(dl, missing, max);
+  if (count >= 0) {
+    dl->fd = open(dl->tmp_path, O_RDWR | O_CLOEXEC);
+    if (dl->fd >= 0) {
+      dl->received = size;
+      for (int i = 0; i < count; i++) dl->received -= missing[i].len;
+      return count;
+    }
+  }
+
+  // nothing to pick up from, start with an empty file and no marks
+  dl->fd = transfer_open_tmp(path, dl->tmp_path, sizeof(dl->tmp_path), size);
+  if (dl->fd < 0) return -1;
+
+  FILE *ranges = fopen(dl->ranges_path, "w");
+  int err = !ranges || fprintf(ranges, "%lld\n", (long long)size) < 0;
+  if (ranges) err |= fclose(ranges);
+  if (err) {
+    transfer_download_abort(dl);
+    return -1;
+  }
+
+  if (!size) return 0;
+  missing[0] = (transfer_range){0, size};
+  return 1;
+}
+
+int transfer_download_mark(transfer_download *dl, int64_t offset,
+                           int64_t len) {
+  // the bytes have to be on disk before we say they are
+  if (fdatasync(dl->fd)) return -1;
+
+  FILE *ranges = fopen(dl->ranges_path, "a");
+  if (!ranges) return -1;
+  int err = fprintf(ranges, "%lld %lld\n", (long long)offset,
+                    (long long)len) < 0 ||
+            fflush(ranges) || fdatasync(fileno(ranges));
+  err |= fclose(ranges);
+  return err ? -1 : 0;
+}
+
+int transfer_download_done(const transfer_download *dl) {
+  return dl->received == dl->size;
+}
+
+int transfer_download_finish(transfer_download *dl) {
+  int err = !transfer_download_done(dl) || fdatasync(dl->fd);
+  close(dl->fd);
+  dl->fd = -1;
+
+  if (!err) err = rename(dl->tmp_path, dl->path);
+  if (err) unlink(dl->tmp_path);
+  unlink(dl->ranges_path);
+  return err ? -1 : 0;
+}
+
+void transfer_download_suspend(transfer_download *dl) {
+  if (dl->fd != -1) close(dl->fd);
+  dl->fd = -1;
+}
+
+void transfer_download_abort(transfer_download *dl) {
+  transfer_download_suspend(dl);
+  unlink(dl->tmp_path);
+  unlink(dl->ranges_path);
+}
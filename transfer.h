@@ -0,0 +1,281 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_TRANSFER_H__
+#define __P2P_TRANSFER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+/**                                               **
+ * Streams files (or ranges of them) between peers *
+ * The file never passes through userspace, the    *
+ * kernel pushes it straight from the page cache   *
+ * and on the other end splices it from the socket *
+ * into the (preallocated) destination file.       *
+ * Unless it is compressed / checksummed, then it  *
+ * is read a block at a time on both ends.         *
+ **                                               **/
+
+// How much we hand to sendfile at once, large enough that the
+// syscall cost disappears but small enough to notice failures.
+#define TRANSFER_CHUNK (1 << 24)
+
+// Only used when sendfile can't be (i.e. odd filesystems)
+#define TRANSFER_COPY_BUF (1 << 16)
+
+// The pipe we splice through on receive, and the size of the
+// aligned buffer we fall back to if the socket can't be spliced.
+#define TRANSFER_PIPE_SIZE (1 << 20)
+#define TRANSFER_RECV_BUF (1 << 20)
+
+// The most we pull off a socket before returning to the caller
+#define TRANSFER_RECV_BURST (1 << 24)
+#define TRANSFER_ALIGN (4096)
+
+// The flags of a transfer header, with either of them the file
+// follows as blocks, each a 12 byte header (the raw len, encoded len
+// and CRC32C of the raw bytes, little endian) and then the block.
+// Blocks that didn't shrink (or with just TRANSFER_CHECKSUM every
+// block) are sent as is, encoded len == raw len.
+#define TRANSFER_COMPRESSED (1 << 0)
+#define TRANSFER_CHECKSUM (1 << 1)
+#define TRANSFER_BLOCKS (TRANSFER_COMPRESSED | TRANSFER_CHECKSUM)
+// the file is for the receiver's object cache, it doesn't change the
+// wire format
+#define TRANSFER_FILL (1 << 2)
+// the file is a key being handed to the receiver (it now holds it),
+// it doesn't change the wire format either
+#define TRANSFER_HANDOFF (1 << 3)
+#define TRANSFER_BLOCK_HDR (12)
+#define TRANSFER_LZ_BLOCK (1 << 16)
+
+// Blocks sent as is are at most this big, a corrupt one fails
+// the transfer (and is asked for again) this far in.
+#define TRANSFER_CRC_CHUNK (1 << 20)
+
+// After this many blocks in a row that don't compress (i.e. a pdf)
+// the rest of the file is sent as is, straight from the page cache.
+#define TRANSFER_LZ_GIVE_UP (8)
+
+// Files are received under this suffix and renamed once complete
+#define TRANSFER_TMP_SUFFIX ".part"
+
+#define TRANSFER_PATH_LEN (512)
+
+// Files at least this big are offered to the requester, which pulls
+// them as up to TRANSFER_SEGMENTS ranges over their own connections
+// (from every replica that has them).
+#define TRANSFER_SEGMENT_MIN (1 << 20)
+#define TRANSFER_SEGMENTS (4)
+
+// How many times a download asks again for a range that failed
+#define TRANSFER_RETRIES (3)
+
+// The ranges of a download that are on disk are listed next to it
+// (the size, then an offset and length per line) so it can pick up
+// where it left off. Past TRANSFER_MAX_MARKS we just start over.
+// A segment marks what it has every TRANSFER_MARK_EVERY bytes.
+#define TRANSFER_RANGES_SUFFIX ".ranges"
+#define TRANSFER_MARK_EVERY (1 << 26)
+#define TRANSFER_MAX_MARKS (1024)
+#define TRANSFER_MAX_MISSING (16)
+
+typedef struct transfer_range_t {
+  int64_t offset;
+  int64_t len;
+} transfer_range;
+
+/*
+  A file being pulled in segments, each segment is its own
+  transfer_recv writing its part of the temporary file.
+ */
+typedef struct transfer_download_t {
+  int file;
+  // which retrieve of the file this is, ranges of older ones are ignored
+  uint32_t id;
+  // what the holders call the file, and where we put it
+  char name[TRANSFER_PATH_LEN];
+  char path[TRANSFER_PATH_LEN];
+  char tmp_path[TRANSFER_PATH_LEN + sizeof(TRANSFER_TMP_SUFFIX)];
+  char ranges_path[TRANSFER_PATH_LEN + sizeof(TRANSFER_TMP_SUFFIX) +
+                   sizeof(TRANSFER_RANGES_SUFFIX)];
+  int fd;
+
+  int64_t size;
+  // including whatever an earlier attempt left us
+  int64_t received;
+
+  // the peer that offered the file, failed ranges go back to it
+  int holder;
+  int retries;
+  // the TCP_RETRIEVE flags every range is asked for with
+  int flags;
+} transfer_download;
+
+/*
+  An in progress receive of a single file.
+ */
+typedef struct transfer_recv_t {
+  // the temporary file we are writing into
+  // (tmp_path is empty for ranges, their download owns it)
+  int fd;
+  char path[TRANSFER_PATH_LEN];
+  char tmp_path[TRANSFER_PATH_LEN + sizeof(TRANSFER_TMP_SUFFIX)];
+
+  // where in the file we start, only ranges don't start at 0
+  int64_t offset;
+
+  // -1 if the sender didn't tell us (we read till they close)
+  int64_t size;
+  int64_t received;
+
+  // socket -> pipe -> file, -1 if we can't splice
+  int pipe[2];
+
+  // only allocated if we can't splice
+  char *buf;
+
+  // set if the file comes in blocks (and can't be spliced),
+  // have counts the bytes of the current block we've read (header too)
+  // and received only counts a block once its crc matches.
+  int blocks;
+  unsigned char block_hdr[TRANSFER_BLOCK_HDR];
+  uint32_t block_raw;
+  uint32_t block_enc;
+  uint32_t block_crc;
+  uint32_t block_sum;
+  size_t block_have;
+  // set if a block didn't match its crc
+  int corrupt;
+  // a compressed block and what it decompresses to
+  char *zbuf;
+} transfer_recv;
+
+/*
+  Stream the file at path to a peer as a TCP_TRANSFER of file,
+  name is what they save it as.
+  The transfer header carries the size so the receiver knows
+  exactly how many bytes follow, and the flags (TRANSFER_COMPRESSED
+  if we should compress it).
+
+  Returns the number of file bytes sent or -1.
+ */
+ssize_t transfer_send(int peer, int file, const char *path, const char *name,
+                      int flags);
+
+/*
+  transfer_send on a connection we already have (that more msgs
+  follow on), sock is left open.
+ */
+ssize_t transfer_send_on(int sock, int file, const char *path,
+                         const char *name, int flags);
+
+/*
+  Stream len bytes from offset of the file at path to a peer
+  as a TCP_TRANSFER_RANGE of file for their download id.
+
+  Returns the number of file bytes sent or -1.
+ */
+ssize_t transfer_send_range(int peer, int file, const char *path,
+                            int64_t offset, int64_t len, uint32_t id,
+                            int flags);
+
+/*
+  Start receiving size bytes (-1 if unknown) into path.
+  The data is written to a temporary file that is preallocated
+  and only renamed to path once every byte has landed.
+  flags are the ones of the transfer header.
+ */
+int transfer_recv_begin(transfer_recv *rx, const char *path, int64_t size,
+                        int flags);
+
+/*
+  Start receiving len bytes at offset of a download.
+ */
+int transfer_recv_begin_range(transfer_recv *rx, const transfer_download *dl,
+                              int64_t offset, int64_t len, int flags);
+
+/*
+  How many more bytes the receive wants off the connection
+  (only as far as the current block if it is in blocks), capped at cap.
+ */
+size_t transfer_recv_want(const transfer_recv *rx, size_t cap);
+
+/*
+  Write bytes we already pulled off the socket (i.e. the ones that
+  were read along with the header), decompressing and checking
+  them if need be.  Returns -1 on failure.
+ */
+int transfer_recv_write(transfer_recv *rx, const char *buf, size_t len);
+
+/*
+  Pull as much of the file as we can (up to TRANSFER_RECV_BURST bytes)
+  from a non blocking socket.
+  Returns 1 once the file is complete, 0 if the socket would block
+  (or we hit the burst) and -1 on failure (or if the sender closed early).
+ */
+int transfer_recv_socket(transfer_recv *rx, int sock);
+
+/*
+  Check if every byte has arrived.
+ */
+int transfer_recv_done(const transfer_recv *rx);
+
+/*
+  Flush and atomically rename the completed file into place.
+ */
+int transfer_recv_finish(transfer_recv *rx);
+
+/*
+  Close a range, returns -1 if it is missing bytes (the ones
+  received are still in the download).
+ */
+int transfer_recv_finish_range(transfer_recv *rx);
+
+/*
+  Throw away a partial receive.
+ */
+void transfer_recv_abort(transfer_recv *rx);
+
+/*
+  Start a segmented download of the holders' name into path, picking up
+  a partial download of the same size if there is one.
+  Fills missing with the (at most max) ranges we still need.
+  Returns how many there are or -1.
+ */
+int transfer_download_begin(transfer_download *dl, int file, const char *name,
+                            const char *path, int64_t size,
+                            transfer_range *missing, int max);
+
+/*
+  Record that len bytes from offset are in the file (once they are
+  on disk), a later attempt won't ask for them again.
+ */
+int transfer_download_mark(transfer_download *dl, int64_t offset,
+                           int64_t len);
+
+/*
+  Check if every segment has arrived.
+ */
+int transfer_download_done(const transfer_download *dl);
+
+/*
+  Flush and atomically rename the completed download into place.
+ */
+int transfer_download_finish(transfer_download *dl);
+
+/*
+  Stop a download but keep what we have so it can be resumed.
+ */
+void transfer_download_suspend(transfer_download *dl);
+
+/*
+  Throw away a partial download.
+ */
+void transfer_download_abort(transfer_download *dl);
+
+#endif
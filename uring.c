@@ -0,0 +1,247 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "p2p_node.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait,
+                       unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, const void *arg,
+                          unsigned count) {
+  return syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+/*
+  Map the rings and register the buffers / file slots.
+ */
+static int uring_map(uring *ring, const struct io_uring_params *p) {
+  ring->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  ring->cq_map_len = p->cq_off.cqes +
+                     p->cq_entries * sizeof(struct io_uring_cqe);
+  // both rings share one map if the kernel can
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_len > ring->sq_map_len) {
+      ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->cq_map_len = 0;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) return -1;
+
+  if (ring->cq_map_len) {
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) return -1;
+  } else {
+    ring->cq_map = ring->sq_map;
+  }
+
+  ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) return -1;
+
+  char *sq = ring->sq_map, *cq = ring->cq_map;
+  ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+  ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+  // the kernel pins these once rather than on every read
+  ring->bufs = mmap(NULL, (size_t)URING_BUFS * URING_BUF_LEN,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->bufs == MAP_FAILED) {
+    ring->bufs = NULL;
+    return -1;
+  }
+  struct iovec iovs[URING_BUFS];
+  for (int i = 0; i < URING_BUFS; i++) {
+    iovs[i] = (struct iovec){uring_buf(ring, i), URING_BUF_LEN};
+  }
+  if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, URING_BUFS)) {
+    return -1;
+  }
+
+  int fds[URING_FILES];
+  for (int i = 0; i < URING_FILES; i++) fds[i] = -1;
+  return uring_register(ring->fd, IORING_REGISTER_FILES, fds, URING_FILES);
+}
+
+int uring_init(uring *ring, unsigned entries) {
+  *ring = (uring){
+    .fd = -1, .sq_map = MAP_FAILED, .cq_map = MAP_FAILED,
+    .sqes = MAP_FAILED,
+  };
+
+  struct io_uring_params params = {0};
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0 || uring_map(ring, &params)) {
+    uring_free(ring);
+    return -1;
+  }
+  return 0;
+}
+
+void uring_free(uring *ring) {
+  if (ring->bufs) munmap(ring->bufs, (size_t)URING_BUFS * URING_BUF_LEN);
+  if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_len);
+  }
+  if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_len);
+  if (ring->fd >= 0) close(ring->fd);
+  *ring = (uring){.fd = -1};
+}
+
+int uring_supported(void) {
+  uring ring;
+  if (uring_init(&ring, 1)) return 0;
+  uring_free(&ring);
+  return 1;
+}
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local uring *thread_ring;
+static _Thread_local int thread_ring_failed;
+
+static void uring_thread_free(void *ring) {
+  uring_free(ring);
+  free(ring);
+}
+
+static void uring_key_init(void) {
+  pthread_key_create(&uring_key, uring_thread_free);
+}
+
+uring *uring_thread(void) {
+  p2p_node *node = p2p_node_current();
+  if (!node || !node->config.io_uring || thread_ring_failed) return NULL;
+  if (thread_ring) return thread_ring;
+
+  pthread_once(&uring_key_once, uring_key_init);
+  uring *ring = malloc(sizeof(*ring));
+  if (!ring || uring_init(ring, URING_ENTRIES)) {
+    // don't keep trying on every transfer
+    free(ring);
+    thread_ring_failed = 1;
+    return NULL;
+  }
+  pthread_setspecific(uring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+/*
+  Cancel everything the ring has in flight and wait for it to land, so
+  nothing can touch the buffers once they are unmapped.  Returns -1 if
+  the kernel won't even let us wait.
+ */
+static int uring_drain(uring *ring) {
+  // whatever is queued but not taken is simply never submitted
+  ring->queued = 0;
+  struct io_uring_sqe *sqe = ring->inflight ? uring_get_sqe(ring) : NULL;
+  if (sqe) {
+    // older kernels turn the flag down, we just wait the rest out
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = UINT64_MAX;
+  }
+
+  struct io_uring_cqe cqe;
+  while (ring->inflight || ring->queued || ring->unsubmitted) {
+    if (uring_submit(ring, ring->inflight ? 1 : 0)) return -1;
+    while (uring_peek(ring, &cqe)) {}
+  }
+  return 0;
+}
+
+void uring_thread_drop(void) {
+  if (!thread_ring) return;
+  pthread_setspecific(uring_key, NULL);
+  // if we can't wait, reads only ever land in the pages the kernel
+  // pinned and a send to an unmapped buffer just fails
+  uring_drain(thread_ring);
+  uring_thread_free(thread_ring);
+  thread_ring = NULL;
+  thread_ring_failed = 1;
+}
+
+int uring_set_files(uring *ring, const int *fds, int count) {
+  struct io_uring_files_update update = {
+    .offset = 0, .fds = (uintptr_t)fds,
+  };
+  int ret = uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update,
+                           count);
+  return ret == count ? 0 : -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->queued;
+  if (tail - head > *ring->sq_mask) return NULL;
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->queued++;
+  return sqe;
+}
+
+int uring_submit(uring *ring, unsigned wait) {
+  if (ring->queued) {
+    // the kernel only sees the sqes once the tail moves past them
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued,
+                     __ATOMIC_RELEASE);
+    ring->unsubmitted += ring->queued;
+    ring->queued = 0;
+  }
+  if (!ring->unsubmitted && !wait) return 0;
+
+  while (1) {
+    int ret = uring_enter(ring->fd, ring->unsubmitted, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+      // whatever it didn't take is asked for again next time
+      unsigned taken = (unsigned)ret < ring->unsubmitted ?
+                       (unsigned)ret : ring->unsubmitted;
+      ring->unsubmitted -= taken;
+      ring->inflight += taken;
+      return 0;
+    }
+    // the kernel skips sqes it already took, so just ask again
+    if (errno != EINTR) return -1;
+  }
+}
+
+int uring_peek(uring *ring, struct io_uring_cqe *cqe) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+  *cqe = ring->cqes[head & *ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  if (ring->inflight) ring->inflight--;
+  return 1;
+}
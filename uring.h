@@ -0,0 +1,164 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_URING_H__
+#define __P2P_URING_H__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**                                                      **
+ * Just enough io_uring (straight on the syscalls, there  *
+ * is no liburing to lean on) to batch the reads and      *
+ * sends of a transfer into one io_uring_enter.           *
+ *                                                        *
+ * Every thread that wants one gets its own ring, with a  *
+ * few registered buffers and fixed file slots, set up    *
+ * the first time and freed when the thread exits.  If    *
+ * the kernel won't give us a ring (too old, or disabled) *
+ * the callers fall back to the plain syscalls.           *
+ *                                                        *
+ * Only compressed sends go through it, which comes out   *
+ * about even with the plain syscalls, so only the bench  *
+ * turns it on (p2p_bench --io-uring) till accepts, recvs *
+ * and the .part writes do as well.                       *
+ **                                                      **/
+
+// Must be a power of 2
+#define URING_ENTRIES (16)
+
+// The buffers registered with every ring, big enough for a
+// transfer block and its header
+#define URING_BUFS (4)
+#define URING_BUF_LEN (128 << 10)
+
+// Fixed file slots, -1 when they aren't in use
+#define URING_FILES (2)
+
+typedef struct uring_t {
+  int fd;
+
+  // the submission queue, shared with the kernel
+  void *sq_map;
+  size_t sq_map_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  // sqes filled in but not submitted yet
+  unsigned queued;
+  // sqes past the tail the kernel hasn't taken yet (it took fewer
+  // than we asked, or turned the enter down), they go with the next
+  unsigned unsubmitted;
+  // sqes the kernel took whose completions we haven't seen
+  unsigned inflight;
+
+  // the completion queue, in the same map as the sq on newer kernels
+  void *cq_map;
+  size_t cq_map_len;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // URING_BUFS registered buffers of URING_BUF_LEN
+  char *bufs;
+} uring;
+
+/*
+  Set up a ring with its buffers and file slots registered.
+  Returns -1 if the kernel won't give us one.
+ */
+int uring_init(uring *ring, unsigned entries);
+
+/*
+  Tear down a ring, nothing can be in flight.
+ */
+void uring_free(uring *ring);
+
+/*
+  Check if the kernel will give us a ring at all.
+ */
+int uring_supported(void);
+
+/*
+  This thread's ring if the node it works for wants io_uring,
+  NULL if it doesn't or we couldn't get one.
+ */
+uring *uring_thread(void);
+
+/*
+  Give up on this thread's ring after it failed us, whatever it still
+  has in flight is cancelled and waited out before it (and its
+  buffers) are freed.  The thread uses the plain syscalls from then on.
+ */
+void uring_thread_drop(void);
+
+/*
+  Registered buffer i (of URING_BUFS).
+ */
+static inline char *uring_buf(uring *ring, int i) {
+  return ring->bufs + (size_t)i * URING_BUF_LEN;
+}
+
+/*
+  Point the fixed file slots at fds (-1 to empty a slot), the kernel
+  holds a reference to them till they are emptied again.
+ */
+int uring_set_files(uring *ring, const int *fds, int count);
+
+/*
+  The next free sqe (zeroed), NULL if URING_ENTRIES are already queued.
+ */
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+
+/*
+  Submit everything queued and wait for at least wait completions.
+  Returns -1 on failure, with errno EAGAIN / EBUSY the completion queue
+  is full (or the kernel is short on memory) and the completions have
+  to be taken before submitting again, nothing queued is lost.
+ */
+int uring_submit(uring *ring, unsigned wait);
+
+/*
+  Take the next completion, returns 0 if there isn't one.
+ */
+int uring_peek(uring *ring, struct io_uring_cqe *cqe);
+
+/*
+  Read len bytes at offset of the file in slot into registered buffer
+  buf_index (buf has to be inside it).
+ */
+static inline void uring_prep_read_fixed(struct io_uring_sqe *sqe, int slot,
+                                         char *buf, size_t len, int64_t offset,
+                                         int buf_index, uint64_t user_data) {
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = slot;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = buf_index;
+  sqe->user_data = user_data;
+}
+
+/*
+  send() on the socket in slot.
+ */
+static inline void uring_prep_send(struct io_uring_sqe *sqe, int slot,
+                                   const char *buf, size_t len, int flags,
+                                   uint64_t user_data) {
+  sqe->opcode = IORING_OP_SEND;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = slot;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->msg_flags = flags;
+  sqe->user_data = user_data;
+}
+
+#endif
@@ -6,6 +6,7 @@
 #define __P2P_UTILS_H__
 
 #include <pthread.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 
 /**                                                     **
@@ -22,8 +23,6 @@
   to if you had inserted the calls at each return callsite.
 */
 
-#define PEER_HASH(x) ((x % 256))
-
 #define _CONCAT(t1, t2) t1 ## t2
 #define CONCAT(t1, t2) _CONCAT(t1, t2)
 
@@ -118,6 +117,19 @@ inline void cleanup_call(cleanup_callback *cleanup) {
 #define SCOPED_FILE(name, path, mode) \
   SCOPED_WITH(FILE *, name, fopen, fclose, path, mode)
 
+/*
+  A fast well distributed 64 bit mix (the splitmix64 finaliser).
+  Keys and peer ids are often sequential so always spread them out.
+ */
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
 void set_sockaddr(struct sockaddr_in *sock, char *ip, int port);
 
 /*
@@ -0,0 +1,208 @@
+#include "work_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "p2p_node.h"
+
+// the pool this thread is a worker of (and which deque is its own)
+static _Thread_local work_pool *worker_pool;
+static _Thread_local int worker_index;
+
+/*
+  The pool of the node this thread works for.
+ */
+static inline work_pool *work_pool_self(void) {
+  return &p2p_node_current()->workers;
+}
+
+void work_pool_state_init(work_pool *pool, int workers) {
+  if (workers <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cores > 0 ? cores : 1;
+  }
+  if (workers > WORK_POOL_MAX_WORKERS) workers = WORK_POOL_MAX_WORKERS;
+
+  pool->worker_count = workers;
+  pool->started = 0;
+  pool->deques = NULL;
+  pool->threads = NULL;
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->sleeping, 0);
+  atomic_init(&pool->next, 0);
+  atomic_init(&pool->joined, 0);
+  pool->stopping = 0;
+  pthread_mutex_init(&pool->idle_lock, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+}
+
+/*
+  Free the deques (nothing can be using them).
+ */
+static void work_pool_release(work_pool *pool) {
+  if (pool->deques) {
+    for (int i = 0; i < pool->worker_count; i++) {
+      pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+  }
+  free(pool->deques);
+  free(pool->threads);
+  pool->deques = NULL;
+  pool->threads = NULL;
+  pool->started = 0;
+}
+
+void work_pool_state_free(work_pool *pool) {
+  work_pool_release(pool);
+  pthread_cond_destroy(&pool->idle);
+  pthread_mutex_destroy(&pool->idle_lock);
+}
+
+static int work_deque_push(work_deque *dq, work_task task) {
+  SCOPED_MTX_LOCK(&dq->lock) {
+    if (dq->bottom - dq->top == WORK_POOL_DEQUE_LEN) return 0;
+    dq->tasks[dq->bottom++ & (WORK_POOL_DEQUE_LEN - 1)] = task;
+  }
+  return 1;
+}
+
+/*
+  The newest task, for the deque's own worker.
+ */
+static int work_deque_pop(work_deque *dq, work_task *task) {
+  SCOPED_MTX_LOCK(&dq->lock) {
+    if (dq->bottom == dq->top) return 0;
+    *task = dq->tasks[--dq->bottom & (WORK_POOL_DEQUE_LEN - 1)];
+  }
+  return 1;
+}
+
+/*
+  The oldest task, for every other worker.
+ */
+static int work_deque_steal(work_deque *dq, work_task *task) {
+  SCOPED_MTX_LOCK(&dq->lock) {
+    if (dq->bottom == dq->top) return 0;
+    *task = dq->tasks[dq->top++ & (WORK_POOL_DEQUE_LEN - 1)];
+  }
+  return 1;
+}
+
+/*
+  Take a task from our own deque, or failing that from the next
+  worker along that has one.
+ */
+static int work_pool_take(work_pool *pool, int self, work_task *task,
+                          int *stolen) {
+  *stolen = 0;
+  if (work_deque_pop(&pool->deques[self], task)) return 1;
+
+  *stolen = 1;
+  for (int i = 1; i < pool->worker_count; i++) {
+    int victim = (self + i) % pool->worker_count;
+    if (work_deque_steal(&pool->deques[victim], task)) return 1;
+  }
+  return 0;
+}
+
+static void *work_pool_worker(void *arg) {
+  p2p_node_enter(arg);
+  work_pool *pool = work_pool_self();
+  worker_pool = pool;
+  worker_index = atomic_fetch_add(&pool->joined, 1);
+
+  for (;;) {
+    work_task task;
+    int stolen;
+    if (work_pool_take(pool, worker_index, &task, &stolen)) {
+      atomic_fetch_sub(&pool->queued, 1);
+      task.fn(task.arg);
+      stats_task_ran(stolen);
+      continue;
+    }
+
+    // nothing anywhere, sleep till a submit (or stop) wakes us
+    int stop = 0;
+    SCOPED_MTX_LOCK(&pool->idle_lock) {
+      atomic_fetch_add(&pool->sleeping, 1);
+      while (atomic_load(&pool->queued) <= 0 && !pool->stopping) {
+        pthread_cond_wait(&pool->idle, &pool->idle_lock);
+      }
+      atomic_fetch_sub(&pool->sleeping, 1);
+      // everything queued is run before we go
+      stop = pool->stopping && atomic_load(&pool->queued) <= 0;
+    }
+    if (stop) break;
+  }
+
+  return NULL;
+}
+
+int work_pool_start(void) {
+  p2p_node *node = p2p_node_current();
+  work_pool *pool = &node->workers;
+  if (pool->deques) return 0;
+
+  pool->deques = calloc(pool->worker_count, sizeof(*pool->deques));
+  pool->threads = calloc(pool->worker_count, sizeof(*pool->threads));
+  if (!pool->deques || !pool->threads) {
+    work_pool_release(pool);
+    return -1;
+  }
+  for (int i = 0; i < pool->worker_count; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  }
+  pool->stopping = 0;
+  atomic_store(&pool->joined, 0);
+
+  // the deques of workers that didn't start are still stolen from
+  while (pool->started < pool->worker_count &&
+         !pthread_create(&pool->threads[pool->started], NULL,
+                         work_pool_worker, node)) {
+    pool->started++;
+  }
+  if (!pool->started) {
+    work_pool_release(pool);
+    return -1;
+  }
+  return 0;
+}
+
+void work_pool_stop(work_pool *pool) {
+  if (!pool->deques) return;
+
+  SCOPED_MTX_LOCK(&pool->idle_lock) {
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->idle);
+  }
+  for (int i = 0; i < pool->started; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  work_pool_release(pool);
+}
+
+void work_submit(work_fn fn, void *arg) {
+  work_pool *pool = work_pool_self();
+  if (pool->deques) {
+    // a worker keeps what it submits (it is still warm), anyone else
+    // spreads them over every worker
+    uint32_t start = worker_pool == pool ? (uint32_t)worker_index :
+                     atomic_fetch_add(&pool->next, 1);
+    // counted first so a worker can't go to sleep on it
+    atomic_fetch_add(&pool->queued, 1);
+    for (int i = 0; i < pool->worker_count; i++) {
+      work_deque *dq = &pool->deques[(start + i) % pool->worker_count];
+      if (!work_deque_push(dq, (work_task){fn, arg})) continue;
+
+      if (atomic_load(&pool->sleeping)) {
+        SCOPED_MTX_LOCK(&pool->idle_lock) pthread_cond_signal(&pool->idle);
+      }
+      return;
+    }
+    atomic_fetch_sub(&pool->queued, 1);
+    stats_task_inline();
+  }
+
+  fn(arg);
+}
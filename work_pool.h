@@ -0,0 +1,97 @@
+/*
+  Author: Braedon Wooding (z5204996)
+ */
+
+#ifndef __P2P_WORK_POOL_H__
+#define __P2P_WORK_POOL_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/**                                                     **
+ * A fixed set of workers (one per core by default) the  *
+ * slow parts of handling a msg are handed to, sending   *
+ * files and working through batches, so the reactor     *
+ * threads only ever wait on sockets.                    *
+ *                                                       *
+ * Every worker has a bounded deque of its own, it takes *
+ * the newest task (what it just queued is still warm)   *
+ * and once it runs dry steals the oldest task of one of *
+ * the others.  When every deque is full the submitter   *
+ * runs the task itself, which also slows it down.       *
+ **                                                     **/
+
+#define WORK_POOL_MAX_WORKERS (64)
+// Must be a power of 2
+#define WORK_POOL_DEQUE_LEN (256)
+
+/*
+  A task, it owns arg (and frees it if it has to).
+ */
+typedef void (*work_fn)(void *arg);
+
+typedef struct work_task_t {
+  work_fn fn;
+  void *arg;
+} work_task;
+
+typedef struct work_deque_t {
+  work_task tasks[WORK_POOL_DEQUE_LEN];
+  // thieves take from the top, the owner pushes / pops the bottom
+  uint32_t top;
+  uint32_t bottom;
+  pthread_mutex_t lock;
+} work_deque;
+
+typedef struct work_pool_t {
+  int worker_count;
+  // threads that are actually running
+  int started;
+  // worker_count of each, NULL till the pool is started
+  work_deque *deques;
+  pthread_t *threads;
+
+  // tasks sitting in a deque, idle workers sleep till there are some
+  _Atomic int queued;
+  _Atomic int sleeping;
+  // where submits from outside the pool go next
+  _Atomic uint32_t next;
+  // workers that have picked their deque
+  _Atomic int joined;
+
+  int stopping;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle;
+} work_pool;
+
+/*
+  Set up a pool of workers (0 for one per core), nothing runs yet.
+ */
+void work_pool_state_init(work_pool *pool, int workers);
+
+/*
+  Free a (stopped) pool.
+ */
+void work_pool_state_free(work_pool *pool);
+
+/*
+  Start the workers of the node this thread works for.
+  Returns -1 if they couldn't all be started.
+ */
+int work_pool_start(void);
+
+/*
+  Let the workers finish everything queued and reap them.
+ */
+void work_pool_stop(work_pool *pool);
+
+/*
+  Run fn(arg) on one of the workers, or right here if the pool
+  isn't running or is full.
+ */
+void work_submit(work_fn fn, void *arg);
+
+#endif